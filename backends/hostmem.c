@@ -14,6 +14,7 @@
 #include "qapi/visitor.h"
 #include "qapi-types.h"
 #include "qapi-visit.h"
+#include "qapi-event.h"
 #include "qemu/config-file.h"
 #include "qom/object_interfaces.h"
 
@@ -185,6 +186,68 @@ static void host_memory_backend_set_dump(Object *obj, bool value, Error **errp)
     }
 }
 
+static void
+host_memory_backend_get_prealloc_threads(Object *obj, Visitor *v,
+                                         void *opaque, const char *name,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    visit_type_uint32(v, &backend->prealloc_threads, name, errp);
+}
+
+static void
+host_memory_backend_set_prealloc_threads(Object *obj, Visitor *v,
+                                         void *opaque, const char *name,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, &value, name, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (value > MEM_PREALLOC_MAX_THREADS * MAX_NODES) {
+        error_setg(&local_err, "Property '%s.%s' doesn't take value '%"
+                   PRIu32 "' (maximum: %d)", object_get_typename(obj), name,
+                   value, MEM_PREALLOC_MAX_THREADS * MAX_NODES);
+        goto out;
+    }
+    backend->prealloc_threads = value;
+out:
+    error_propagate(errp, local_err);
+}
+
+static void host_memory_backend_prealloc_progress(void *opaque, size_t done,
+                                                  size_t total)
+{
+    HostMemoryBackend *backend = opaque;
+    char *id = object_get_canonical_path_component(OBJECT(backend));
+
+    if (id) {
+        qapi_event_send_mem_prealloc_progress(id, done, total, &error_abort);
+        g_free(id);
+    }
+}
+
+/* Threads go to the CPUs of the nodes the memory is bound to */
+static void host_memory_backend_prealloc(HostMemoryBackend *backend,
+                                         void *ptr, uint64_t sz)
+{
+    Object *obj = OBJECT(backend);
+    /* memory-backend-file,share=on */
+    bool shared = object_property_find(obj, "share", NULL) &&
+                  object_property_get_bool(obj, "share", &error_abort);
+
+    os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz, shared,
+                    backend->prealloc_threads,
+                    backend->policy != HOST_MEM_POLICY_DEFAULT ?
+                    backend->host_nodes : NULL,
+                    host_memory_backend_prealloc_progress, backend);
+}
+
 static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -211,11 +274,10 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
     }
 
     if (value && !backend->prealloc) {
-        int fd = memory_region_get_fd(&backend->mr);
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
 
-        os_mem_prealloc(fd, ptr, sz);
+        host_memory_backend_prealloc(backend, ptr, sz);
         backend->prealloc = true;
     }
 }
@@ -238,6 +300,10 @@ static void host_memory_backend_init(Object *obj)
     object_property_add_bool(obj, "prealloc",
                         host_memory_backend_get_prealloc,
                         host_memory_backend_set_prealloc, NULL);
+    object_property_add(obj, "prealloc-threads", "int",
+                        host_memory_backend_get_prealloc_threads,
+                        host_memory_backend_set_prealloc_threads,
+                        NULL, NULL, NULL);
     object_property_add(obj, "size", "int",
                         host_memory_backend_get_size,
                         host_memory_backend_set_size, NULL, NULL, NULL);
@@ -323,7 +389,7 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          * specified NUMA policy in place.
          */
         if (backend->prealloc) {
-            os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz);
+            host_memory_backend_prealloc(backend, ptr, sz);
         }
     }
 }
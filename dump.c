@@ -25,6 +25,10 @@
 #include "qapi/error.h"
 #include "qapi/qmp/qerror.h"
 #include "qmp-commands.h"
+#include "qapi-event.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
+#include "qemu/error-report.h"
 
 #include <zlib.h>
 #ifdef CONFIG_LZO
@@ -70,6 +74,26 @@ uint64_t cpu_to_dump64(DumpState *s, uint64_t val)
     return val;
 }
 
+/*
+ * Pages of a kdump-compressed dump are compressed by a pool of threads,
+ * DUMP_CHUNK_PAGES consecutive dumpable pages at a time.  The dump thread
+ * writes the chunks back in order, so the file is the same whatever the
+ * number of threads.
+ */
+#define DUMP_CHUNK_PAGES    128
+#define DUMP_MAX_THREADS    16
+
+/* ELF dumps are written this much at a time */
+#define DUMP_ELF_WRITE_SIZE (1 << 20)
+
+/* There can only be one dump at a time, its progress is in here */
+static DumpState dump_state_global = { .status = DUMP_STATUS_NONE };
+
+bool dump_in_progress(void)
+{
+    return atomic_read(&dump_state_global.status) == DUMP_STATUS_ACTIVE;
+}
+
 static int dump_cleanup(DumpState *s)
 {
     guest_phys_blocks_free(&s->guest_phys_blocks);
@@ -82,12 +106,6 @@ static int dump_cleanup(DumpState *s)
     return 0;
 }
 
-static void dump_error(DumpState *s, const char *reason, Error **errp)
-{
-    dump_cleanup(s);
-    error_setg(errp, "%s", reason);
-}
-
 static int fd_write_vmcore(const void *buf, size_t size, void *opaque)
 {
     DumpState *s = opaque;
@@ -128,7 +146,7 @@ static void write_elf64_header(DumpState *s, Error **errp)
 
     ret = fd_write_vmcore(&elf_header, sizeof(elf_header), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write elf header", errp);
+        error_setg(errp, "dump: failed to write elf header");
     }
 }
 
@@ -159,7 +177,7 @@ static void write_elf32_header(DumpState *s, Error **errp)
 
     ret = fd_write_vmcore(&elf_header, sizeof(elf_header), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write elf header", errp);
+        error_setg(errp, "dump: failed to write elf header");
     }
 }
 
@@ -182,7 +200,7 @@ static void write_elf64_load(DumpState *s, MemoryMapping *memory_mapping,
 
     ret = fd_write_vmcore(&phdr, sizeof(Elf64_Phdr), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write program header table", errp);
+        error_setg(errp, "dump: failed to write program header table");
     }
 }
 
@@ -205,7 +223,7 @@ static void write_elf32_load(DumpState *s, MemoryMapping *memory_mapping,
 
     ret = fd_write_vmcore(&phdr, sizeof(Elf32_Phdr), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write program header table", errp);
+        error_setg(errp, "dump: failed to write program header table");
     }
 }
 
@@ -225,7 +243,7 @@ static void write_elf64_note(DumpState *s, Error **errp)
 
     ret = fd_write_vmcore(&phdr, sizeof(Elf64_Phdr), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write program header table", errp);
+        error_setg(errp, "dump: failed to write program header table");
     }
 }
 
@@ -245,7 +263,7 @@ static void write_elf64_notes(WriteCoreDumpFunction f, DumpState *s,
         id = cpu_index(cpu);
         ret = cpu_write_elf64_note(f, cpu, id, s);
         if (ret < 0) {
-            dump_error(s, "dump: failed to write elf notes", errp);
+            error_setg(errp, "dump: failed to write elf notes");
             return;
         }
     }
@@ -253,7 +271,7 @@ static void write_elf64_notes(WriteCoreDumpFunction f, DumpState *s,
     CPU_FOREACH(cpu) {
         ret = cpu_write_elf64_qemunote(f, cpu, s);
         if (ret < 0) {
-            dump_error(s, "dump: failed to write CPU status", errp);
+            error_setg(errp, "dump: failed to write CPU status");
             return;
         }
     }
@@ -275,7 +293,7 @@ static void write_elf32_note(DumpState *s, Error **errp)
 
     ret = fd_write_vmcore(&phdr, sizeof(Elf32_Phdr), s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write program header table", errp);
+        error_setg(errp, "dump: failed to write program header table");
     }
 }
 
@@ -290,7 +308,7 @@ static void write_elf32_notes(WriteCoreDumpFunction f, DumpState *s,
         id = cpu_index(cpu);
         ret = cpu_write_elf32_note(f, cpu, id, s);
         if (ret < 0) {
-            dump_error(s, "dump: failed to write elf notes", errp);
+            error_setg(errp, "dump: failed to write elf notes");
             return;
         }
     }
@@ -298,7 +316,7 @@ static void write_elf32_notes(WriteCoreDumpFunction f, DumpState *s,
     CPU_FOREACH(cpu) {
         ret = cpu_write_elf32_qemunote(f, cpu, s);
         if (ret < 0) {
-            dump_error(s, "dump: failed to write CPU status", errp);
+            error_setg(errp, "dump: failed to write CPU status");
             return;
         }
     }
@@ -326,7 +344,7 @@ static void write_elf_section(DumpState *s, int type, Error **errp)
 
     ret = fd_write_vmcore(&shdr, shdr_size, s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write section header table", errp);
+        error_setg(errp, "dump: failed to write section header table");
     }
 }
 
@@ -336,33 +354,25 @@ static void write_data(DumpState *s, void *buf, int length, Error **errp)
 
     ret = fd_write_vmcore(buf, length, s);
     if (ret < 0) {
-        dump_error(s, "dump: failed to save memory", errp);
+        error_setg(errp, "dump: failed to save memory");
     }
 }
 
-/* write the memory to vmcore. 1 page per I/O. */
+/* write the memory to vmcore. DUMP_ELF_WRITE_SIZE bytes per I/O. */
 static void write_memory(DumpState *s, GuestPhysBlock *block, ram_addr_t start,
                          int64_t size, Error **errp)
 {
-    int64_t i;
+    int64_t done, len;
     Error *local_err = NULL;
 
-    for (i = 0; i < size / TARGET_PAGE_SIZE; i++) {
-        write_data(s, block->host_addr + start + i * TARGET_PAGE_SIZE,
-                   TARGET_PAGE_SIZE, &local_err);
-        if (local_err) {
-            error_propagate(errp, local_err);
-            return;
-        }
-    }
-
-    if ((size % TARGET_PAGE_SIZE) != 0) {
-        write_data(s, block->host_addr + start + i * TARGET_PAGE_SIZE,
-                   size % TARGET_PAGE_SIZE, &local_err);
+    for (done = 0; done < size; done += len) {
+        len = MIN(size - done, DUMP_ELF_WRITE_SIZE);
+        write_data(s, block->host_addr + start + done, len, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
         }
+        s->written_size += len;
     }
 }
 
@@ -568,11 +578,6 @@ static void dump_begin(DumpState *s, Error **errp)
     }
 }
 
-static void dump_completed(DumpState *s)
-{
-    dump_cleanup(s);
-}
-
 static int get_next_block(DumpState *s, GuestPhysBlock *block)
 {
     while (1) {
@@ -624,8 +629,6 @@ static void dump_iterate(DumpState *s, Error **errp)
         }
 
     } while (!get_next_block(s, block));
-
-    dump_completed(s);
 }
 
 static void create_vmcore(DumpState *s, Error **errp)
@@ -765,7 +768,7 @@ static void create_header32(DumpState *s, Error **errp)
     dh->status = cpu_to_dump32(s, status);
 
     if (write_buffer(s->fd, 0, dh, size) < 0) {
-        dump_error(s, "dump: failed to write disk dump header", errp);
+        error_setg(errp, "dump: failed to write disk dump header");
         goto out;
     }
 
@@ -784,7 +787,7 @@ static void create_header32(DumpState *s, Error **errp)
 
     if (write_buffer(s->fd, DISKDUMP_HEADER_BLOCKS *
                      block_size, kh, size) < 0) {
-        dump_error(s, "dump: failed to write kdump sub header", errp);
+        error_setg(errp, "dump: failed to write kdump sub header");
         goto out;
     }
 
@@ -800,7 +803,7 @@ static void create_header32(DumpState *s, Error **errp)
     }
     if (write_buffer(s->fd, offset_note, s->note_buf,
                      s->note_size) < 0) {
-        dump_error(s, "dump: failed to write notes", errp);
+        error_setg(errp, "dump: failed to write notes");
         goto out;
     }
 
@@ -865,7 +868,7 @@ static void create_header64(DumpState *s, Error **errp)
     dh->status = cpu_to_dump32(s, status);
 
     if (write_buffer(s->fd, 0, dh, size) < 0) {
-        dump_error(s, "dump: failed to write disk dump header", errp);
+        error_setg(errp, "dump: failed to write disk dump header");
         goto out;
     }
 
@@ -884,7 +887,7 @@ static void create_header64(DumpState *s, Error **errp)
 
     if (write_buffer(s->fd, DISKDUMP_HEADER_BLOCKS *
                      block_size, kh, size) < 0) {
-        dump_error(s, "dump: failed to write kdump sub header", errp);
+        error_setg(errp, "dump: failed to write kdump sub header");
         goto out;
     }
 
@@ -901,7 +904,7 @@ static void create_header64(DumpState *s, Error **errp)
 
     if (write_buffer(s->fd, offset_note, s->note_buf,
                      s->note_size) < 0) {
-        dump_error(s, "dump: failed to write notes", errp);
+        error_setg(errp, "dump: failed to write notes");
         goto out;
     }
 
@@ -1064,7 +1067,7 @@ static void write_dump_bitmap(DumpState *s, Error **errp)
     while (get_next_page(&block_iter, &pfn, NULL, s)) {
         ret = set_dump_bitmap(last_pfn, pfn, true, dump_bitmap_buf, s);
         if (ret < 0) {
-            dump_error(s, "dump: failed to set dump_bitmap", errp);
+            error_setg(errp, "dump: failed to set dump_bitmap");
             goto out;
         }
 
@@ -1081,7 +1084,7 @@ static void write_dump_bitmap(DumpState *s, Error **errp)
         ret = set_dump_bitmap(last_pfn, last_pfn + PFN_BUFBITMAP, false,
                               dump_bitmap_buf, s);
         if (ret < 0) {
-            dump_error(s, "dump: failed to sync dump_bitmap", errp);
+            error_setg(errp, "dump: failed to sync dump_bitmap");
             goto out;
         }
     }
@@ -1170,20 +1173,257 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
+typedef struct DumpChunk {
+    int nr_pages;
+    uint8_t *pages[DUMP_CHUNK_PAGES];
+    /* compressed size of every page, 0 for a zero page */
+    size_t size[DUMP_CHUNK_PAGES];
+    uint32_t flags[DUMP_CHUNK_PAGES];
+    /* len_buf_out bytes for every page */
+    uint8_t *data;
+    bool done;
+} DumpChunk;
+
+typedef struct DumpCompressState {
+    uint32_t flag_compress;
+    size_t len_buf_out;
+    QemuMutex lock;
+    /* signalled for a new chunk, a compressed chunk and to quit */
+    QemuCond cond;
+    DumpChunk *chunks;
+    int nr_chunks;
+    /* chunks queued by the dump thread and taken by a compression thread */
+    uint64_t queued;
+    uint64_t taken;
+    bool quit;
+    QemuThread *threads;
+    int nr_threads;
+} DumpCompressState;
+
+static int dump_compress_threads(void)
+{
+    long n = 1;
+
+#ifdef _SC_NPROCESSORS_ONLN
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    return MAX(MIN(n, DUMP_MAX_THREADS), 1);
+}
+
+/*
+ * Compress a page into buf_out, and return the flags of its page descriptor.
+ * When compression fails to work, the page is left in plaintext and its
+ * flags are 0.
+ */
+static uint32_t dump_compress_page(DumpCompressState *cs, const uint8_t *buf,
+                                   uint8_t *buf_out, size_t *size_out,
+                                   void *wrkmem)
+{
+    /*
+     * only one compression format will be used here, for
+     * cs->flag_compress is set.
+     */
+    *size_out = cs->len_buf_out;
+    if ((cs->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+        (compress2(buf_out, (uLongf *)size_out, buf,
+                   TARGET_PAGE_SIZE, Z_BEST_SPEED) == Z_OK) &&
+        (*size_out < TARGET_PAGE_SIZE)) {
+        return DUMP_DH_COMPRESSED_ZLIB;
+    }
+#ifdef CONFIG_LZO
+    if ((cs->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+        (lzo1x_1_compress(buf, TARGET_PAGE_SIZE, buf_out,
+                          (lzo_uint *)size_out, wrkmem) == LZO_E_OK) &&
+        (*size_out < TARGET_PAGE_SIZE)) {
+        return DUMP_DH_COMPRESSED_LZO;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    if ((cs->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+        (snappy_compress((char *)buf, TARGET_PAGE_SIZE,
+                         (char *)buf_out, size_out) == SNAPPY_OK) &&
+        (*size_out < TARGET_PAGE_SIZE)) {
+        return DUMP_DH_COMPRESSED_SNAPPY;
+    }
+#endif
+    *size_out = TARGET_PAGE_SIZE;
+    return 0;
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompressState *cs = opaque;
+    DumpChunk *chunk;
+    void *wrkmem = NULL;
+    int i;
+
+#ifdef CONFIG_LZO
+    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+
+    qemu_mutex_lock(&cs->lock);
+    while (true) {
+        while (!cs->quit && cs->taken == cs->queued) {
+            qemu_cond_wait(&cs->cond, &cs->lock);
+        }
+        if (cs->quit) {
+            break;
+        }
+        chunk = &cs->chunks[cs->taken++ % cs->nr_chunks];
+        qemu_mutex_unlock(&cs->lock);
+
+        for (i = 0; i < chunk->nr_pages; i++) {
+            if (is_zero_page(chunk->pages[i], TARGET_PAGE_SIZE)) {
+                chunk->size[i] = 0;
+                continue;
+            }
+            chunk->flags[i] = dump_compress_page(cs, chunk->pages[i],
+                                                 chunk->data +
+                                                 i * cs->len_buf_out,
+                                                 &chunk->size[i], wrkmem);
+        }
+
+        qemu_mutex_lock(&cs->lock);
+        chunk->done = true;
+        qemu_cond_broadcast(&cs->cond);
+    }
+    qemu_mutex_unlock(&cs->lock);
+
+    g_free(wrkmem);
+    return NULL;
+}
+
+static void dump_compress_start(DumpCompressState *cs, DumpState *s,
+                                size_t len_buf_out)
+{
+    int i;
+
+    memset(cs, 0, sizeof(*cs));
+    cs->flag_compress = s->flag_compress;
+    cs->len_buf_out = len_buf_out;
+    qemu_mutex_init(&cs->lock);
+    qemu_cond_init(&cs->cond);
+
+    cs->nr_threads = dump_compress_threads();
+    /* let every thread have a chunk queued behind the one it works on */
+    cs->nr_chunks = cs->nr_threads * 2;
+    cs->chunks = g_new0(DumpChunk, cs->nr_chunks);
+    for (i = 0; i < cs->nr_chunks; i++) {
+        cs->chunks[i].data = g_malloc(DUMP_CHUNK_PAGES * len_buf_out);
+    }
+
+    cs->threads = g_new0(QemuThread, cs->nr_threads);
+    for (i = 0; i < cs->nr_threads; i++) {
+        qemu_thread_create(cs->threads + i, "dump_compress",
+                           dump_compress_thread, cs, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void dump_compress_stop(DumpCompressState *cs)
+{
+    int i;
+
+    qemu_mutex_lock(&cs->lock);
+    cs->quit = true;
+    qemu_cond_broadcast(&cs->cond);
+    qemu_mutex_unlock(&cs->lock);
+
+    for (i = 0; i < cs->nr_threads; i++) {
+        qemu_thread_join(cs->threads + i);
+    }
+    for (i = 0; i < cs->nr_chunks; i++) {
+        g_free(cs->chunks[i].data);
+    }
+    g_free(cs->threads);
+    g_free(cs->chunks);
+    qemu_cond_destroy(&cs->cond);
+    qemu_mutex_destroy(&cs->lock);
+}
+
+/*
+ * Fill the next free chunk with dumpable pages and hand it to the
+ * compression threads; return false if there were no pages left.
+ */
+static bool dump_queue_chunk(DumpCompressState *cs, DumpState *s,
+                             GuestPhysBlock **block_iter, uint64_t *pfn_iter)
+{
+    DumpChunk *chunk = &cs->chunks[cs->queued % cs->nr_chunks];
+    uint8_t *buf;
+
+    chunk->nr_pages = 0;
+    chunk->done = false;
+    while (chunk->nr_pages < DUMP_CHUNK_PAGES &&
+           get_next_page(block_iter, pfn_iter, &buf, s)) {
+        chunk->pages[chunk->nr_pages++] = buf;
+    }
+    if (!chunk->nr_pages) {
+        return false;
+    }
+
+    qemu_mutex_lock(&cs->lock);
+    cs->queued++;
+    qemu_cond_broadcast(&cs->cond);
+    qemu_mutex_unlock(&cs->lock);
+    return chunk->nr_pages == DUMP_CHUNK_PAGES;
+}
+
+/*
+ * Write the page descriptors and data of a compressed chunk.  Zero pages
+ * all use the page data of pd_zero.
+ */
+static int dump_write_chunk(DumpState *s, DumpChunk *chunk,
+                            size_t len_buf_out, DataCache *page_desc,
+                            DataCache *page_data, PageDescriptor *pd_zero,
+                            off_t *offset_data)
+{
+    PageDescriptor pd;
+    const uint8_t *buf;
+    int i;
+
+    for (i = 0; i < chunk->nr_pages; i++) {
+        if (!chunk->size[i]) {
+            if (write_cache(page_desc, pd_zero, sizeof(PageDescriptor),
+                            false) < 0) {
+                return -1;
+            }
+            s->written_size += TARGET_PAGE_SIZE;
+            continue;
+        }
+
+        buf = chunk->flags[i] ? chunk->data + i * len_buf_out
+                              : chunk->pages[i];
+        if (write_cache(page_data, buf, chunk->size[i], false) < 0) {
+            return -1;
+        }
+
+        pd.flags = cpu_to_dump32(s, chunk->flags[i]);
+        pd.size = cpu_to_dump32(s, chunk->size[i]);
+        pd.page_flags = cpu_to_dump64(s, 0);
+        pd.offset = cpu_to_dump64(s, *offset_data);
+        *offset_data += chunk->size[i];
+
+        if (write_cache(page_desc, &pd, sizeof(PageDescriptor), false) < 0) {
+            return -1;
+        }
+        s->written_size += TARGET_PAGE_SIZE;
+    }
+    return 0;
+}
+
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    DumpCompressState cs;
+    DumpChunk *chunk;
+    size_t len_buf_out;
     off_t offset_desc, offset_data;
-    PageDescriptor pd, pd_zero;
+    PageDescriptor pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    uint64_t written = 0;
+    bool more = true;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1196,12 +1436,6 @@ static void write_dump_pages(DumpState *s, Error **errp)
     len_buf_out = get_len_buf_out(TARGET_PAGE_SIZE, s->flag_compress);
     assert(len_buf_out != 0);
 
-#ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
-#endif
-
-    buf_out = g_malloc(len_buf_out);
-
     /*
      * init zero page's page_desc and page_data, because every zero page
      * uses the same page_data
@@ -1214,127 +1448,57 @@ static void write_dump_pages(DumpState *s, Error **errp)
     ret = write_cache(&page_data, buf, TARGET_PAGE_SIZE, false);
     g_free(buf);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write page data (zero page)", errp);
-        goto out;
+        error_setg(errp, "dump: failed to write page data (zero page)");
+        free_data_cache(&page_desc);
+        free_data_cache(&page_data);
+        return;
     }
 
     offset_data += TARGET_PAGE_SIZE;
 
     /*
-     * dump memory to vmcore page by page. zero page will all be resided in the
-     * first page of page section
+     * dump memory to vmcore chunk by chunk: keep all the chunks queued for
+     * compression, and write the oldest one as soon as it is compressed.
+     * zero page will all be resided in the first page of page section
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, TARGET_PAGE_SIZE)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                dump_error(s, "dump: failed to write page desc", errp);
-                goto out;
-            }
-        } else {
-            /*
-             * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
-             */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               TARGET_PAGE_SIZE, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < TARGET_PAGE_SIZE)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data", errp);
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, TARGET_PAGE_SIZE, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < TARGET_PAGE_SIZE)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data", errp);
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, TARGET_PAGE_SIZE,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < TARGET_PAGE_SIZE)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data", errp);
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned TARGET_PAGE_SIZE
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = TARGET_PAGE_SIZE;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf, TARGET_PAGE_SIZE, false);
-                if (ret < 0) {
-                    dump_error(s, "dump: failed to write page data", errp);
-                    goto out;
-                }
-            }
+    dump_compress_start(&cs, s, len_buf_out);
+    while (more || written < cs.queued) {
+        if (more && cs.queued - written < cs.nr_chunks) {
+            more = dump_queue_chunk(&cs, s, &block_iter, &pfn_iter);
+            continue;
+        }
 
-            /* get and write page desc here */
-            pd.page_flags = cpu_to_dump64(s, 0);
-            pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+        chunk = &cs.chunks[written % cs.nr_chunks];
+        qemu_mutex_lock(&cs.lock);
+        while (!chunk->done) {
+            qemu_cond_wait(&cs.cond, &cs.lock);
+        }
+        qemu_mutex_unlock(&cs.lock);
 
-            ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
-            if (ret < 0) {
-                dump_error(s, "dump: failed to write page desc", errp);
-                goto out;
-            }
+        ret = dump_write_chunk(s, chunk, len_buf_out, &page_desc, &page_data,
+                               &pd_zero, &offset_data);
+        if (ret < 0) {
+            error_setg(errp, "dump: failed to write page data");
+            goto out;
         }
+        written++;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
     if (ret < 0) {
-        dump_error(s, "dump: failed to sync cache for page_desc", errp);
+        error_setg(errp, "dump: failed to sync cache for page_desc");
         goto out;
     }
     ret = write_cache(&page_data, NULL, 0, true);
     if (ret < 0) {
-        dump_error(s, "dump: failed to sync cache for page_data", errp);
+        error_setg(errp, "dump: failed to sync cache for page_data");
         goto out;
     }
 
 out:
+    dump_compress_stop(&cs);
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
-
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
@@ -1366,7 +1530,7 @@ static void create_kdump_vmcore(DumpState *s, Error **errp)
 
     ret = write_start_flat_header(s->fd);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write start flat header", errp);
+        error_setg(errp, "dump: failed to write start flat header");
         return;
     }
 
@@ -1390,11 +1554,9 @@ static void create_kdump_vmcore(DumpState *s, Error **errp)
 
     ret = write_end_flat_header(s->fd);
     if (ret < 0) {
-        dump_error(s, "dump: failed to write end flat header", errp);
+        error_setg(errp, "dump: failed to write end flat header");
         return;
     }
-
-    dump_completed(s);
 }
 
 static ram_addr_t get_start_block(DumpState *s)
@@ -1433,6 +1595,26 @@ static void get_max_mapnr(DumpState *s)
     s->max_mapnr = paddr_to_pfn(last_block->target_end);
 }
 
+/* the amount of guest memory that goes into the dump */
+static int64_t dump_calculate_size(DumpState *s)
+{
+    GuestPhysBlock *block;
+    int64_t start, end, total = 0;
+
+    QTAILQ_FOREACH(block, &s->guest_phys_blocks.head, next) {
+        start = block->target_start;
+        end = block->target_end;
+        if (s->has_filter) {
+            start = MAX(start, s->begin);
+            end = MIN(end, s->begin + s->length);
+        }
+        if (end > start) {
+            total += end - start;
+        }
+    }
+    return total;
+}
+
 static void dump_init(DumpState *s, int fd, bool has_format,
                       DumpGuestMemoryFormat format, bool paging, bool has_filter,
                       int64_t begin, int64_t length, Error **errp)
@@ -1467,6 +1649,8 @@ static void dump_init(DumpState *s, int fd, bool has_format,
     s->has_filter = has_filter;
     s->begin = begin;
     s->length = length;
+    s->has_format = has_format;
+    s->format = format;
 
     memory_mapping_list_init(&s->list);
 
@@ -1508,6 +1692,7 @@ static void dump_init(DumpState *s, int fd, bool has_format,
     }
 
     s->nr_cpus = nr_cpus;
+    s->total_size = dump_calculate_size(s);
 
     get_max_mapnr(s);
 
@@ -1595,9 +1780,68 @@ cleanup:
     dump_cleanup(s);
 }
 
-void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
-                           int64_t begin, bool has_length,
-                           int64_t length, bool has_format,
+/* called with the iothread lock held, unless the dump is detached */
+static void dump_process(DumpState *s, Error **errp)
+{
+    Error *local_err = NULL;
+    DumpQueryResult *result;
+
+    if (s->has_format && s->format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
+        create_kdump_vmcore(s, &local_err);
+    } else {
+        create_vmcore(s, &local_err);
+    }
+
+    if (s->detached) {
+        qemu_mutex_lock_iothread();
+    }
+
+    /* make sure the status is written after written_size */
+    smp_wmb();
+    atomic_set(&s->status,
+               local_err ? DUMP_STATUS_FAILED : DUMP_STATUS_COMPLETED);
+
+    result = qmp_query_dump(&error_abort);
+    qapi_event_send_dump_completed(result, !!local_err,
+                                   local_err ? error_get_pretty(local_err)
+                                             : NULL,
+                                   &error_abort);
+    qapi_free_DumpQueryResult(result);
+
+    dump_cleanup(s);
+    if (s->detached) {
+        if (local_err) {
+            error_report("%s", error_get_pretty(local_err));
+        }
+        qemu_mutex_unlock_iothread();
+    }
+    error_propagate(errp, local_err);
+}
+
+static void *dump_thread(void *opaque)
+{
+    DumpState *s = opaque;
+
+    dump_process(s, NULL);
+    return NULL;
+}
+
+DumpQueryResult *qmp_query_dump(Error **errp)
+{
+    DumpQueryResult *result = g_new(DumpQueryResult, 1);
+    DumpState *s = &dump_state_global;
+
+    result->status = atomic_read(&s->status);
+    /* make sure we are reading the status and written_size in order */
+    smp_rmb();
+    result->completed = s->written_size;
+    result->total = s->total_size;
+    return result;
+}
+
+void qmp_dump_guest_memory(bool paging, const char *file, bool has_detach,
+                           bool detach, bool has_begin, int64_t begin,
+                           bool has_length, int64_t length, bool has_format,
                            DumpGuestMemoryFormat format, Error **errp)
 {
     const char *p;
@@ -1605,6 +1849,16 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
     DumpState *s;
     Error *local_err = NULL;
 
+    if (runstate_check(RUN_STATE_INMIGRATE)) {
+        error_setg(errp, "Dump not allowed during incoming migration");
+        return;
+    }
+
+    if (dump_in_progress()) {
+        error_setg(errp, "There is a dump in progress already");
+        return;
+    }
+
     /*
      * kdump-compressed format need the whole memory dumped, so paging or
      * filter is not supported here.
@@ -1661,23 +1915,25 @@ void qmp_dump_guest_memory(bool paging, const char *file, bool has_begin,
         return;
     }
 
-    s = g_malloc0(sizeof(DumpState));
+    s = &dump_state_global;
+    memset(s, 0, sizeof(*s));
+    s->status = DUMP_STATUS_ACTIVE;
 
     dump_init(s, fd, has_format, format, paging, has_begin,
               begin, length, &local_err);
     if (local_err) {
-        g_free(s);
+        atomic_set(&s->status, DUMP_STATUS_FAILED);
         error_propagate(errp, local_err);
         return;
     }
 
-    if (has_format && format != DUMP_GUEST_MEMORY_FORMAT_ELF) {
-        create_kdump_vmcore(s, errp);
+    if (has_detach && detach) {
+        s->detached = true;
+        qemu_thread_create(&s->dump_thread, "dump_thread", dump_thread, s,
+                           QEMU_THREAD_DETACHED);
     } else {
-        create_vmcore(s, errp);
+        dump_process(s, errp);
     }
-
-    g_free(s);
 }
 
 DumpGuestMemoryCapability *qmp_query_dump_guest_memory_capability(Error **errp)
@@ -28,6 +28,7 @@
 #include "hw/hw.h"
 #if !defined(CONFIG_USER_ONLY)
 #include "hw/boards.h"
+#include "qmp-commands.h"
 #endif
 #include "hw/qdev.h"
 #include "qemu/osdep.h"
@@ -135,21 +136,21 @@ typedef struct PhysPageMap {
     MemoryRegionSection *sections;
 } PhysPageMap;
 
+/* Owned by a FlatView, and shared by all address spaces that use it */
 struct AddressSpaceDispatch {
-    struct rcu_head rcu;
-
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
     PhysPageEntry phys_map;
     PhysPageMap map;
+    /* One of the address spaces using it (RCU); subpages forward through it */
     AddressSpace *as;
 };
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
     MemoryRegion iomem;
-    AddressSpace *as;
+    AddressSpaceDispatch *d;
     hwaddr base;
     uint16_t sub_section[TARGET_PAGE_SIZE];
 } subpage_t;
@@ -958,8 +959,9 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
                                               ram_addr_t length,
                                               unsigned client)
 {
-    unsigned long end, page;
-    bool dirty;
+    DirtyMemoryBlocks *blocks;
+    unsigned long end, page, idx, offset, num;
+    bool dirty = false;
 
     if (length == 0) {
         return false;
@@ -967,8 +969,19 @@ bool cpu_physical_memory_test_and_clear_dirty(ram_addr_t start,
 
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    dirty = bitmap_test_and_clear_atomic(ram_list.dirty_memory[client],
-                                         page, end - page);
+
+    rcu_read_lock();
+    blocks = atomic_rcu_read(&ram_list.dirty_memory[client]);
+    while (page < end) {
+        idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+        offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+        num = MIN(end - page, DIRTY_MEMORY_BLOCK_SIZE - offset);
+
+        dirty |= bitmap_test_and_clear_atomic(blocks->blocks[idx],
+                                              offset, num);
+        page += num;
+    }
+    rcu_read_unlock();
 
     if (dirty && tcg_enabled()) {
         tlb_reset_dirty_range_all(start, length);
@@ -998,9 +1011,11 @@ hwaddr memory_region_section_get_iotlb(CPUState *cpu,
             iotlb |= PHYS_SECTION_ROM;
         }
     } else {
-        AddressSpaceDispatch *d;
+        /* @section came from the CPU's dispatch, which address spaces
+         * with the same view share; its address_space is just one of them.
+         */
+        AddressSpaceDispatch *d = cpu->cpu_ases[0].memory_dispatch;
 
-        d = atomic_rcu_read(&section->address_space->dispatch);
         iotlb = section - d->map.sections;
         iotlb += xlat;
     }
@@ -1026,7 +1041,7 @@ hwaddr memory_region_section_get_iotlb(CPUState *cpu,
 
 static int subpage_register (subpage_t *mmio, uint32_t start, uint32_t end,
                              uint16_t section);
-static subpage_t *subpage_init(AddressSpace *as, hwaddr base);
+static subpage_t *subpage_init(AddressSpaceDispatch *d, hwaddr base);
 
 static void *(*phys_mem_alloc)(size_t size, uint64_t *align) =
                                qemu_anon_ram_alloc;
@@ -1097,7 +1112,7 @@ static void register_subpage(AddressSpaceDispatch *d, MemoryRegionSection *secti
     assert(existing->mr->subpage || existing->mr == &io_mem_unassigned);
 
     if (!(existing->mr->subpage)) {
-        subpage = subpage_init(d->as, base);
+        subpage = subpage_init(d, base);
         subsection.address_space = d->as;
         subsection.mr = &subpage->iomem;
         phys_page_set(d, base >> TARGET_PAGE_BITS, 1,
@@ -1124,10 +1139,9 @@ static void register_multipage(AddressSpaceDispatch *d,
     phys_page_set(d, start_addr >> TARGET_PAGE_BITS, num_pages, section_index);
 }
 
-static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
+void address_space_dispatch_add(AddressSpaceDispatch *d,
+                                MemoryRegionSection *section)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
-    AddressSpaceDispatch *d = as->next_dispatch;
     MemoryRegionSection now = *section, remain = *section;
     Int128 page_size = int128_make64(TARGET_PAGE_SIZE);
 
@@ -1275,7 +1289,8 @@ static void *file_ram_alloc(RAMBlock *block,
     }
 
     if (mem_prealloc) {
-        os_mem_prealloc(fd, area, memory);
+        os_mem_prealloc(fd, area, memory, block->flags & RAM_SHARED, 0,
+                        NULL, NULL, NULL);
     }
 
     block->fd = fd;
@@ -1371,6 +1386,24 @@ static RAMBlock *find_ram_block(ram_addr_t addr)
     return NULL;
 }
 
+/*
+ * Whether @block is private anonymous memory QEMU allocated itself, which
+ * reads as zeroes again once discarded with MADV_DONTNEED.
+ */
+bool qemu_ram_is_anonymous(RAMBlock *block)
+{
+    return !xen_enabled() && block->fd < 0 && !(block->flags & RAM_PREALLOC);
+}
+
+/*
+ * Whether @block is a file mapped MAP_SHARED, whose contents another process
+ * mapping the same file sees as well.
+ */
+bool qemu_ram_is_shared(RAMBlock *block)
+{
+    return block->fd >= 0 && (block->flags & RAM_SHARED);
+}
+
 /* Called with iothread lock held.  */
 void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev)
 {
@@ -1474,6 +1507,49 @@ int qemu_ram_resize(ram_addr_t base, ram_addr_t newsize, Error **errp)
     return 0;
 }
 
+/* Allocate the dirty memory blocks covering a new RAMBlock, growing the
+ * block arrays if needed.  Called with the ramlist lock held.
+ */
+static void dirty_memory_extend(ram_addr_t start, ram_addr_t length)
+{
+    unsigned long first = (start >> TARGET_PAGE_BITS) / DIRTY_MEMORY_BLOCK_SIZE;
+    unsigned long last = ((start + length - 1) >> TARGET_PAGE_BITS) /
+                         DIRTY_MEMORY_BLOCK_SIZE;
+    unsigned long j;
+    int i;
+
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        DirtyMemoryBlocks *old_blocks = ram_list.dirty_memory[i];
+        DirtyMemoryBlocks *new_blocks = old_blocks;
+        unsigned long old_num = old_blocks ? old_blocks->num : 0;
+
+        if (last >= old_num) {
+            new_blocks = g_malloc0(sizeof(*new_blocks) +
+                                   sizeof(new_blocks->blocks[0]) * (last + 1));
+            new_blocks->num = last + 1;
+            if (old_num) {
+                memcpy(new_blocks->blocks, old_blocks->blocks,
+                       old_num * sizeof(old_blocks->blocks[0]));
+            }
+        }
+
+        /* Nobody looks at the blocks of an address range with no RAM yet */
+        for (j = first; j <= last; j++) {
+            if (!new_blocks->blocks[j]) {
+                atomic_rcu_set(&new_blocks->blocks[j],
+                               bitmap_new(DIRTY_MEMORY_BLOCK_SIZE));
+            }
+        }
+
+        if (new_blocks != old_blocks) {
+            atomic_rcu_set(&ram_list.dirty_memory[i], new_blocks);
+            if (old_blocks) {
+                g_free_rcu(old_blocks, rcu);
+            }
+        }
+    }
+}
+
 static ram_addr_t ram_block_add(RAMBlock *new_block, Error **errp)
 {
     RAMBlock *block;
@@ -1508,6 +1584,7 @@ static ram_addr_t ram_block_add(RAMBlock *new_block, Error **errp)
     if (new_ram_size > old_ram_size) {
         migration_bitmap_extend(old_ram_size, new_ram_size);
     }
+    dirty_memory_extend(new_block->offset, new_block->max_length);
     /* Keep the list sorted from biggest to smallest block.  Unlike QTAILQ,
      * QLIST (which has an RCU-friendly variant) does not have insertion at
      * tail, so save the last element in last_block.
@@ -1532,25 +1609,16 @@ static ram_addr_t ram_block_add(RAMBlock *new_block, Error **errp)
     ram_list.version++;
     qemu_mutex_unlock_ramlist();
 
-    new_ram_size = last_ram_offset() >> TARGET_PAGE_BITS;
-
-    if (new_ram_size > old_ram_size) {
-        int i;
-
-        /* ram_list.dirty_memory[] is protected by the iothread lock.  */
-        for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
-            ram_list.dirty_memory[i] =
-                bitmap_zero_extend(ram_list.dirty_memory[i],
-                                   old_ram_size, new_ram_size);
-       }
-    }
     cpu_physical_memory_set_dirty_range(new_block->offset,
                                         new_block->used_length,
                                         DIRTY_CLIENTS_ALL);
 
     if (new_block->host) {
         qemu_ram_setup_dump(new_block->host, new_block->max_length);
-        qemu_madvise(new_block->host, new_block->max_length, QEMU_MADV_HUGEPAGE);
+        if (qemu_madvise(new_block->host, new_block->max_length,
+                         QEMU_MADV_HUGEPAGE)) {
+            trace_ram_block_add_no_thp(new_block->idstr);
+        }
         qemu_madvise(new_block->host, new_block->max_length, QEMU_MADV_DONTFORK);
         if (kvm_enabled()) {
             kvm_setup_guest_memory(new_block->host, new_block->max_length);
@@ -2074,7 +2142,8 @@ static MemTxResult subpage_read(void *opaque, hwaddr addr, uint64_t *data,
     printf("%s: subpage %p len %u addr " TARGET_FMT_plx "\n", __func__,
            subpage, len, addr);
 #endif
-    res = address_space_read(subpage->as, addr + subpage->base,
+    res = address_space_read(atomic_rcu_read(&subpage->d->as),
+                             addr + subpage->base,
                              attrs, buf, len);
     if (res) {
         return res;
@@ -2124,7 +2193,8 @@ static MemTxResult subpage_write(void *opaque, hwaddr addr,
     default:
         abort();
     }
-    return address_space_write(subpage->as, addr + subpage->base,
+    return address_space_write(atomic_rcu_read(&subpage->d->as),
+                               addr + subpage->base,
                                attrs, buf, len);
 }
 
@@ -2137,8 +2207,8 @@ static bool subpage_accepts(void *opaque, hwaddr addr,
            __func__, subpage, is_write ? 'w' : 'r', len, addr);
 #endif
 
-    return address_space_access_valid(subpage->as, addr + subpage->base,
-                                      len, is_write);
+    return address_space_access_valid(atomic_rcu_read(&subpage->d->as),
+                                      addr + subpage->base, len, is_write);
 }
 
 static const MemoryRegionOps subpage_ops = {
@@ -2172,13 +2242,13 @@ static int subpage_register (subpage_t *mmio, uint32_t start, uint32_t end,
     return 0;
 }
 
-static subpage_t *subpage_init(AddressSpace *as, hwaddr base)
+static subpage_t *subpage_init(AddressSpaceDispatch *d, hwaddr base)
 {
     subpage_t *mmio;
 
     mmio = g_malloc0(sizeof(subpage_t));
 
-    mmio->as = as;
+    mmio->d = d;
     mmio->base = base;
     memory_region_init_io(&mmio->iomem, NULL, &subpage_ops, mmio,
                           NULL, TARGET_PAGE_SIZE);
@@ -2227,9 +2297,8 @@ static void io_mem_init(void)
                           NULL, UINT64_MAX);
 }
 
-static void mem_begin(MemoryListener *listener)
+AddressSpaceDispatch *address_space_dispatch_new(AddressSpace *as)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
     AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
     uint16_t n;
 
@@ -2244,27 +2313,24 @@ static void mem_begin(MemoryListener *listener)
 
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
     d->as = as;
-    as->next_dispatch = d;
+    return d;
 }
 
-static void address_space_dispatch_free(AddressSpaceDispatch *d)
+/* Called with the iothread lock held when @d is kept for another commit */
+void address_space_dispatch_set_as(AddressSpaceDispatch *d, AddressSpace *as)
 {
-    phys_sections_free(&d->map);
-    g_free(d);
+    atomic_rcu_set(&d->as, as);
 }
 
-static void mem_commit(MemoryListener *listener)
+void address_space_dispatch_compact(AddressSpaceDispatch *d)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
-    AddressSpaceDispatch *cur = as->dispatch;
-    AddressSpaceDispatch *next = as->next_dispatch;
-
-    phys_page_compact_all(next, next->map.nodes_nb);
+    phys_page_compact_all(d, d->map.nodes_nb);
+}
 
-    atomic_rcu_set(&as->dispatch, next);
-    if (cur) {
-        call_rcu(cur, address_space_dispatch_free, rcu);
-    }
+void address_space_dispatch_free(AddressSpaceDispatch *d)
+{
+    phys_sections_free(&d->map);
+    g_free(d);
 }
 
 static void tcg_commit(MemoryListener *listener)
@@ -2285,34 +2351,6 @@ static void tcg_commit(MemoryListener *listener)
     tlb_flush(cpuas->cpu, 1);
 }
 
-void address_space_init_dispatch(AddressSpace *as)
-{
-    as->dispatch = NULL;
-    as->dispatch_listener = (MemoryListener) {
-        .begin = mem_begin,
-        .commit = mem_commit,
-        .region_add = mem_add,
-        .region_nop = mem_add,
-        .priority = 0,
-    };
-    memory_listener_register(&as->dispatch_listener, as);
-}
-
-void address_space_unregister(AddressSpace *as)
-{
-    memory_listener_unregister(&as->dispatch_listener);
-}
-
-void address_space_destroy_dispatch(AddressSpace *as)
-{
-    AddressSpaceDispatch *d = as->dispatch;
-
-    atomic_rcu_set(&as->dispatch, NULL);
-    if (d) {
-        call_rcu(d, address_space_dispatch_free, rcu);
-    }
-}
-
 static void memory_map_init(void)
 {
     system_memory = g_malloc(sizeof(*system_memory));
@@ -2646,53 +2684,58 @@ void cpu_flush_icache_range(hwaddr start, int len)
                                            start, NULL, len, FLUSH_CACHE);
 }
 
+#define BOUNCE_BUFFER_MAGIC 0xb4017ceb4ffe12edULL
+
 typedef struct {
+    uint64_t magic;
     MemoryRegion *mr;
-    void *buffer;
     hwaddr addr;
     hwaddr len;
-    bool in_use;
+    uint8_t buffer[];
 } BounceBuffer;
 
-static BounceBuffer bounce;
-
 typedef struct MapClient {
     QEMUBH *bh;
-    QLIST_ENTRY(MapClient) link;
+    QTAILQ_ENTRY(MapClient) link;
 } MapClient;
 
-QemuMutex map_client_list_lock;
-static QLIST_HEAD(map_client_list, MapClient) map_client_list
-    = QLIST_HEAD_INITIALIZER(map_client_list);
-
-static void cpu_unregister_map_client_do(MapClient *client)
+static void address_space_unregister_map_client_do(AddressSpace *as,
+                                                   MapClient *client)
 {
-    QLIST_REMOVE(client, link);
+    QTAILQ_REMOVE(&as->map_client_list, client, link);
     g_free(client);
 }
 
-static void cpu_notify_map_clients_locked(void)
+/* Wake the oldest waiter up if there is bounce buffer space for it.  Once
+ * it has mapped what it could, address_space_map() passes the wakeup on
+ * to the next waiter if some space is still left; waking everybody at
+ * once would only have them race for the space, newest bottom half first.
+ */
+static void address_space_notify_map_clients_locked(AddressSpace *as)
 {
-    MapClient *client;
+    MapClient *client = QTAILQ_FIRST(&as->map_client_list);
 
-    while (!QLIST_EMPTY(&map_client_list)) {
-        client = QLIST_FIRST(&map_client_list);
+    if (client &&
+        atomic_read(&as->bounce_buffer_size) < as->max_bounce_buffer_size) {
         qemu_bh_schedule(client->bh);
-        cpu_unregister_map_client_do(client);
+        address_space_unregister_map_client_do(as, client);
     }
 }
 
-void cpu_register_map_client(QEMUBH *bh)
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh)
 {
     MapClient *client = g_malloc(sizeof(*client));
 
-    qemu_mutex_lock(&map_client_list_lock);
+    qemu_mutex_lock(&as->map_client_list_lock);
     client->bh = bh;
-    QLIST_INSERT_HEAD(&map_client_list, client, link);
-    if (!atomic_read(&bounce.in_use)) {
-        cpu_notify_map_clients_locked();
-    }
-    qemu_mutex_unlock(&map_client_list_lock);
+    QTAILQ_INSERT_TAIL(&as->map_client_list, client, link);
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->map_client_list_lock);
+}
+
+void cpu_register_map_client(QEMUBH *bh)
+{
+    address_space_register_map_client(&address_space_memory, bh);
 }
 
 void cpu_exec_init_all(void)
@@ -2700,28 +2743,36 @@ void cpu_exec_init_all(void)
     qemu_mutex_init(&ram_list.mutex);
     memory_map_init();
     io_mem_init();
-    qemu_mutex_init(&map_client_list_lock);
 }
 
-void cpu_unregister_map_client(QEMUBH *bh)
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh)
 {
     MapClient *client;
 
-    qemu_mutex_lock(&map_client_list_lock);
-    QLIST_FOREACH(client, &map_client_list, link) {
+    qemu_mutex_lock(&as->map_client_list_lock);
+    QTAILQ_FOREACH(client, &as->map_client_list, link) {
         if (client->bh == bh) {
-            cpu_unregister_map_client_do(client);
+            address_space_unregister_map_client_do(as, client);
             break;
         }
     }
-    qemu_mutex_unlock(&map_client_list_lock);
+    if (!client) {
+        /* @bh was woken already and won't map anything: pass it on */
+        address_space_notify_map_clients_locked(as);
+    }
+    qemu_mutex_unlock(&as->map_client_list_lock);
+}
+
+void cpu_unregister_map_client(QEMUBH *bh)
+{
+    address_space_unregister_map_client(&address_space_memory, bh);
 }
 
-static void cpu_notify_map_clients(void)
+static void address_space_notify_map_clients(AddressSpace *as)
 {
-    qemu_mutex_lock(&map_client_list_lock);
-    cpu_notify_map_clients_locked();
-    qemu_mutex_unlock(&map_client_list_lock);
+    qemu_mutex_lock(&as->map_client_list_lock);
+    address_space_notify_map_clients_locked(as);
+    qemu_mutex_unlock(&as->map_client_list_lock);
 }
 
 bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_write)
@@ -2751,8 +2802,8 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
  * May map a subset of the requested range, given by and returned in *plen.
  * May return NULL if resources needed to perform the mapping are exhausted.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  */
 void *address_space_map(AddressSpace *as,
                         hwaddr addr,
@@ -2774,26 +2825,44 @@ void *address_space_map(AddressSpace *as,
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
 
     if (!memory_access_is_direct(mr, is_write)) {
-        if (atomic_xchg(&bounce.in_use, true)) {
+        uint64_t used = atomic_read(&as->bounce_buffer_size);
+        uint64_t max = as->max_bounce_buffer_size;
+        uint64_t actual;
+        BounceBuffer *bounce;
+
+        /* Avoid unbounded allocations: take what is left of the budget */
+        for (;;) {
+            hwaddr alloc = used < max ? MIN(max - used, l) : 0;
+
+            actual = atomic_cmpxchg(&as->bounce_buffer_size, used,
+                                    used + alloc);
+            if (actual == used) {
+                l = alloc;
+                break;
+            }
+            used = actual;
+        }
+        if (l == 0) {
             rcu_read_unlock();
             return NULL;
         }
-        /* Avoid unbounded allocations */
-        l = MIN(l, TARGET_PAGE_SIZE);
-        bounce.buffer = qemu_memalign(TARGET_PAGE_SIZE, l);
-        bounce.addr = addr;
-        bounce.len = l;
+
+        bounce = g_malloc(sizeof(*bounce) + l);
+        bounce->magic = BOUNCE_BUFFER_MAGIC;
+        bounce->addr = addr;
+        bounce->len = l;
 
         memory_region_ref(mr);
-        bounce.mr = mr;
+        bounce->mr = mr;
         if (!is_write) {
             address_space_read(as, addr, MEMTXATTRS_UNSPECIFIED,
-                               bounce.buffer, l);
+                               bounce->buffer, l);
         }
 
         rcu_read_unlock();
+        address_space_notify_map_clients(as);
         *plen = l;
-        return bounce.buffer;
+        return bounce->buffer;
     }
 
     base = xlat;
@@ -2827,12 +2896,12 @@ void *address_space_map(AddressSpace *as,
 void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
                          int is_write, hwaddr access_len)
 {
-    if (buffer != bounce.buffer) {
-        MemoryRegion *mr;
-        ram_addr_t addr1;
+    MemoryRegion *mr;
+    ram_addr_t addr1;
+    BounceBuffer *bounce;
 
-        mr = qemu_ram_addr_from_host(buffer, &addr1);
-        assert(mr != NULL);
+    mr = qemu_ram_addr_from_host(buffer, &addr1);
+    if (mr != NULL) {
         if (is_write) {
             invalidate_and_set_dirty(mr, addr1, access_len);
         }
@@ -2842,15 +2911,19 @@ void address_space_unmap(AddressSpace *as, void *buffer, hwaddr len,
         memory_region_unref(mr);
         return;
     }
+
+    bounce = container_of(buffer, BounceBuffer, buffer);
+    assert(bounce->magic == BOUNCE_BUFFER_MAGIC);
+
     if (is_write) {
-        address_space_write(as, bounce.addr, MEMTXATTRS_UNSPECIFIED,
-                            bounce.buffer, access_len);
+        address_space_write(as, bounce->addr, MEMTXATTRS_UNSPECIFIED,
+                            bounce->buffer, access_len);
     }
-    qemu_vfree(bounce.buffer);
-    bounce.buffer = NULL;
-    memory_region_unref(bounce.mr);
-    atomic_mb_set(&bounce.in_use, false);
-    cpu_notify_map_clients();
+    memory_region_unref(bounce->mr);
+    atomic_sub(&as->bounce_buffer_size, bounce->len);
+    bounce->magic = ~BOUNCE_BUFFER_MAGIC;
+    g_free(bounce);
+    address_space_notify_map_clients(as);
 }
 
 void *cpu_physical_memory_map(hwaddr addr,
@@ -3544,4 +3617,46 @@ int qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque)
     rcu_read_unlock();
     return ret;
 }
+
+MemoryHugepageInfoList *qmp_query_memory_hugepages(Error **errp)
+{
+    MemoryHugepageInfoList *head = NULL, **tail = &head;
+    RAMBlock *block;
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        MemoryHugepageInfoList *entry;
+        int64_t bytes;
+
+        if (!block->host) {
+            continue;
+        }
+        bytes = qemu_hugepage_bytes(block->host, block->used_length);
+        if (bytes < 0) {
+            error_setg_errno(errp, -bytes,
+                             "cannot get the huge page usage of '%s'",
+                             block->idstr);
+            qapi_free_MemoryHugepageInfoList(head);
+            head = NULL;
+            break;
+        }
+
+        entry = g_new0(MemoryHugepageInfoList, 1);
+        entry->value = g_new0(MemoryHugepageInfo, 1);
+        entry->value->id = g_strdup(block->idstr);
+        entry->value->size = block->used_length;
+        /* file_ram_alloc() sets the alignment to the page size of the file */
+        if (block->fd >= 0) {
+            entry->value->hugepage_size =
+                block->mr->align > getpagesize() ? block->mr->align : 0;
+        } else {
+            entry->value->hugepage_size = qemu_thp_pagesize();
+        }
+        entry->value->hugepage_bytes = bytes;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    rcu_read_unlock();
+    return head;
+}
 #endif
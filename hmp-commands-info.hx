@@ -558,6 +558,22 @@ STEXI
 @item info migrate_parameters
 @findex migrate_parameters
 Show current migration parameters.
+ETEXI
+
+    {
+        .name       = "migrate_profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show where the downtime of the last migration went",
+        .mhandler.cmd = hmp_info_migrate_profile,
+    },
+
+STEXI
+@item info migrate_profile
+@findex migrate_profile
+Show the timeline of the stop-the-world part of the last outgoing migration
+or snapshot, and of the last incoming migration, with the time spent on
+each device's state.
 ETEXI
 
     {
@@ -784,6 +800,20 @@ STEXI
 @item info skeys @var{address}
 @findex skeys
 Display the value of a storage key (s390 only)
+ETEXI
+
+    {
+        .name       = "dump",
+        .args_type  = "",
+        .params     = "",
+        .help       = "Display the latest dump status",
+        .mhandler.cmd = hmp_info_dump,
+    },
+
+STEXI
+@item info dump
+@findex dump
+Display the latest dump status.
 ETEXI
 
 STEXI
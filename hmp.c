@@ -27,6 +27,7 @@
 #include "qapi/opts-visitor.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/string-output-visitor.h"
+#include "qapi/util.h"
 #include "qapi-visit.h"
 #include "ui/console.h"
 #include "block/qapi.h"
@@ -173,6 +174,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "expected downtime: %" PRIu64 " milliseconds\n",
                            info->expected_downtime);
         }
+        if (info->has_expected_completion_time) {
+            monitor_printf(mon, "expected completion time: %" PRIu64
+                           " milliseconds\n", info->expected_completion_time);
+        }
         if (info->has_downtime) {
             monitor_printf(mon, "downtime: %" PRIu64 " milliseconds\n",
                            info->downtime);
@@ -202,6 +207,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "resent: %" PRIu64 " pages\n",
+                       info->ram->resent);
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
@@ -283,12 +290,58 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: %" PRId64,
             MigrationParameter_lookup[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT],
             params->x_cpu_throttle_increment);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        monitor_printf(mon, " %s: %s",
+            MigrationParameter_lookup[MIGRATION_PARAMETER_COMPRESS_METHOD],
+            MigrationCompressMethod_lookup[params->compress_method]);
         monitor_printf(mon, "\n");
     }
 
     qapi_free_MigrationParameters(params);
 }
 
+static void hmp_info_migrate_profile_entries(Monitor *mon,
+                                             MigrationProfileEntryList *list)
+{
+    for (; list; list = list->next) {
+        MigrationProfileEntry *e = list->value;
+
+        monitor_printf(mon, "  %-32s", e->name);
+        if (e->has_instance_id) {
+            monitor_printf(mon, " %4" PRId64, e->instance_id);
+        } else {
+            monitor_printf(mon, "     ");
+        }
+        monitor_printf(mon, " at %10" PRId64 " us took %10" PRId64 " us\n",
+                       e->start, e->duration);
+    }
+}
+
+static void hmp_info_migrate_profile_timeline(Monitor *mon, const char *side,
+                                              MigrationProfileTimeline *t)
+{
+    monitor_printf(mon, "%s: %" PRId64 " us\n", side, t->total);
+    monitor_printf(mon, " phases:\n");
+    hmp_info_migrate_profile_entries(mon, t->phases);
+    monitor_printf(mon, " devices:\n");
+    hmp_info_migrate_profile_entries(mon, t->devices);
+}
+
+void hmp_info_migrate_profile(Monitor *mon, const QDict *qdict)
+{
+    MigrationProfile *profile = qmp_query_migrate_profile(NULL);
+
+    if (profile->has_save) {
+        hmp_info_migrate_profile_timeline(mon, "save", profile->save);
+    }
+    if (profile->has_load) {
+        hmp_info_migrate_profile_timeline(mon, "load", profile->load);
+    }
+    qapi_free_MigrationProfile(profile);
+}
+
 void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
 {
     monitor_printf(mon, "xbzrel cache size: %" PRId64 " kbytes\n",
@@ -1167,6 +1220,14 @@ void hmp_migrate_incoming(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &err);
 }
 
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 {
     double value = qdict_get_double(qdict, "value");
@@ -1227,13 +1288,17 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
 void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
 {
     const char *param = qdict_get_str(qdict, "parameter");
-    int value = qdict_get_int(qdict, "value");
+    const char *valuestr = qdict_get_str(qdict, "value");
+    int64_t value = 0;
     Error *err = NULL;
     bool has_compress_level = false;
     bool has_compress_threads = false;
     bool has_decompress_threads = false;
     bool has_x_cpu_throttle_initial = false;
     bool has_x_cpu_throttle_increment = false;
+    bool has_x_multifd_channels = false;
+    bool has_compress_method = false;
+    int compress_method = MIGRATION_COMPRESS_METHOD_ZLIB;
     int i;
 
     for (i = 0; i < MIGRATION_PARAMETER_MAX; i++) {
@@ -1254,12 +1319,32 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT:
                 has_x_cpu_throttle_increment = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                break;
+            case MIGRATION_PARAMETER_COMPRESS_METHOD:
+                has_compress_method = true;
+                compress_method =
+                    qapi_enum_parse(MigrationCompressMethod_lookup, valuestr,
+                                    MIGRATION_COMPRESS_METHOD_MAX, -1, &err);
+                break;
+            }
+            if (err) {
+                break;
+            }
+            if (!has_compress_method &&
+                qemu_strtoll(valuestr, NULL, 10, &value) < 0) {
+                error_setg(&err, QERR_INVALID_PARAMETER_VALUE, "value",
+                           "an integer");
+                break;
             }
             qmp_migrate_set_parameters(has_compress_level, value,
                                        has_compress_threads, value,
                                        has_decompress_threads, value,
                                        has_x_cpu_throttle_initial, value,
                                        has_x_cpu_throttle_increment, value,
+                                       has_x_multifd_channels, value,
+                                       has_compress_method, compress_method,
                                        &err);
             break;
         }
@@ -1548,6 +1633,7 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
     bool paging = qdict_get_try_bool(qdict, "paging", false);
+    bool detach = qdict_get_try_bool(qdict, "detach", false);
     bool zlib = qdict_get_try_bool(qdict, "zlib", false);
     bool lzo = qdict_get_try_bool(qdict, "lzo", false);
     bool snappy = qdict_get_try_bool(qdict, "snappy", false);
@@ -1586,12 +1672,29 @@ void hmp_dump_guest_memory(Monitor *mon, const QDict *qdict)
 
     prot = g_strconcat("file:", file, NULL);
 
-    qmp_dump_guest_memory(paging, prot, has_begin, begin, has_length, length,
-                          true, dump_format, &err);
+    qmp_dump_guest_memory(paging, prot, true, detach, has_begin, begin,
+                          has_length, length, true, dump_format, &err);
     hmp_handle_error(mon, &err);
     g_free(prot);
 }
 
+void hmp_info_dump(Monitor *mon, const QDict *qdict)
+{
+    DumpQueryResult *result = qmp_query_dump(NULL);
+
+    assert(result && result->status < DUMP_STATUS_MAX);
+    monitor_printf(mon, "Status: %s\n", DumpStatus_lookup[result->status]);
+
+    if (result->status == DUMP_STATUS_ACTIVE) {
+        float percent = 0;
+        assert(result->total != 0);
+        percent = 100.0 * result->completed / result->total;
+        monitor_printf(mon, "Finished: %.2f %%\n", percent);
+    }
+
+    qapi_free_DumpQueryResult(result);
+}
+
 void hmp_netdev_add(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
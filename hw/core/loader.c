@@ -910,6 +910,13 @@ static void rom_reset(void *unused)
         if (rom->data == NULL) {
             continue;
         }
+        /*
+         * An incoming migration brings the RAM contents along, and with
+         * x-ignore-shared the RAM may still belong to the running source.
+         */
+        if (!rom->isrom && runstate_check(RUN_STATE_INMIGRATE)) {
+            continue;
+        }
         if (rom->mr) {
             void *host = memory_region_get_ram_ptr(rom->mr);
             memcpy(host, rom->data, rom->datasize);
@@ -211,6 +211,20 @@ static void machine_set_mem_merge(Object *obj, bool value, Error **errp)
     ms->mem_merge = value;
 }
 
+static bool machine_get_numa_split_ram(Object *obj, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    return ms->numa_split_ram;
+}
+
+static void machine_set_numa_split_ram(Object *obj, bool value, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    ms->numa_split_ram = value;
+}
+
 static bool machine_get_usb(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -407,6 +421,13 @@ static void machine_initfn(Object *obj)
     object_property_set_description(obj, "mem-merge",
                                     "Enable/disable memory merge support",
                                     NULL);
+    object_property_add_bool(obj, "numa-split-ram",
+                             machine_get_numa_split_ram,
+                             machine_set_numa_split_ram, NULL);
+    object_property_set_description(obj, "numa-split-ram",
+                                    "Set on to allocate the RAM of each NUMA "
+                                    "node separately, on a host node",
+                                    NULL);
     object_property_add_bool(obj, "usb",
                              machine_get_usb,
                              machine_set_usb, NULL);
@@ -497,6 +518,11 @@ bool machine_mem_merge(MachineState *machine)
     return machine->mem_merge;
 }
 
+bool machine_numa_split_ram(MachineState *machine)
+{
+    return machine->numa_split_ram;
+}
+
 static const TypeInfo machine_info = {
     .name = TYPE_MACHINE,
     .parent = TYPE_OBJECT,
@@ -25,6 +25,7 @@
 #include "exec/address-spaces.h"
 #include "qapi/visitor.h"
 #include "qapi-event.h"
+#include "migration/migration.h"
 #include "trace.h"
 
 #if defined(__linux__)
@@ -238,6 +239,73 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
+/*
+ * The guest acknowledges a request for free page hints by sending its
+ * command id, reports free pages as buffers it gives us to fill, and
+ * sends any other id when it's done.  The buffers are given back
+ * untouched, so that they don't get dirty.
+ */
+static void virtio_balloon_handle_free_page_vq(VirtIODevice *vdev,
+                                               VirtQueue *vq)
+{
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+    VirtQueueElement elem;
+    uint32_t id;
+    unsigned int i;
+
+    while (virtqueue_pop(vq, &elem)) {
+        if (iov_to_buf(elem.out_sg, elem.out_num, 0, &id, 4) == 4) {
+            id = virtio_ldl_p(vdev, &id);
+            s->free_page_hint_started =
+                id == s->free_page_hint_cmd_id &&
+                id > VIRTIO_BALLOON_CMD_ID_DONE;
+            trace_virtio_balloon_free_page_hint_cmd(id,
+                                                    s->free_page_hint_started);
+        }
+
+        if (s->free_page_hint_started) {
+            for (i = 0; i < elem.in_num; i++) {
+                qemu_guest_free_page_hint(elem.in_sg[i].iov_base,
+                                          elem.in_sg[i].iov_len);
+            }
+        }
+
+        virtqueue_push(vq, &elem, 0);
+        virtio_notify(vdev, vq);
+    }
+}
+
+static void virtio_balloon_free_page_hint_notify(Notifier *n, void *data)
+{
+    VirtIOBalloon *s = container_of(n, VirtIOBalloon, free_page_hint_notify);
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    FreePageHintEvent *event = data;
+
+    if (!virtio_vdev_has_feature(vdev, VIRTIO_BALLOON_F_FREE_PAGE_HINT) ||
+        !(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
+        return;
+    }
+
+    switch (*event) {
+    case FREE_PAGE_HINT_START:
+        if (++s->free_page_hint_last_id <= VIRTIO_BALLOON_CMD_ID_DONE) {
+            s->free_page_hint_last_id = VIRTIO_BALLOON_CMD_ID_DONE + 1;
+        }
+        s->free_page_hint_cmd_id = s->free_page_hint_last_id;
+        break;
+    case FREE_PAGE_HINT_STOP:
+        s->free_page_hint_cmd_id = VIRTIO_BALLOON_CMD_ID_STOP;
+        break;
+    case FREE_PAGE_HINT_DONE:
+        s->free_page_hint_cmd_id = VIRTIO_BALLOON_CMD_ID_DONE;
+        break;
+    }
+    s->free_page_hint_started = false;
+    trace_virtio_balloon_free_page_hint_notify(*event,
+                                               s->free_page_hint_cmd_id);
+    virtio_notify_config(vdev);
+}
+
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
@@ -287,9 +355,10 @@ static void virtio_balloon_get_config(VirtIODevice *vdev, uint8_t *config_data)
 
     config.num_pages = cpu_to_le32(dev->num_pages);
     config.actual = cpu_to_le32(dev->actual);
+    config.free_page_hint_cmd_id = cpu_to_le32(dev->free_page_hint_cmd_id);
 
     trace_virtio_balloon_get_config(config.num_pages, config.actual);
-    memcpy(config_data, &config, sizeof(struct virtio_balloon_config));
+    memcpy(config_data, &config, vdev->config_len);
 }
 
 static void virtio_balloon_set_config(VirtIODevice *vdev,
@@ -300,7 +369,7 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
     uint32_t oldactual = dev->actual;
     ram_addr_t vm_ram_size = get_current_ram_size();
 
-    memcpy(&config, config_data, sizeof(struct virtio_balloon_config));
+    memcpy(&config, config_data, vdev->config_len);
     dev->actual = le32_to_cpu(config.actual);
     if (dev->actual != oldactual) {
         qapi_event_send_balloon_change(vm_ram_size -
@@ -353,14 +422,36 @@ static void virtio_balloon_save_device(VirtIODevice *vdev, QEMUFile *f)
 
     qemu_put_be32(f, s->num_pages);
     qemu_put_be32(f, s->actual);
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        qemu_put_be32(f, s->free_page_hint_cmd_id);
+        qemu_put_be32(f, s->free_page_hint_last_id);
+    }
 }
 
 static int virtio_balloon_load(QEMUFile *f, void *opaque, int version_id)
 {
+    VirtIOBalloon *s = VIRTIO_BALLOON(opaque);
+    VirtIODevice *vdev = VIRTIO_DEVICE(opaque);
+    int ret;
+
     if (version_id != 1)
         return -EINVAL;
 
-    return virtio_load(VIRTIO_DEVICE(opaque), f, version_id);
+    ret = virtio_load(vdev, f, version_id);
+    if (ret) {
+        return ret;
+    }
+
+    /*
+     * The source tells the guest it is done only after sending this, so
+     * the guest would keep holding its free pages back; do it here.
+     */
+    if (virtio_vdev_has_feature(vdev, VIRTIO_BALLOON_F_FREE_PAGE_HINT) &&
+        s->free_page_hint_cmd_id != VIRTIO_BALLOON_CMD_ID_DONE) {
+        s->free_page_hint_cmd_id = VIRTIO_BALLOON_CMD_ID_DONE;
+        virtio_notify_config(vdev);
+    }
+    return 0;
 }
 
 static int virtio_balloon_load_device(VirtIODevice *vdev, QEMUFile *f,
@@ -370,9 +461,21 @@ static int virtio_balloon_load_device(VirtIODevice *vdev, QEMUFile *f,
 
     s->num_pages = qemu_get_be32(f);
     s->actual = qemu_get_be32(f);
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        s->free_page_hint_cmd_id = qemu_get_be32(f);
+        s->free_page_hint_last_id = qemu_get_be32(f);
+    }
     return 0;
 }
 
+static size_t virtio_balloon_config_size(VirtIOBalloon *s)
+{
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        return sizeof(struct virtio_balloon_config);
+    }
+    return offsetof(struct virtio_balloon_config, free_page_hint_cmd_id);
+}
+
 static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -380,7 +483,7 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     int ret;
 
     virtio_init(vdev, "virtio-balloon", VIRTIO_ID_BALLOON,
-                sizeof(struct virtio_balloon_config));
+                virtio_balloon_config_size(s));
 
     ret = qemu_add_balloon_handler(virtio_balloon_to_target,
                                    virtio_balloon_stat, s);
@@ -395,6 +498,13 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
 
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_FREE_PAGE_HINT)) {
+        s->free_page_vq = virtio_add_queue(vdev, 128,
+                                           virtio_balloon_handle_free_page_vq);
+        s->free_page_hint_notify.notify = virtio_balloon_free_page_hint_notify;
+        ram_add_free_page_hint_notifier(&s->free_page_hint_notify);
+    }
+
     reset_stats(s);
 
     register_savevm(dev, "virtio-balloon", -1, 1,
@@ -407,6 +517,9 @@ static void virtio_balloon_device_unrealize(DeviceState *dev, Error **errp)
     VirtIOBalloon *s = VIRTIO_BALLOON(dev);
 
     balloon_stats_destroy_timer(s);
+    if (s->free_page_vq) {
+        ram_remove_free_page_hint_notifier(&s->free_page_hint_notify);
+    }
     qemu_remove_balloon_handler(s);
     unregister_savevm(dev, "virtio-balloon", s);
     virtio_cleanup(vdev);
@@ -428,6 +541,8 @@ static void virtio_balloon_instance_init(Object *obj)
 static Property virtio_balloon_properties[] = {
     DEFINE_PROP_BIT("deflate-on-oom", VirtIOBalloon, host_features,
                     VIRTIO_BALLOON_F_DEFLATE_ON_OOM, false),
+    DEFINE_PROP_BIT("free-page-hint", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_FREE_PAGE_HINT, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -22,9 +22,12 @@
 #ifndef CONFIG_USER_ONLY
 typedef struct AddressSpaceDispatch AddressSpaceDispatch;
 
-void address_space_init_dispatch(AddressSpace *as);
-void address_space_unregister(AddressSpace *as);
-void address_space_destroy_dispatch(AddressSpace *as);
+AddressSpaceDispatch *address_space_dispatch_new(AddressSpace *as);
+void address_space_dispatch_add(AddressSpaceDispatch *d,
+                                MemoryRegionSection *section);
+void address_space_dispatch_compact(AddressSpaceDispatch *d);
+void address_space_dispatch_set_as(AddressSpaceDispatch *d, AddressSpace *as);
+void address_space_dispatch_free(AddressSpaceDispatch *d);
 
 extern const MemoryRegionOps unassigned_mem_ops;
 
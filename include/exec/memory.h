@@ -21,6 +21,9 @@
 #define DIRTY_MEMORY_MIGRATION 2
 #define DIRTY_MEMORY_NUM       3        /* num of dirty bits */
 
+/* Default total size of the bounce buffers of an address space */
+#define DEFAULT_MAX_BOUNCE_BUFFER_SIZE 4096
+
 #include <stdint.h>
 #include <stdbool.h>
 #include "exec/cpu-common.h"
@@ -242,9 +245,16 @@ struct AddressSpace {
 
     int ioeventfd_nb;
     struct MemoryRegionIoeventfd *ioeventfds;
+    /* Accessed via RCU; the dispatch table of current_map.  */
     struct AddressSpaceDispatch *dispatch;
-    struct AddressSpaceDispatch *next_dispatch;
-    MemoryListener dispatch_listener;
+
+    /* Limit on the total size of the bounce buffers of address_space_map() */
+    uint64_t max_bounce_buffer_size;
+    /* Total size of the bounce buffers in use, updated atomically */
+    uint64_t bounce_buffer_size;
+    /* Waiters for bounce buffer space, in the order they registered */
+    QemuMutex map_client_list_lock;
+    QTAILQ_HEAD(, MapClient) map_client_list;
 
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
 };
@@ -1328,10 +1338,12 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
 /* address_space_map: map a physical memory region into a host virtual address
  *
  * May map a subset of the requested range, given by and returned in @plen.
- * May return %NULL if resources needed to perform the mapping are exhausted.
+ * May return %NULL if resources needed to perform the mapping are exhausted,
+ * that is if the range is not directly accessible guest RAM and @as already
+ * has max_bounce_buffer_size bytes of bounce buffers mapped.
  * Use only for reads OR writes - not for read-modify-write operations.
- * Use cpu_register_map_client() to know when retrying the map operation is
- * likely to succeed.
+ * Use address_space_register_map_client() to know when retrying the map
+ * operation is likely to succeed.
  *
  * @as: #AddressSpace to be accessed
  * @addr: address within that address space
@@ -1341,6 +1353,24 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
 void *address_space_map(AddressSpace *as, hwaddr addr,
                         hwaddr *plen, bool is_write);
 
+/* address_space_register_map_client: get notified of free bounce buffer space
+ *
+ * Schedules @bh once some of the bounce buffers of @as are unmapped, or
+ * right away if there is space already.  Waiters are woken one at a time,
+ * in the order they registered.
+ *
+ * @as: #AddressSpace whose bounce buffers are waited for
+ * @bh: bottom half to schedule
+ */
+void address_space_register_map_client(AddressSpace *as, QEMUBH *bh);
+
+/* address_space_unregister_map_client: cancel address_space_register_map_client()
+ *
+ * @as: #AddressSpace passed to address_space_register_map_client()
+ * @bh: bottom half passed to address_space_register_map_client()
+ */
+void address_space_unregister_map_client(AddressSpace *as, QEMUBH *bh);
+
 /* address_space_unmap: Unmaps a memory region previously mapped by address_space_map()
  *
  * Will also mark the memory as dirty if @is_write == %true.  @access_len gives
@@ -21,6 +21,7 @@
 
 #ifndef CONFIG_USER_ONLY
 #include "hw/xen/xen.h"
+#include "qemu/rcu.h"
 
 typedef struct RAMBlock RAMBlock;
 
@@ -47,10 +48,35 @@ static inline void *ramblock_ptr(RAMBlock *block, ram_addr_t offset)
     return (char *)block->host + offset;
 }
 
+/*
+ * Each dirty memory bitmap is split into blocks of DIRTY_MEMORY_BLOCK_SIZE
+ * pages, so that it can grow without being copied.  Adding RAM allocates
+ * the blocks that it covers, and only those; if the block pointer array
+ * has to grow, a new one pointing to the same blocks replaces it under
+ * RCU.  The bits themselves are only accessed with atomic operations, so
+ * a reader does:
+ *
+ *   rcu_read_lock();
+ *   blocks = atomic_rcu_read(&ram_list.dirty_memory[client]);
+ *   bitmap = blocks->blocks[page / DIRTY_MEMORY_BLOCK_SIZE];
+ *   ... bit page % DIRTY_MEMORY_BLOCK_SIZE of bitmap ...
+ *   rcu_read_unlock();
+ *
+ * moving on to the next block when a range crosses the end of one.  Blocks
+ * that no RAMBlock has covered are NULL; blocks are never freed.
+ */
+#define DIRTY_MEMORY_BLOCK_SIZE ((ram_addr_t)256 * 1024 * 8)
+
+typedef struct DirtyMemoryBlocks {
+    struct rcu_head rcu;
+    unsigned long num;
+    unsigned long *blocks[];
+} DirtyMemoryBlocks;
+
 typedef struct RAMList {
     QemuMutex mutex;
-    /* Protected by the iothread lock.  */
-    unsigned long *dirty_memory[DIRTY_MEMORY_NUM];
+    /* RCU-enabled, writes protected by the ramlist lock.  */
+    DirtyMemoryBlocks *dirty_memory[DIRTY_MEMORY_NUM];
     RAMBlock *mru_block;
     /* RCU-enabled, writes protected by the ramlist lock. */
     QLIST_HEAD(, RAMBlock) blocks;
@@ -59,6 +85,8 @@ typedef struct RAMList {
 extern RAMList ram_list;
 
 ram_addr_t last_ram_offset(void);
+bool qemu_ram_is_anonymous(RAMBlock *block);
+bool qemu_ram_is_shared(RAMBlock *block);
 void qemu_mutex_lock_ramlist(void);
 void qemu_mutex_unlock_ramlist(void);
 
@@ -88,30 +116,64 @@ static inline bool cpu_physical_memory_get_dirty(ram_addr_t start,
                                                  ram_addr_t length,
                                                  unsigned client)
 {
-    unsigned long end, page, next;
+    DirtyMemoryBlocks *blocks;
+    unsigned long end, page, idx, offset, num;
+    bool dirty = false;
 
     assert(client < DIRTY_MEMORY_NUM);
 
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    next = find_next_bit(ram_list.dirty_memory[client], end, page);
 
-    return next < end;
+    rcu_read_lock();
+    blocks = atomic_rcu_read(&ram_list.dirty_memory[client]);
+    while (page < end) {
+        idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+        offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+        num = MIN(end - page, DIRTY_MEMORY_BLOCK_SIZE - offset);
+
+        if (find_next_bit(blocks->blocks[idx], offset + num, offset)
+            < offset + num) {
+            dirty = true;
+            break;
+        }
+        page += num;
+    }
+    rcu_read_unlock();
+
+    return dirty;
 }
 
 static inline bool cpu_physical_memory_all_dirty(ram_addr_t start,
                                                  ram_addr_t length,
                                                  unsigned client)
 {
-    unsigned long end, page, next;
+    DirtyMemoryBlocks *blocks;
+    unsigned long end, page, idx, offset, num;
+    bool dirty = true;
 
     assert(client < DIRTY_MEMORY_NUM);
 
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    next = find_next_zero_bit(ram_list.dirty_memory[client], end, page);
 
-    return next >= end;
+    rcu_read_lock();
+    blocks = atomic_rcu_read(&ram_list.dirty_memory[client]);
+    while (page < end) {
+        idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+        offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+        num = MIN(end - page, DIRTY_MEMORY_BLOCK_SIZE - offset);
+
+        if (find_next_zero_bit(blocks->blocks[idx], offset + num, offset)
+            < offset + num) {
+            dirty = false;
+            break;
+        }
+        page += num;
+    }
+    rcu_read_unlock();
+
+    return dirty;
 }
 
 static inline bool cpu_physical_memory_get_dirty_flag(ram_addr_t addr,
@@ -153,28 +215,58 @@ static inline uint8_t cpu_physical_memory_range_includes_clean(ram_addr_t start,
 static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
                                                       unsigned client)
 {
+    DirtyMemoryBlocks *blocks;
+    unsigned long page = addr >> TARGET_PAGE_BITS;
+
     assert(client < DIRTY_MEMORY_NUM);
-    set_bit_atomic(addr >> TARGET_PAGE_BITS, ram_list.dirty_memory[client]);
+
+    rcu_read_lock();
+    blocks = atomic_rcu_read(&ram_list.dirty_memory[client]);
+    set_bit_atomic(page % DIRTY_MEMORY_BLOCK_SIZE,
+                   blocks->blocks[page / DIRTY_MEMORY_BLOCK_SIZE]);
+    rcu_read_unlock();
 }
 
 static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
                                                        ram_addr_t length,
                                                        uint8_t mask)
 {
-    unsigned long end, page;
-    unsigned long **d = ram_list.dirty_memory;
+    DirtyMemoryBlocks *blocks[DIRTY_MEMORY_NUM];
+    unsigned long end, page, idx, offset, num;
+    int i;
 
     end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
     page = start >> TARGET_PAGE_BITS;
-    if (likely(mask & (1 << DIRTY_MEMORY_MIGRATION))) {
-        bitmap_set_atomic(d[DIRTY_MEMORY_MIGRATION], page, end - page);
-    }
-    if (unlikely(mask & (1 << DIRTY_MEMORY_VGA))) {
-        bitmap_set_atomic(d[DIRTY_MEMORY_VGA], page, end - page);
+
+    rcu_read_lock();
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        blocks[i] = atomic_rcu_read(&ram_list.dirty_memory[i]);
     }
-    if (unlikely(mask & (1 << DIRTY_MEMORY_CODE))) {
-        bitmap_set_atomic(d[DIRTY_MEMORY_CODE], page, end - page);
+
+    idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+    offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+    while (page < end) {
+        num = MIN(end - page, DIRTY_MEMORY_BLOCK_SIZE - offset);
+
+        if (likely(mask & (1 << DIRTY_MEMORY_MIGRATION))) {
+            bitmap_set_atomic(blocks[DIRTY_MEMORY_MIGRATION]->blocks[idx],
+                              offset, num);
+        }
+        if (unlikely(mask & (1 << DIRTY_MEMORY_VGA))) {
+            bitmap_set_atomic(blocks[DIRTY_MEMORY_VGA]->blocks[idx],
+                              offset, num);
+        }
+        if (unlikely(mask & (1 << DIRTY_MEMORY_CODE))) {
+            bitmap_set_atomic(blocks[DIRTY_MEMORY_CODE]->blocks[idx],
+                              offset, num);
+        }
+
+        page += num;
+        idx++;
+        offset = 0;
     }
+    rcu_read_unlock();
+
     xen_modified_memory(start, length);
 }
 
@@ -194,21 +286,37 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
     /* start address is aligned at the start of a word? */
     if ((((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) &&
         (hpratio == 1)) {
+        DirtyMemoryBlocks *blocks[DIRTY_MEMORY_NUM];
+        unsigned long idx = page / (DIRTY_MEMORY_BLOCK_SIZE / BITS_PER_LONG);
+        unsigned long offset = page % (DIRTY_MEMORY_BLOCK_SIZE / BITS_PER_LONG);
         long k;
         long nr = BITS_TO_LONGS(pages);
 
+        rcu_read_lock();
+        for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+            blocks[i] = atomic_rcu_read(&ram_list.dirty_memory[i]);
+        }
+
         for (k = 0; k < nr; k++) {
             if (bitmap[k]) {
                 unsigned long temp = leul_to_cpu(bitmap[k]);
-                unsigned long **d = ram_list.dirty_memory;
 
-                atomic_or(&d[DIRTY_MEMORY_MIGRATION][page + k], temp);
-                atomic_or(&d[DIRTY_MEMORY_VGA][page + k], temp);
+                atomic_or(&blocks[DIRTY_MEMORY_MIGRATION]->blocks[idx][offset],
+                          temp);
+                atomic_or(&blocks[DIRTY_MEMORY_VGA]->blocks[idx][offset],
+                          temp);
                 if (tcg_enabled()) {
-                    atomic_or(&d[DIRTY_MEMORY_CODE][page + k], temp);
+                    atomic_or(&blocks[DIRTY_MEMORY_CODE]->blocks[idx][offset],
+                              temp);
                 }
             }
+            if (++offset >= DIRTY_MEMORY_BLOCK_SIZE / BITS_PER_LONG) {
+                offset = 0;
+                idx++;
+            }
         }
+        rcu_read_unlock();
+
         xen_modified_memory(start, pages << TARGET_PAGE_BITS);
     } else {
         uint8_t clients = tcg_enabled() ? DIRTY_CLIENTS_ALL : DIRTY_CLIENTS_NOCODE;
@@ -260,18 +368,30 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
     if (((page * BITS_PER_LONG) << TARGET_PAGE_BITS) == start) {
         int k;
         int nr = BITS_TO_LONGS(length >> TARGET_PAGE_BITS);
-        unsigned long *src = ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION];
+        unsigned long idx = page / (DIRTY_MEMORY_BLOCK_SIZE / BITS_PER_LONG);
+        unsigned long offset = page % (DIRTY_MEMORY_BLOCK_SIZE / BITS_PER_LONG);
+        DirtyMemoryBlocks *blocks;
+        unsigned long *src;
+
+        rcu_read_lock();
+        blocks = atomic_rcu_read(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
 
         for (k = page; k < page + nr; k++) {
-            if (src[k]) {
-                unsigned long bits = atomic_xchg(&src[k], 0);
+            src = blocks->blocks[idx];
+            if (src[offset]) {
+                unsigned long bits = atomic_xchg(&src[offset], 0);
                 unsigned long new_dirty;
                 new_dirty = ~dest[k];
                 dest[k] |= bits;
                 new_dirty &= bits;
                 num_dirty += ctpopl(new_dirty);
             }
+            if (++offset >= DIRTY_MEMORY_BLOCK_SIZE / BITS_PER_LONG) {
+                offset = 0;
+                idx++;
+            }
         }
+        rcu_read_unlock();
     } else {
         for (addr = 0; addr < length; addr += TARGET_PAGE_SIZE) {
             if (cpu_physical_memory_test_and_clear_dirty(
@@ -40,6 +40,7 @@ int machine_kvm_shadow_mem(MachineState *machine);
 int machine_phandle_start(MachineState *machine);
 bool machine_dump_guest_core(MachineState *machine);
 bool machine_mem_merge(MachineState *machine);
+bool machine_numa_split_ram(MachineState *machine);
 
 /**
  * MachineClass:
@@ -114,6 +115,7 @@ struct MachineState {
     char *dt_compatible;
     bool dump_guest_core;
     bool mem_merge;
+    bool numa_split_ram;
     bool usb;
     bool usb_disabled;
     bool igd_gfx_passthru;
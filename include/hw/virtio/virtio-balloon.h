@@ -33,7 +33,7 @@ typedef struct virtio_balloon_stat_modern {
 
 typedef struct VirtIOBalloon {
     VirtIODevice parent_obj;
-    VirtQueue *ivq, *dvq, *svq;
+    VirtQueue *ivq, *dvq, *svq, *free_page_vq;
     uint32_t num_pages;
     uint32_t actual;
     uint64_t stats[VIRTIO_BALLOON_S_NR];
@@ -43,6 +43,13 @@ typedef struct VirtIOBalloon {
     int64_t stats_last_update;
     int64_t stats_poll_interval;
     uint32_t host_features;
+    /* What the config space asks of the guest, or a VIRTIO_BALLOON_CMD_ID */
+    uint32_t free_page_hint_cmd_id;
+    /* Id of the last request */
+    uint32_t free_page_hint_last_id;
+    /* The guest is reporting for free_page_hint_cmd_id */
+    bool free_page_hint_started;
+    Notifier free_page_hint_notify;
 } VirtIOBalloon;
 
 #endif
@@ -0,0 +1,48 @@
+/*
+ * Page compression methods for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qemu-common.h"
+#include "qapi-types.h"
+
+typedef struct MigrationCompressCtx MigrationCompressCtx;
+
+bool migrate_compress_method_available(MigrationCompressMethod method);
+
+/*
+ * The method the pages of the current migration are compressed with.
+ * On the source it's chosen when the compression threads start, on the
+ * destination it comes from the configuration section of the stream;
+ * zlib if neither happened.
+ */
+MigrationCompressMethod migrate_compress_method_current(void);
+void migrate_compress_method_set_current(MigrationCompressMethod method);
+
+/* Largest output for @len bytes of input with any of the methods built in */
+size_t migrate_compress_bound(size_t len);
+
+/*
+ * A context compresses (or decompresses) one page at a time; each page is
+ * independent of the others.  @level is on the compress-level scale, 0-9.
+ */
+MigrationCompressCtx *migrate_compress_ctx_new(MigrationCompressMethod method,
+                                               int level, bool decompress);
+void migrate_compress_ctx_free(MigrationCompressCtx *ctx);
+MigrationCompressMethod migrate_compress_ctx_method(MigrationCompressCtx *ctx);
+void migrate_compress_ctx_set_level(MigrationCompressCtx *ctx, int level);
+
+/* Both return the length of the output, or -1 on error */
+ssize_t migrate_compress_page(MigrationCompressCtx *ctx,
+                              uint8_t *dst, size_t dst_len,
+                              const uint8_t *src, size_t src_len);
+ssize_t migrate_decompress_page(MigrationCompressCtx *ctx,
+                                uint8_t *dst, size_t dst_len,
+                                const uint8_t *src, size_t src_len);
+
+#endif
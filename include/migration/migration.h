@@ -22,6 +22,7 @@
 #include "migration/vmstate.h"
 #include "qapi-types.h"
 #include "exec/cpu-common.h"
+#include "block/snapshot.h"
 
 #define QEMU_VM_FILE_MAGIC           0x5145564d
 #define QEMU_VM_FILE_VERSION_COMPAT  0x00000002
@@ -35,6 +36,7 @@
 #define QEMU_VM_SUBSECTION           0x05
 #define QEMU_VM_VMDESCRIPTION        0x06
 #define QEMU_VM_CONFIGURATION        0x07
+#define QEMU_VM_COMMAND              0x08
 #define QEMU_VM_SECTION_FOOTER       0x7e
 
 struct MigrationParams {
@@ -42,6 +44,18 @@ struct MigrationParams {
     bool shared;
 };
 
+/* Messages sent on the return path from destination to source */
+enum mig_rp_message_type {
+    MIG_RP_MSG_INVALID = 0,  /* Must be 0 */
+    MIG_RP_MSG_SHUT,         /* sibling will not send any more RP messages */
+    MIG_RP_MSG_PONG,         /* Response to a PING; data (seq: be32 ) */
+
+    MIG_RP_MSG_REQ_PAGES_ID, /* data (start: be64, len: be32, id: string) */
+    MIG_RP_MSG_REQ_PAGES,    /* data (start: be64, len: be32) */
+
+    MIG_RP_MSG_MAX
+};
+
 typedef struct MigrationState MigrationState;
 
 typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntry_Head;
@@ -50,6 +64,37 @@ typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntry_Head;
 struct MigrationIncomingState {
     QEMUFile *file;
 
+    /* Return path back to the source; written from several threads */
+    QEMUFile *to_src_file;
+    QemuMutex rp_mutex;
+
+    /* Thread forwarding userfaultfd page requests over the return path */
+    bool have_fault_thread;
+    QemuThread fault_thread;
+    QemuSemaphore fault_thread_sem;
+
+    /* Thread reading the main stream once in postcopy */
+    bool have_listen_thread;
+    QemuThread listen_thread;
+    QemuSemaphore listen_thread_sem;
+
+    /* For the kernel to send us notifications */
+    int userfault_fd;
+    /* To tell the fault_thread to quit */
+    int userfault_quit_fd;
+    /* Page-sized buffer that incoming postcopy pages are staged in */
+    void *postcopy_tmp_page;
+    /* Guest RAM registered with userfaultfd, see postcopy-ram.c */
+    GArray *postcopy_ranges;
+
+    /* The stream comes with its RAM at fixed offsets, see file.c */
+    bool mapped_ram;
+
+    /* Set by the main thread once it has finished loading device state */
+    QemuEvent main_thread_load_event;
+    /* Starts the guest once postcopy has been entered */
+    QEMUBH *bh;
+
     /* See savevm.c */
     LoadStateEntry_Head loadvm_handlers;
 };
@@ -74,12 +119,34 @@ struct MigrationState
     int64_t total_time;
     int64_t downtime;
     int64_t expected_downtime;
+    /* -1 while the migration isn't predicted to converge */
+    int64_t expected_completion_time;
     int64_t dirty_pages_rate;
     int64_t dirty_bytes_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+
+    /* Flag set once the migration has been asked to enter postcopy */
+    bool start_postcopy;
+
+    /*
+     * The stream is a live snapshot (savevm -l) rather than a migration;
+     * the guest is resumed once it's complete.
+     */
+    bool live_snapshot;
+    /* The snapshot it creates once complete, with the state in this BDS */
+    QEMUSnapshotInfo live_snapshot_info;
+    BlockDriverState *live_snapshot_bs;
+
+    /* State related to return path */
+    struct {
+        QEMUFile     *from_dst_file;
+        QemuThread    rp_thread;
+        bool          rp_thread_created;
+        bool          error;
+    } rp_state;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -104,22 +171,55 @@ void fd_start_incoming_migration(const char *path, Error **errp);
 
 void fd_start_outgoing_migration(MigrationState *s, const char *fdname, Error **errp);
 
+void file_start_incoming_migration(const char *path, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp);
+
 void rdma_start_outgoing_migration(void *opaque, const char *host_port, Error **errp);
 
 void rdma_start_incoming_migration(const char *host_port, Error **errp);
 
+/*
+ * An x-mapped-ram file starts with this header.  The RAM follows, each page
+ * at MAPPED_RAM_ALIGN plus its ram_addr_t, and the stream carrying the
+ * device state starts at @stream_offset, after the last RAMBlock.
+ */
+#define MAPPED_RAM_MAGIC    0x514d5241      /* "QMRA" */
+#define MAPPED_RAM_VERSION  1
+#define MAPPED_RAM_ALIGN    (1 * 1024 * 1024)
+
+typedef struct QEMU_PACKED MappedRamHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t stream_offset;
+} MappedRamHeader;
+
+/* Returns 0 and the offset of the stream if @fd is an x-mapped-ram file */
+int mapped_ram_read_header(int fd, uint64_t *stream_offset);
+/* Where the stream can start after the RAM of the current VM */
+uint64_t ram_mapped_ram_end(void);
+
 void migrate_fd_error(MigrationState *s);
 
 void migrate_fd_connect(MigrationState *s);
 
+/* Save the VM to @f while it runs, taking ownership of @f */
+void migrate_start_live_snapshot(QEMUFile *f, BlockDriverState *bs,
+                                 const QEMUSnapshotInfo *sn, Error **errp);
+
 int migrate_fd_close(MigrationState *s);
 
 void add_migration_state_change_notifier(Notifier *notify);
 void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_in_setup(MigrationState *);
+bool migration_is_active(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
+/* True if outgoing migration has entered postcopy phase */
+bool migration_in_postcopy(MigrationState *);
 MigrationState *migrate_get_current(void);
+void migrate_generate_event(int new_state);
 
 void migrate_compress_threads_create(void);
 void migrate_compress_threads_join(void);
@@ -141,10 +241,18 @@ uint64_t norm_mig_pages_transferred(void);
 uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
+uint64_t resent_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
 double xbzrle_mig_cache_miss_rate(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
+int ram_postcopy_send_discard_bitmap(MigrationState *ms);
+int ram_discard_range(MigrationIncomingState *mis, const char *block_name,
+                      uint64_t start, size_t length);
+int ram_save_queue_pages(const char *rbname, ram_addr_t start,
+                         ram_addr_t len);
+void *ram_multifd_host_from_name(const char *block_name, ram_addr_t offset,
+                                 size_t len);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -162,6 +270,8 @@ void migrate_del_blocker(Error *reason);
 
 bool migrate_zero_blocks(void);
 
+bool migrate_postcopy_ram(void);
+
 bool migrate_auto_converge(void);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
@@ -175,10 +285,26 @@ int64_t xbzrle_cache_resize(int64_t new_size);
 
 bool migrate_use_compression(void);
 int migrate_compress_level(void);
+MigrationCompressMethod migrate_compress_method(void);
 int migrate_compress_threads(void);
 int migrate_decompress_threads(void);
+bool migrate_use_multifd(void);
+bool migrate_use_mapped_ram(void);
+bool migrate_ignore_shared(void);
+int migrate_multifd_channels(void);
 bool migrate_use_events(void);
 
+/* Sending on the return path - generic and then for each message type */
+void migrate_send_rp_message(MigrationIncomingState *mis,
+                             enum mig_rp_message_type message_type,
+                             uint16_t len, void *data);
+void migrate_send_rp_shut(MigrationIncomingState *mis,
+                          uint32_t value);
+void migrate_send_rp_pong(MigrationIncomingState *mis,
+                          uint32_t value);
+int migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                              ram_addr_t start, size_t len);
+
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_after_iterate(QEMUFile *f, uint64_t flags);
 void ram_control_load_hook(QEMUFile *f, uint64_t flags, void *data);
@@ -198,10 +324,31 @@ size_t ram_control_save_page(QEMUFile *f, ram_addr_t block_offset,
                              uint64_t *bytes_sent);
 
 void ram_mig_init(void);
+
+/*
+ * Free page hinting: a device that can learn from the guest which of its
+ * pages are free registers a notifier, called with the iothread lock held
+ * and one of the events below as data.  Between START and STOP, pages
+ * reported with qemu_guest_free_page_hint() are taken out of the first
+ * round of the migration; their content needn't be sent unless the guest
+ * dirties them again.  DONE comes when the migration ends, so that the
+ * guest can use the pages it set aside again.
+ */
+typedef enum FreePageHintEvent {
+    FREE_PAGE_HINT_START,
+    FREE_PAGE_HINT_STOP,
+    FREE_PAGE_HINT_DONE,
+} FreePageHintEvent;
+
+void ram_add_free_page_hint_notifier(Notifier *notify);
+void ram_remove_free_page_hint_notifier(Notifier *notify);
+/* Called with the iothread lock held; @addr is a host address of RAM */
+void qemu_guest_free_page_hint(void *addr, size_t len);
 void savevm_skip_section_footers(void);
 void register_global_state(void);
 void global_state_set_optional(void);
 void savevm_skip_configuration(void);
+bool savevm_configuration_skipped(void);
 int global_state_store(void);
 void global_state_store_running(void);
 #endif
@@ -0,0 +1,41 @@
+/*
+ * Multiple channel (multifd) RAM transfer for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_MIGRATION_MULTIFD_H
+#define QEMU_MIGRATION_MULTIFD_H
+
+#include "migration/migration.h"
+
+/* Remember where the extra channels of an outgoing migration connect to */
+void multifd_set_outgoing_address(const char *host_port);
+
+/*
+ * Source side; setup/cleanup run in the main thread, the rest in the
+ * migration thread.
+ */
+int multifd_save_setup(Error **errp);
+void multifd_save_cleanup(void);
+/*
+ * Queue a page to be sent on one of the channels; the page is read straight
+ * out of guest RAM by the channel thread when the batch is sent.
+ * Returns 0 on success, -1 if a channel failed.
+ */
+int multifd_queue_page(const char *block_name, uint8_t *host,
+                       ram_addr_t offset, size_t size);
+/*
+ * Push out any partially filled batch and wait for every channel to send a
+ * sync packet; pages queued afterwards can't overtake the ones before.
+ */
+int multifd_send_sync_main(void);
+
+/* Destination side; accepts the channels on @listen_fd and takes ownership */
+void multifd_load_setup(int listen_fd);
+void multifd_load_cleanup(void);
+/* Wait until every channel has received everything sent before the sync */
+int multifd_recv_sync_main(void);
+
+#endif
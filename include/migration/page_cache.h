@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is an N-way set associative cache indexed by a hash of the
+ * page address, with LRU replacement within each set
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -18,6 +19,18 @@
 /* Page cache for storing guest pages */
 typedef struct PageCache PageCache;
 
+/* Statistics of one set of the cache, or of the whole cache */
+typedef struct PageCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    /* cached pages replaced by another page */
+    uint64_t evictions;
+    /* pages not cached because it was the first time they were inserted */
+    uint64_t rejected;
+    /* pages currently cached */
+    int64_t items;
+} PageCacheStats;
+
 /**
  * cache_init: Initialize the page cache
  *
@@ -45,7 +58,7 @@ void cache_fini(PageCache *cache);
  * @addr: page addr
  * @current_age: current bitmap generation
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
+bool cache_is_cached(PageCache *cache, uint64_t addr,
                      uint64_t current_age);
 
 /**
@@ -62,6 +75,11 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
  * cache_insert: insert the page into the cache. the page cache
  * will dup the data on insert. the previous value will be overwritten
  *
+ * A page that isn't cached yet takes a free slot of its set if there is
+ * one.  Otherwise it is only admitted the second time it is inserted
+ * (i.e. once it has been dirtied more than once), evicting the least
+ * recently used page of its set.
+ *
  * Returns -1 when the page isn't inserted into cache
  *
  * @cache pointer to the PageCache struct
@@ -83,4 +101,29 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
  */
 int64_t cache_resize(PageCache *cache, int64_t num_pages);
 
+/**
+ * cache_get_num_sets: Returns the number of sets of the cache
+ *
+ * @cache pointer to the PageCache struct
+ */
+int64_t cache_get_num_sets(const PageCache *cache);
+
+/**
+ * cache_get_set_stats: Get the statistics of one set
+ *
+ * @cache pointer to the PageCache struct
+ * @set: set index, below cache_get_num_sets()
+ * @stats: filled in with the statistics
+ */
+void cache_get_set_stats(const PageCache *cache, int64_t set,
+                         PageCacheStats *stats);
+
+/**
+ * cache_get_stats: Get the statistics summed over all the sets
+ *
+ * @cache pointer to the PageCache struct
+ * @stats: filled in with the statistics
+ */
+void cache_get_stats(const PageCache *cache, PageCacheStats *stats);
+
 #endif
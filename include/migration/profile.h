@@ -0,0 +1,40 @@
+/*
+ * Timelines of where the time of a migration goes
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#ifndef QEMU_MIGRATION_PROFILE_H
+#define QEMU_MIGRATION_PROFILE_H
+
+#include "qemu-common.h"
+
+typedef enum MigrationProfileSide {
+    MIGRATION_PROFILE_SAVE,
+    MIGRATION_PROFILE_LOAD,
+    MIGRATION_PROFILE__MAX,
+} MigrationProfileSide;
+
+/*
+ * _start and _finish are called with the iothread lock held; the others
+ * record nothing when called without it.  Nothing is recorded on a side
+ * between its _finish and the next _start.
+ */
+void migration_profile_start(MigrationProfileSide side);
+void migration_profile_finish(MigrationProfileSide side);
+
+/* Timestamp to pass as @start below */
+int64_t migration_profile_now(void);
+
+/* Record a step that ran from @start until now */
+void migration_profile_phase(MigrationProfileSide side, const char *name,
+                             int64_t start);
+/*
+ * Record the time spent on the state of a device since @start; on the
+ * destination the time of all its sections is added up.
+ */
+void migration_profile_device(MigrationProfileSide side, const char *idstr,
+                              uint32_t instance_id, int64_t start);
+
+#endif
@@ -41,6 +41,11 @@ typedef struct SaveVMHandlers {
 
     void (*cancel)(void *opaque);
     int (*save_live_complete)(QEMUFile *f, void *opaque);
+    /* Handlers providing this one can keep going once the destination
+     * is running; they are skipped by the precopy completion when
+     * entering postcopy and finished by this call instead.
+     */
+    int (*save_live_complete_postcopy)(QEMUFile *f, void *opaque);
 
     /* This runs both outside and inside the iothread lock.  */
     bool (*is_active)(void *opaque);
@@ -132,6 +132,14 @@ int qemu_daemon(int nochdir, int noclose);
 void *qemu_try_memalign(size_t alignment, size_t size);
 void *qemu_memalign(size_t alignment, size_t size);
 void *qemu_anon_ram_alloc(size_t size, uint64_t *align);
+/* Size of the transparent huge pages of the host, 0 if it has none */
+size_t qemu_thp_pagesize(void);
+/*
+ * How much of @area the host backs with huge pages right now, transparent
+ * or from hugetlbfs, or -errno if it can't be found out.  Host mappings
+ * that extend past @area are counted in proportion.
+ */
+int64_t qemu_hugepage_bytes(void *area, size_t size);
 void qemu_vfree(void *ptr);
 void qemu_anon_ram_free(void *ptr, size_t size);
 
@@ -284,7 +292,24 @@ unsigned long qemu_getauxval(unsigned long type);
 
 void qemu_set_tty_echo(int fd, bool echo);
 
-void os_mem_prealloc(int fd, char *area, size_t sz);
+typedef void MemPreallocProgress(void *opaque, size_t done, size_t total);
+
+/* Most threads os_mem_prealloc() starts when not told how many */
+#define MEM_PREALLOC_MAX_THREADS 16
+
+/*
+ * Touch every page of @area so that the host allocates it, from @threads
+ * threads, or if it's 0 as many as there are host CPUs, at most
+ * MEM_PREALLOC_MAX_THREADS.  With @host_nodes, a bitmap of MAX_NODES host
+ * NUMA nodes, the threads are spread over the nodes and each runs on the
+ * CPUs of its node; with @threads 0 there are as many as the nodes have
+ * CPUs.  @progress, if not NULL, is called with the bytes done so far
+ * about once a second and when it's all done.  Pages of a @shared mapping are only read, as
+ * another process may be using them.
+ */
+void os_mem_prealloc(int fd, char *area, size_t sz, bool shared, int threads,
+                     const unsigned long *host_nodes,
+                     MemPreallocProgress *progress, void *opaque);
 
 int qemu_read_password(char *buf, int buf_size);
 
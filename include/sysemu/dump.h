@@ -45,6 +45,8 @@
 
 #include "sysemu/dump-arch.h"
 #include "sysemu/memory_mapping.h"
+#include "qapi-types.h"
+#include "qemu/thread.h"
 
 typedef struct QEMU_PACKED MakedumpfileHeader {
     char signature[16];     /* = "makedumpfile" */
@@ -183,6 +185,15 @@ typedef struct DumpState {
     off_t offset_page;          /* offset of page part in vmcore */
     size_t num_dumpable;        /* number of page that can be dumped */
     uint32_t flag_compress;     /* indicate the compression format */
+
+    bool has_format;              /* whether format is provided */
+    DumpGuestMemoryFormat format; /* valid only if has_format == true */
+    bool detached;                /* whether the dump runs in a thread */
+    QemuThread dump_thread;       /* the thread of a detached dump */
+
+    DumpStatus status;          /* read by query-dump from the main loop */
+    int64_t total_size;         /* bytes of guest memory to be dumped */
+    int64_t written_size;       /* bytes of guest memory dumped so far */
 } DumpState;
 
 uint16_t cpu_to_dump16(DumpState *s, uint16_t val);
@@ -227,7 +227,8 @@ struct FlatRange {
 };
 
 /* Flattened global view of current active memory hierarchy.  Kept in sorted
- * order.
+ * order.  Address spaces that render the same root share one view and its
+ * dispatch table.
  */
 struct FlatView {
     struct rcu_head rcu;
@@ -235,6 +236,7 @@ struct FlatView {
     FlatRange *ranges;
     unsigned nr;
     unsigned nr_allocated;
+    AddressSpaceDispatch *dispatch;
 };
 
 typedef struct AddressSpaceOps AddressSpaceOps;
@@ -257,6 +259,7 @@ static void flatview_init(FlatView *view)
     view->ranges = NULL;
     view->nr = 0;
     view->nr_allocated = 0;
+    view->dispatch = NULL;
 }
 
 /* Insert a range into a given position.  Caller is responsible for maintaining
@@ -284,18 +287,59 @@ static void flatview_destroy(FlatView *view)
         memory_region_unref(view->ranges[i].mr);
     }
     g_free(view->ranges);
+    if (view->dispatch) {
+        address_space_dispatch_free(view->dispatch);
+    }
     g_free(view);
 }
 
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i])
+            || a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void flatview_ref(FlatView *view)
 {
     atomic_inc(&view->ref);
 }
 
+/* Take a reference unless the last one is already gone; readers can still
+ * find such a view in current_map until a grace period has passed.
+ */
+static bool flatview_tryref(FlatView *view)
+{
+    unsigned ref = atomic_read(&view->ref);
+    unsigned old;
+
+    while (ref) {
+        old = atomic_cmpxchg(&view->ref, ref, ref + 1);
+        if (old == ref) {
+            return true;
+        }
+        ref = old;
+    }
+    return false;
+}
+
+/* Views are shared between address spaces, so the last reference can be
+ * dropped by any of them; readers may still be using it until a grace period
+ * has passed.
+ */
 static void flatview_unref(FlatView *view)
 {
     if (atomic_fetch_dec(&view->ref) == 1) {
-        flatview_destroy(view);
+        call_rcu(view, flatview_destroy, rcu);
     }
 }
 
@@ -525,6 +569,22 @@ static AddressSpace *memory_region_to_address_space(MemoryRegion *mr)
     return NULL;
 }
 
+/* Index of the first range in @view that ends after @addr */
+static unsigned flatview_find_after(FlatView *view, Int128 addr)
+{
+    unsigned lo = 0, hi = view->nr, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (int128_ge(addr, addrrange_end(view->ranges[mid].addr))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
 /* Render a memory region into the global view.  Ranges in @view obscure
  * ranges in @mr.
  */
@@ -583,7 +643,8 @@ static void render_memory_region(FlatView *view,
     fr.readonly = readonly;
 
     /* Render the region itself into any gaps left by the current view. */
-    for (i = 0; i < view->nr && int128_nz(remain); ++i) {
+    for (i = flatview_find_after(view, base);
+         i < view->nr && int128_nz(remain); ++i) {
         if (int128_ge(base, addrrange_end(view->ranges[i].addr))) {
             continue;
         }
@@ -612,6 +673,55 @@ static void render_memory_region(FlatView *view,
     }
 }
 
+/* Look through the regions on top of @mr that do not change how it renders:
+ * aliases covering all of their target from offset 0, and containers with a
+ * single enabled subregion at offset 0.  Address spaces with the same result
+ * share one FlatView.  Returns NULL if nothing would be rendered.
+ */
+static MemoryRegion *memory_region_get_flatview_root(MemoryRegion *mr)
+{
+    MemoryRegion *subregion, *next;
+    unsigned found;
+
+    while (mr && mr->enabled) {
+        /* The base address and read-only bit of @mr apply to what's below */
+        if (mr->addr || mr->readonly) {
+            return mr;
+        }
+        if (mr->alias) {
+            /* Rendering the alias cancels the base address of its target */
+            if (!mr->alias_offset && !mr->alias->addr &&
+                int128_ge(mr->size, mr->alias->size)) {
+                mr = mr->alias;
+                continue;
+            }
+            return mr;
+        }
+        if (mr->terminates) {
+            return mr;
+        }
+
+        found = 0;
+        next = NULL;
+        QTAILQ_FOREACH(subregion, &mr->subregions, subregions_link) {
+            if (subregion->enabled) {
+                next = subregion;
+                if (++found > 1) {
+                    return mr;
+                }
+            }
+        }
+        if (!found) {
+            return NULL;
+        }
+        if (next->addr || int128_lt(mr->size, next->size)) {
+            return mr;
+        }
+        mr = next;
+    }
+    return NULL;
+}
+
 /* Render a memory topology into a list of disjoint absolute ranges. */
 static FlatView *generate_memory_topology(MemoryRegion *mr)
 {
@@ -629,6 +739,29 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     return view;
 }
 
+/* Build the dispatch table of @view.  @as is the first address space using
+ * it.
+ */
+static void flatview_build_dispatch(FlatView *view, AddressSpace *as)
+{
+    FlatRange *fr;
+
+    view->dispatch = address_space_dispatch_new(as);
+    FOR_EACH_FLAT_RANGE(fr, view) {
+        MemoryRegionSection section = {
+            .mr = fr->mr,
+            .address_space = as,
+            .offset_within_region = fr->offset_in_region,
+            .size = fr->addr.size,
+            .offset_within_address_space = int128_get64(fr->addr.start),
+            .readonly = fr->readonly,
+        };
+
+        address_space_dispatch_add(view->dispatch, &section);
+    }
+    address_space_dispatch_compact(view->dispatch);
+}
+
 static void address_space_add_del_ioeventfds(AddressSpace *as,
                                              MemoryRegionIoeventfd *fds_new,
                                              unsigned fds_new_nb,
@@ -683,8 +816,9 @@ static FlatView *address_space_get_flatview(AddressSpace *as)
     FlatView *view;
 
     rcu_read_lock();
-    view = atomic_rcu_read(&as->current_map);
-    flatview_ref(view);
+    do {
+        view = atomic_rcu_read(&as->current_map);
+    } while (!flatview_tryref(view));
     rcu_read_unlock();
     return view;
 }
@@ -791,17 +925,40 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
-static void address_space_update_topology(AddressSpace *as)
+/* @views maps flatview roots to the views built so far in this commit */
+static void address_space_update_topology(AddressSpace *as, GHashTable *views)
 {
+    MemoryRegion *root = memory_region_get_flatview_root(as->root);
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view;
+
+    new_view = g_hash_table_lookup(views, root);
+    if (!new_view) {
+        new_view = generate_memory_topology(root);
+        if (flatview_equal(new_view, old_view)) {
+            /* Nothing under the root changed: keep the old view, so that its
+             * dispatch table is not rebuilt and listeners are not called.
+             */
+            flatview_destroy(new_view);
+            new_view = old_view;
+            flatview_ref(new_view);
+            address_space_dispatch_set_as(new_view->dispatch, as);
+        } else {
+            flatview_build_dispatch(new_view, as);
+        }
+        g_hash_table_insert(views, root, new_view);
+    }
+    flatview_ref(new_view);
 
-    address_space_update_topology_pass(as, old_view, new_view, false);
-    address_space_update_topology_pass(as, old_view, new_view, true);
+    if (new_view != old_view) {
+        address_space_update_topology_pass(as, old_view, new_view, false);
+        address_space_update_topology_pass(as, old_view, new_view, true);
+    }
 
     /* Writes are protected by the BQL.  */
     atomic_rcu_set(&as->current_map, new_view);
-    call_rcu(old_view, flatview_unref, rcu);
+    atomic_rcu_set(&as->dispatch, new_view->dispatch);
+    flatview_unref(old_view);
 
     /* Note that all the old MemoryRegions are still alive up to this
      * point.  This relieves most MemoryListeners from the need to
@@ -834,13 +991,18 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
+            GHashTable *views;
+
+            views = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+                                          (GDestroyNotify)flatview_unref);
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                address_space_update_topology(as, views);
             }
 
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            g_hash_table_destroy(views);
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -2093,13 +2255,17 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     memory_region_ref(root);
     memory_region_transaction_begin();
     as->root = root;
-    as->current_map = g_new(FlatView, 1);
-    flatview_init(as->current_map);
+    as->current_map = generate_memory_topology(NULL);
+    flatview_build_dispatch(as->current_map, as);
+    as->dispatch = as->current_map->dispatch;
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
+    as->max_bounce_buffer_size = DEFAULT_MAX_BOUNCE_BUFFER_SIZE;
+    as->bounce_buffer_size = 0;
+    qemu_mutex_init(&as->map_client_list_lock);
+    QTAILQ_INIT(&as->map_client_list);
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
     as->name = g_strdup(name ? name : "anonymous");
-    address_space_init_dispatch(as);
     memory_region_update_pending |= root->enabled;
     memory_region_transaction_commit();
 }
@@ -2108,12 +2274,14 @@ static void do_address_space_destroy(AddressSpace *as)
 {
     MemoryListener *listener;
 
-    address_space_destroy_dispatch(as);
-
     QTAILQ_FOREACH(listener, &memory_listeners, link) {
         assert(listener->address_space_filter != as);
     }
 
+    assert(atomic_read(&as->bounce_buffer_size) == 0);
+    assert(QTAILQ_EMPTY(&as->map_client_list));
+    qemu_mutex_destroy(&as->map_client_list_lock);
+
     flatview_unref(as->current_map);
     g_free(as->name);
     g_free(as->ioeventfds);
@@ -2124,12 +2292,15 @@ void address_space_destroy(AddressSpace *as)
 {
     MemoryRegion *root = as->root;
 
-    /* Flush out anything from MemoryListeners listening in on this */
+    /* Flush out anything from MemoryListeners listening in on this.  A
+     * non-empty view may have been built for this address space and shared
+     * with others, so rebuild it for one that stays.
+     */
     memory_region_transaction_begin();
     as->root = NULL;
+    memory_region_update_pending |= as->current_map->nr > 0;
     memory_region_transaction_commit();
     QTAILQ_REMOVE(&address_spaces, as, address_spaces_link);
-    address_space_unregister(as);
 
     /* At this point, as->dispatch and as->current_map are dummy
      * entries that the guest should never use.  Wait for the old
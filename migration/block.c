@@ -20,6 +20,7 @@
 #include "hw/hw.h"
 #include "qemu/queue.h"
 #include "qemu/timer.h"
+#include "qemu/hbitmap.h"
 #include "migration/block.h"
 #include "migration/migration.h"
 #include "sysemu/blockdev.h"
@@ -36,6 +37,9 @@
 
 #define MAX_IS_ALLOCATED_SEARCH 65536
 
+/* Reads of chunks that may be outstanding at once */
+#define MAX_INFLIGHT_IO 512
+
 //#define DEBUG_BLK_MIGRATION
 
 #ifdef DEBUG_BLK_MIGRATION
@@ -66,7 +70,7 @@ typedef struct BlkMigDevState {
 } BlkMigDevState;
 
 typedef struct BlkMigBlock {
-    /* Only used by migration thread.  */
+    /* Only used by migration thread.  NULL for a zero block record.  */
     uint8_t *buf;
     BlkMigDevState *bmds;
     int64_t sector;
@@ -118,24 +122,32 @@ static void blk_mig_unlock(void)
  * or the VM will stall.
  */
 
-static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+static void blk_send_header(QEMUFile *f, BlkMigDevState *bmds,
+                            int64_t sector, uint64_t flags)
 {
     int len;
-    uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
-
-    if (block_mig_state.zero_blocks &&
-        buffer_is_zero(blk->buf, BLOCK_SIZE)) {
-        flags |= BLK_MIG_FLAG_ZERO_BLOCK;
-    }
 
     /* sector number and flags */
-    qemu_put_be64(f, (blk->sector << BDRV_SECTOR_BITS)
+    qemu_put_be64(f, (sector << BDRV_SECTOR_BITS)
                      | flags);
 
     /* device name */
-    len = strlen(bdrv_get_device_name(blk->bmds->bs));
+    len = strlen(bdrv_get_device_name(bmds->bs));
     qemu_put_byte(f, len);
-    qemu_put_buffer(f, (uint8_t *)bdrv_get_device_name(blk->bmds->bs), len);
+    qemu_put_buffer(f, (uint8_t *)bdrv_get_device_name(bmds->bs), len);
+}
+
+static void blk_send(QEMUFile *f, BlkMigBlock * blk)
+{
+    uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
+
+    if (!blk->buf ||
+        (block_mig_state.zero_blocks &&
+         buffer_is_zero(blk->buf, BLOCK_SIZE))) {
+        flags |= BLK_MIG_FLAG_ZERO_BLOCK;
+    }
+
+    blk_send_header(f, blk->bmds, blk->sector, flags);
 
     /* if a block is zero we need to flush here since the network
      * bandwidth is now a lot higher than the storage device bandwidth.
@@ -232,6 +244,50 @@ static void alloc_aio_bitmap(BlkMigDevState *bmds)
     bmds->aio_bitmap = g_malloc0(bitmap_size);
 }
 
+/* Called with iothread lock taken.
+ *
+ * Return how many of the chunks starting at @sector, at most @max_chunks,
+ * the block layer knows to read as zeroes; those needn't be read, a zero
+ * block record is enough.  Only whole chunks count, except at the end of
+ * the device.
+ */
+static int bmds_zero_chunks(BlkMigDevState *bmds, int64_t sector,
+                            int max_chunks)
+{
+    int64_t total_sectors = bmds->total_sectors;
+    int64_t ret;
+    int nr_sectors, pnum;
+
+    if (!block_mig_state.zero_blocks) {
+        return 0;
+    }
+
+    nr_sectors = MIN(total_sectors - sector,
+                     (int64_t)max_chunks * BDRV_SECTORS_PER_DIRTY_CHUNK);
+    ret = bdrv_get_block_status_above(bmds->bs, NULL, sector, nr_sectors,
+                                      &pnum);
+    if (ret < 0 || !(ret & BDRV_BLOCK_ZERO)) {
+        return 0;
+    }
+    if (sector + pnum >= total_sectors) {
+        return DIV_ROUND_UP(total_sectors - sector,
+                            BDRV_SECTORS_PER_DIRTY_CHUNK);
+    }
+    return pnum / BDRV_SECTORS_PER_DIRTY_CHUNK;
+}
+
+/* Called with no lock taken, or with the iothread lock taken.  */
+
+static void blk_send_zero_chunks(QEMUFile *f, BlkMigDevState *bmds,
+                                 int64_t sector, int nr_chunks)
+{
+    for (; nr_chunks > 0; nr_chunks--) {
+        blk_send_header(f, bmds, sector,
+                        BLK_MIG_FLAG_DEVICE_BLOCK | BLK_MIG_FLAG_ZERO_BLOCK);
+        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
+    }
+}
+
 /* Never hold migration lock when yielding to the main loop!  */
 
 static void blk_mig_read_cb(void *opaque, int ret)
@@ -259,6 +315,7 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
     BlockDriverState *bs = bmds->bs;
     BlkMigBlock *blk;
     int nr_sectors;
+    int zero_chunks = 0;
 
     if (bmds->shared_base) {
         qemu_mutex_lock_iothread();
@@ -279,6 +336,28 @@ static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
 
     cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
 
+    /* zero extents go out as zero block records, without reading them */
+    if (block_mig_state.zero_blocks) {
+        qemu_mutex_lock_iothread();
+        zero_chunks = bmds_zero_chunks(bmds, cur_sector,
+                                       MAX_IS_ALLOCATED_SEARCH /
+                                       BDRV_SECTORS_PER_DIRTY_CHUNK);
+        if (zero_chunks) {
+            nr_sectors = MIN(total_sectors - cur_sector,
+                             (int64_t)zero_chunks *
+                             BDRV_SECTORS_PER_DIRTY_CHUNK);
+            bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector,
+                                    nr_sectors);
+        }
+        qemu_mutex_unlock_iothread();
+    }
+
+    if (zero_chunks) {
+        blk_send_zero_chunks(f, bmds, cur_sector, zero_chunks);
+        bmds->cur_sector = cur_sector + nr_sectors;
+        return (bmds->cur_sector >= total_sectors);
+    }
+
     /* we are going to transfer a full block even if it is not allocated */
     nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
 
@@ -448,12 +527,23 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
                                  int is_async)
 {
     BlkMigBlock *blk;
+    HBitmapIter hbi;
     int64_t total_sectors = bmds->total_sectors;
     int64_t sector;
     int nr_sectors;
     int ret = -EIO;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
+    /* skip straight to the next dirty chunk */
+    bdrv_dirty_iter_init(bmds->dirty_bitmap, &hbi);
+    while (bmds->cur_dirty < total_sectors) {
+        bdrv_set_dirty_iter(&hbi, bmds->cur_dirty);
+        sector = hbitmap_iter_next(&hbi);
+        if (sector < 0 || sector >= total_sectors) {
+            bmds->cur_dirty = total_sectors;
+            break;
+        }
+        bmds->cur_dirty = sector;
+
         blk_mig_lock();
         if (bmds_aio_inflight(bmds, sector)) {
             blk_mig_unlock();
@@ -468,6 +558,32 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
             } else {
                 nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
             }
+
+            if (bmds_zero_chunks(bmds, sector, 1)) {
+                /* e.g. discarded by the guest */
+                bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, sector,
+                                        nr_sectors);
+                if (!is_async) {
+                    blk_send_zero_chunks(f, bmds, sector, 1);
+                    break;
+                }
+                /*
+                 * An older read of this chunk may still be waiting in
+                 * blk_list; queue the record behind it so that it isn't
+                 * overwritten on the destination.
+                 */
+                blk = g_new0(BlkMigBlock, 1);
+                blk->bmds = bmds;
+                blk->sector = sector;
+                blk->nr_sectors = nr_sectors;
+
+                blk_mig_lock();
+                QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+                block_mig_state.read_done++;
+                blk_mig_unlock();
+                break;
+            }
+
             blk = g_new(BlkMigBlock, 1);
             blk->buf = g_malloc(BLOCK_SIZE);
             blk->bmds = bmds;
@@ -500,8 +616,7 @@ static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
             bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, sector, nr_sectors);
             break;
         }
-        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-        bmds->cur_dirty = sector;
+        bmds->cur_dirty = sector + BDRV_SECTORS_PER_DIRTY_CHUNK;
     }
 
     return (bmds->cur_dirty >= bmds->total_sectors);
@@ -666,11 +781,18 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
 
     blk_mig_reset_dirty_cursor();
 
-    /* control the rate of transfer */
+    /*
+     * Control the rate of transfer.  Only the chunks read and waiting to
+     * be sent count against it; reads that are still in flight overlap
+     * with sending, as long as they stay within twice the rate limit and
+     * MAX_INFLIGHT_IO.
+     */
     blk_mig_lock();
-    while ((block_mig_state.submitted +
-            block_mig_state.read_done) * BLOCK_SIZE <
-           qemu_file_get_rate_limit(f)) {
+    while (block_mig_state.read_done * BLOCK_SIZE <
+           qemu_file_get_rate_limit(f) &&
+           block_mig_state.submitted * BLOCK_SIZE <
+           2 * qemu_file_get_rate_limit(f) &&
+           block_mig_state.submitted < MAX_INFLIGHT_IO) {
         blk_mig_unlock();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
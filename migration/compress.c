@@ -0,0 +1,313 @@
+/*
+ * Page compression methods for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include <zlib.h>
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "migration/compress.h"
+
+typedef struct MigrationCompressOps {
+    int (*init)(MigrationCompressCtx *ctx);
+    void (*cleanup)(MigrationCompressCtx *ctx);
+    size_t (*bound)(size_t len);
+    ssize_t (*compress)(MigrationCompressCtx *ctx, uint8_t *dst,
+                        size_t dst_len, const uint8_t *src, size_t src_len);
+    ssize_t (*decompress)(MigrationCompressCtx *ctx, uint8_t *dst,
+                          size_t dst_len, const uint8_t *src, size_t src_len);
+} MigrationCompressOps;
+
+struct MigrationCompressCtx {
+    const MigrationCompressOps *ops;
+    MigrationCompressMethod method;
+    int level;
+    bool level_changed;
+    bool decompress;
+    z_stream stream;
+    void *opaque;
+};
+
+static MigrationCompressMethod current_method;
+
+/* zlib */
+
+static int zlib_init(MigrationCompressCtx *ctx)
+{
+    int ret;
+
+    if (ctx->decompress) {
+        ret = inflateInit(&ctx->stream);
+    } else {
+        ret = deflateInit(&ctx->stream, ctx->level);
+    }
+    return ret == Z_OK ? 0 : -1;
+}
+
+static void zlib_cleanup(MigrationCompressCtx *ctx)
+{
+    if (ctx->decompress) {
+        inflateEnd(&ctx->stream);
+    } else {
+        deflateEnd(&ctx->stream);
+    }
+}
+
+static size_t zlib_bound(size_t len)
+{
+    return compressBound(len);
+}
+
+/* Produces a zlib stream that uncompress() takes */
+static ssize_t zlib_compress(MigrationCompressCtx *ctx, uint8_t *dst,
+                             size_t dst_len, const uint8_t *src,
+                             size_t src_len)
+{
+    z_stream *stream = &ctx->stream;
+
+    if (ctx->level_changed) {
+        deflateParams(stream, ctx->level, Z_DEFAULT_STRATEGY);
+        ctx->level_changed = false;
+    }
+    deflateReset(stream);
+    stream->next_in = (uint8_t *)src;
+    stream->avail_in = src_len;
+    stream->next_out = dst;
+    stream->avail_out = dst_len;
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return stream->total_out;
+}
+
+static ssize_t zlib_decompress(MigrationCompressCtx *ctx, uint8_t *dst,
+                               size_t dst_len, const uint8_t *src,
+                               size_t src_len)
+{
+    z_stream *stream = &ctx->stream;
+
+    inflateReset(stream);
+    stream->next_in = (uint8_t *)src;
+    stream->avail_in = src_len;
+    stream->next_out = dst;
+    stream->avail_out = dst_len;
+    if (inflate(stream, Z_FINISH) != Z_STREAM_END) {
+        return -1;
+    }
+    return stream->total_out;
+}
+
+static const MigrationCompressOps zlib_ops = {
+    .init = zlib_init,
+    .cleanup = zlib_cleanup,
+    .bound = zlib_bound,
+    .compress = zlib_compress,
+    .decompress = zlib_decompress,
+};
+
+/* lz4 */
+
+#ifdef CONFIG_LZ4
+static size_t lz4_bound(size_t len)
+{
+    return LZ4_compressBound(len);
+}
+
+/*
+ * lz4 has no levels in its fast mode, only an acceleration factor that
+ * trades ratio for speed; level 9 is the default acceleration of 1 and
+ * each level below it adds one.
+ */
+static ssize_t lz4_compress(MigrationCompressCtx *ctx, uint8_t *dst,
+                            size_t dst_len, const uint8_t *src,
+                            size_t src_len)
+{
+    int ret;
+
+    ret = LZ4_compress_fast((const char *)src, (char *)dst, src_len, dst_len,
+                            MAX(1, 10 - ctx->level));
+    return ret > 0 ? ret : -1;
+}
+
+static ssize_t lz4_decompress(MigrationCompressCtx *ctx, uint8_t *dst,
+                              size_t dst_len, const uint8_t *src,
+                              size_t src_len)
+{
+    int ret;
+
+    ret = LZ4_decompress_safe((const char *)src, (char *)dst, src_len,
+                              dst_len);
+    return ret >= 0 ? ret : -1;
+}
+
+static const MigrationCompressOps lz4_ops = {
+    .bound = lz4_bound,
+    .compress = lz4_compress,
+    .decompress = lz4_decompress,
+};
+#endif
+
+/* zstd */
+
+#ifdef CONFIG_ZSTD
+static int zstd_init(MigrationCompressCtx *ctx)
+{
+    if (ctx->decompress) {
+        ctx->opaque = ZSTD_createDCtx();
+    } else {
+        ctx->opaque = ZSTD_createCCtx();
+    }
+    return ctx->opaque ? 0 : -1;
+}
+
+static void zstd_cleanup(MigrationCompressCtx *ctx)
+{
+    if (ctx->decompress) {
+        ZSTD_freeDCtx(ctx->opaque);
+    } else {
+        ZSTD_freeCCtx(ctx->opaque);
+    }
+}
+
+static size_t zstd_bound(size_t len)
+{
+    return ZSTD_compressBound(len);
+}
+
+static ssize_t zstd_compress(MigrationCompressCtx *ctx, uint8_t *dst,
+                             size_t dst_len, const uint8_t *src,
+                             size_t src_len)
+{
+    size_t ret;
+
+    /* zstd can't store, level 0 is its fastest level too */
+    ret = ZSTD_compressCCtx(ctx->opaque, dst, dst_len, src, src_len,
+                            MAX(1, ctx->level));
+    return ZSTD_isError(ret) ? -1 : ret;
+}
+
+static ssize_t zstd_decompress(MigrationCompressCtx *ctx, uint8_t *dst,
+                               size_t dst_len, const uint8_t *src,
+                               size_t src_len)
+{
+    size_t ret;
+
+    ret = ZSTD_decompressDCtx(ctx->opaque, dst, dst_len, src, src_len);
+    return ZSTD_isError(ret) ? -1 : ret;
+}
+
+static const MigrationCompressOps zstd_ops = {
+    .init = zstd_init,
+    .cleanup = zstd_cleanup,
+    .bound = zstd_bound,
+    .compress = zstd_compress,
+    .decompress = zstd_decompress,
+};
+#endif
+
+static const MigrationCompressOps *
+compress_ops[MIGRATION_COMPRESS_METHOD_MAX] = {
+    [MIGRATION_COMPRESS_METHOD_ZLIB] = &zlib_ops,
+#ifdef CONFIG_LZ4
+    [MIGRATION_COMPRESS_METHOD_LZ4] = &lz4_ops,
+#endif
+#ifdef CONFIG_ZSTD
+    [MIGRATION_COMPRESS_METHOD_ZSTD] = &zstd_ops,
+#endif
+};
+
+bool migrate_compress_method_available(MigrationCompressMethod method)
+{
+    return method < MIGRATION_COMPRESS_METHOD_MAX && compress_ops[method];
+}
+
+MigrationCompressMethod migrate_compress_method_current(void)
+{
+    return atomic_read(&current_method);
+}
+
+void migrate_compress_method_set_current(MigrationCompressMethod method)
+{
+    assert(migrate_compress_method_available(method));
+    atomic_set(&current_method, method);
+}
+
+size_t migrate_compress_bound(size_t len)
+{
+    size_t bound = 0;
+    int i;
+
+    for (i = 0; i < MIGRATION_COMPRESS_METHOD_MAX; i++) {
+        if (compress_ops[i]) {
+            bound = MAX(bound, compress_ops[i]->bound(len));
+        }
+    }
+    return bound;
+}
+
+MigrationCompressCtx *migrate_compress_ctx_new(MigrationCompressMethod method,
+                                               int level, bool decompress)
+{
+    MigrationCompressCtx *ctx;
+
+    assert(migrate_compress_method_available(method));
+    ctx = g_new0(MigrationCompressCtx, 1);
+    ctx->ops = compress_ops[method];
+    ctx->method = method;
+    ctx->level = level;
+    ctx->decompress = decompress;
+    if (ctx->ops->init && ctx->ops->init(ctx) < 0) {
+        g_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void migrate_compress_ctx_free(MigrationCompressCtx *ctx)
+{
+    if (!ctx) {
+        return;
+    }
+    if (ctx->ops->cleanup) {
+        ctx->ops->cleanup(ctx);
+    }
+    g_free(ctx);
+}
+
+MigrationCompressMethod migrate_compress_ctx_method(MigrationCompressCtx *ctx)
+{
+    return ctx->method;
+}
+
+void migrate_compress_ctx_set_level(MigrationCompressCtx *ctx, int level)
+{
+    if (level != ctx->level) {
+        ctx->level = level;
+        ctx->level_changed = true;
+    }
+}
+
+ssize_t migrate_compress_page(MigrationCompressCtx *ctx,
+                              uint8_t *dst, size_t dst_len,
+                              const uint8_t *src, size_t src_len)
+{
+    assert(!ctx->decompress);
+    return ctx->ops->compress(ctx, dst, dst_len, src, src_len);
+}
+
+ssize_t migrate_decompress_page(MigrationCompressCtx *ctx,
+                                uint8_t *dst, size_t dst_len,
+                                const uint8_t *src, size_t src_len)
+{
+    assert(ctx->decompress);
+    return ctx->ops->decompress(ctx, dst, dst_len, src, src_len);
+}
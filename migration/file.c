@@ -0,0 +1,173 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "qemu/main-loop.h"
+#include "qemu/bswap.h"
+#include "migration/migration.h"
+#include "migration/qemu-file.h"
+#include "trace.h"
+
+typedef struct QEMUFileFile {
+    int fd;
+    /* Where the stream starts; the x-mapped-ram header and RAM come first */
+    uint64_t base;
+    /*
+     * Stream offset of the next read or write.  QEMUFile's own position
+     * also counts the RAM written out of band, so it can't be used.
+     */
+    uint64_t offset;
+} QEMUFileFile;
+
+static ssize_t file_put_buffer(void *opaque, const uint8_t *buf,
+                               int64_t pos, size_t size)
+{
+    QEMUFileFile *s = opaque;
+    size_t done = 0;
+    ssize_t len;
+
+    while (done < size) {
+        len = pwrite(s->fd, buf + done, size - done, s->base + s->offset);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        done += len;
+        s->offset += len;
+    }
+    return size;
+}
+
+static ssize_t file_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
+                               size_t size)
+{
+    QEMUFileFile *s = opaque;
+    ssize_t len;
+
+    do {
+        len = pread(s->fd, buf, size, s->base + s->offset);
+    } while (len < 0 && errno == EINTR);
+    if (len < 0) {
+        return -errno;
+    }
+    s->offset += len;
+    return len;
+}
+
+static int file_get_fd(void *opaque)
+{
+    QEMUFileFile *s = opaque;
+
+    return s->fd;
+}
+
+static int file_close(void *opaque)
+{
+    QEMUFileFile *s = opaque;
+    int ret = 0;
+
+    if (qemu_close(s->fd) < 0) {
+        ret = -errno;
+    }
+    g_free(s);
+    return ret;
+}
+
+static const QEMUFileOps file_read_ops = {
+    .get_fd     = file_get_fd,
+    .get_buffer = file_get_buffer,
+    .close      = file_close
+};
+
+static const QEMUFileOps file_write_ops = {
+    .get_fd     = file_get_fd,
+    .put_buffer = file_put_buffer,
+    .close      = file_close
+};
+
+int mapped_ram_read_header(int fd, uint64_t *stream_offset)
+{
+    MappedRamHeader hdr;
+
+    if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        be32_to_cpu(hdr.magic) != MAPPED_RAM_MAGIC) {
+        return -1;
+    }
+    if (be32_to_cpu(hdr.version) != MAPPED_RAM_VERSION) {
+        return -1;
+    }
+    *stream_offset = be64_to_cpu(hdr.stream_offset);
+    return 0;
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *path,
+                                   Error **errp)
+{
+    QEMUFileFile *f;
+    MappedRamHeader hdr;
+    int fd;
+
+    fd = qemu_open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    f = g_new0(QEMUFileFile, 1);
+    f->fd = fd;
+    if (migrate_use_mapped_ram()) {
+        f->base = ram_mapped_ram_end();
+        hdr.magic = cpu_to_be32(MAPPED_RAM_MAGIC);
+        hdr.version = cpu_to_be32(MAPPED_RAM_VERSION);
+        hdr.stream_offset = cpu_to_be64(f->base);
+        if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+            error_setg_errno(errp, errno, "failed to write to '%s'", path);
+            qemu_close(fd);
+            g_free(f);
+            return;
+        }
+    }
+    trace_file_start_outgoing_migration(path, f->base);
+
+    s->file = qemu_fopen_ops(f, &file_write_ops);
+    migrate_fd_connect(s);
+}
+
+static void file_accept_incoming_migration(void *opaque)
+{
+    QEMUFile *f = opaque;
+
+    qemu_set_fd_handler(qemu_get_fd(f), NULL, NULL, NULL);
+    process_incoming_migration(f);
+}
+
+void file_start_incoming_migration(const char *path, Error **errp)
+{
+    QEMUFileFile *f;
+    QEMUFile *file;
+    int fd;
+
+    fd = qemu_open(path, O_RDONLY);
+    if (fd < 0) {
+        error_setg_errno(errp, errno, "failed to open '%s'", path);
+        return;
+    }
+
+    f = g_new0(QEMUFileFile, 1);
+    f->fd = fd;
+    /* Without a header the stream starts at the beginning of the file */
+    if (mapped_ram_read_header(fd, &f->base) < 0) {
+        f->base = 0;
+    }
+    trace_file_start_incoming_migration(path, f->base);
+
+    file = qemu_fopen_ops(f, &file_read_ops);
+    qemu_set_fd_handler(fd, file_accept_incoming_migration, NULL, file);
+}
@@ -0,0 +1,644 @@
+/*
+ * Multiple channel (multifd) RAM transfer for migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * With the x-multifd capability the page data of normal RAM pages is sent
+ * over x-multifd-channels extra sockets, each driven by its own thread,
+ * while the main migration stream carries everything else (zero pages,
+ * device state) and the synchronisation points.
+ *
+ * Each channel starts with a hello (magic, version, channel id) and then
+ * carries packets of up to MULTIFD_PAGES_PER_PACKET pages of one RAMBlock:
+ *
+ *    MultiFDPacketHdr
+ *    be64 offset within the RAMBlock, one per page
+ *    the page data, one page after the other
+ *
+ * A packet with MULTIFD_FLAG_SYNC set and no pages marks the end of a
+ * ram_save_iterate() round; the destination waits for all channels to
+ * reach it before loading anything after the matching sync on the main
+ * stream, so a page resent in a later round can't be overwritten by a
+ * stale copy still in flight on another channel.
+ */
+
+#include <glib.h>
+
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/rcu.h"
+#include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "migration/migration.h"
+#include "migration/multifd.h"
+#include "trace.h"
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+/* Pages per packet; 64 pages of 4k is 256k per writev */
+#define MULTIFD_PAGES_PER_PACKET 64
+
+typedef struct QEMU_PACKED {
+    uint32_t magic;
+    uint32_t version;
+    uint8_t id;
+} MultiFDHello;
+
+typedef struct QEMU_PACKED {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t pages;
+    uint32_t page_size;
+    char ramblock[256];
+} MultiFDPacketHdr;
+
+typedef struct {
+    /* RAMBlock all the pages belong to */
+    const char *block_name;
+    uint32_t num;
+    size_t page_size;
+    uint64_t offset[MULTIFD_PAGES_PER_PACKET];
+    /* Point straight into guest RAM */
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+typedef struct {
+    uint8_t id;
+    QemuThread thread;
+    /* -1 until the thread has connected */
+    int fd;
+    /* Kicks the thread when there's a job, a sync or it has to quit */
+    QemuSemaphore sem;
+    /* Posted once the requested sync packet has been sent */
+    QemuSemaphore sem_sync;
+    /* Protects the fields below */
+    QemuMutex mutex;
+    bool quit;
+    bool pending_job;
+    bool pending_sync;
+    /* Pages to send when pending_job is set, owned by the thread */
+    MultiFDPages *pages;
+} MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    int count;
+    /* Number of channels without a job */
+    QemuSemaphore channels_ready;
+    /* Pages being collected by the migration thread */
+    MultiFDPages *pages;
+    /* Next channel to try */
+    int next_channel;
+    /* Set by a channel thread that failed */
+    bool error;
+} *multifd_send_state;
+
+static char *multifd_outgoing_addr;
+
+void multifd_set_outgoing_address(const char *host_port)
+{
+    g_free(multifd_outgoing_addr);
+    multifd_outgoing_addr = g_strdup(host_port);
+}
+
+static int multifd_send_iov(int fd, struct iovec *iov, unsigned int iovcnt,
+                            size_t bytes)
+{
+    ssize_t ret = iov_send(fd, iov, iovcnt, 0, bytes);
+
+    return ret == bytes ? 0 : -1;
+}
+
+static int multifd_send_packet(MultiFDSendParams *p, MultiFDPages *pages,
+                               uint32_t flags)
+{
+    MultiFDPacketHdr hdr;
+    struct iovec iov[2 + MULTIFD_PAGES_PER_PACKET];
+    uint32_t num = pages ? pages->num : 0;
+    size_t bytes;
+    uint32_t i;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = cpu_to_be32(MULTIFD_MAGIC);
+    hdr.flags = cpu_to_be32(flags);
+    hdr.pages = cpu_to_be32(num);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    bytes = sizeof(hdr);
+
+    if (num) {
+        hdr.page_size = cpu_to_be32(pages->page_size);
+        pstrcpy(hdr.ramblock, sizeof(hdr.ramblock), pages->block_name);
+        for (i = 0; i < num; i++) {
+            pages->offset[i] = cpu_to_be64(pages->offset[i]);
+        }
+        iov[1].iov_base = pages->offset;
+        iov[1].iov_len = num * sizeof(uint64_t);
+        bytes += iov[1].iov_len;
+        memcpy(&iov[2], pages->iov, num * sizeof(struct iovec));
+        bytes += num * pages->page_size;
+    }
+
+    trace_multifd_send_packet(p->id, flags, num);
+    return multifd_send_iov(p->fd, iov, num ? 2 + num : 1, bytes);
+}
+
+static void multifd_send_set_error(MultiFDSendParams *p)
+{
+    error_report("multifd: channel %d failed", p->id);
+    atomic_mb_set(&multifd_send_state->error, true);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    Error *local_err = NULL;
+    MultiFDHello hello;
+    struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+    bool failed = false;
+    int fd;
+
+    trace_multifd_send_thread_start(p->id);
+    fd = inet_connect(multifd_outgoing_addr, &local_err);
+    if (fd < 0) {
+        error_report_err(local_err);
+        failed = true;
+    } else {
+        qemu_set_block(fd);
+        hello.magic = cpu_to_be32(MULTIFD_MAGIC);
+        hello.version = cpu_to_be32(MULTIFD_VERSION);
+        hello.id = p->id;
+        if (multifd_send_iov(fd, &iov, 1, sizeof(hello))) {
+            failed = true;
+        }
+    }
+    qemu_mutex_lock(&p->mutex);
+    p->fd = fd;
+    qemu_mutex_unlock(&p->mutex);
+    if (failed) {
+        multifd_send_set_error(p);
+    }
+    /* Ready for the first job */
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    /*
+     * Once failed, the thread carries on acknowledging jobs and syncs
+     * without sending anything so nobody waits on it forever; the
+     * migration thread notices the error and gives up.
+     */
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->pending_job) {
+            MultiFDPages *pages = p->pages;
+
+            qemu_mutex_unlock(&p->mutex);
+            if (!failed && multifd_send_packet(p, pages, 0)) {
+                failed = true;
+                multifd_send_set_error(p);
+            }
+            qemu_mutex_lock(&p->mutex);
+            pages->num = 0;
+            p->pending_job = false;
+            qemu_mutex_unlock(&p->mutex);
+            qemu_sem_post(&multifd_send_state->channels_ready);
+            qemu_mutex_lock(&p->mutex);
+        }
+        if (p->pending_sync) {
+            p->pending_sync = false;
+            qemu_mutex_unlock(&p->mutex);
+            if (!failed && multifd_send_packet(p, NULL, MULTIFD_FLAG_SYNC)) {
+                failed = true;
+                multifd_send_set_error(p);
+            }
+            qemu_sem_post(&p->sem_sync);
+            qemu_mutex_lock(&p->mutex);
+        }
+        if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+
+    trace_multifd_send_thread_end(p->id);
+    return NULL;
+}
+
+int multifd_save_setup(Error **errp)
+{
+    int i, count;
+
+    if (!migrate_use_multifd()) {
+        return 0;
+    }
+    if (!multifd_outgoing_addr) {
+        error_setg(errp, "multifd needs a tcp: migration URI");
+        return -1;
+    }
+
+    count = migrate_multifd_channels();
+    multifd_send_state = g_new0(typeof(*multifd_send_state), 1);
+    multifd_send_state->params = g_new0(MultiFDSendParams, count);
+    multifd_send_state->count = count;
+    multifd_send_state->pages = g_new0(MultiFDPages, 1);
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+
+    for (i = 0; i < count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        p->id = i;
+        p->fd = -1;
+        p->pages = g_new0(MultiFDPages, 1);
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        qemu_sem_init(&p->sem_sync, 0);
+        qemu_thread_create(&p->thread, "multifd/send", multifd_send_thread,
+                           p, QEMU_THREAD_JOINABLE);
+    }
+
+    return 0;
+}
+
+void multifd_save_cleanup(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        goto out;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        if (p->fd != -1) {
+            /* Kick it out of a send to a peer that's gone away */
+            shutdown(p->fd, SHUT_RDWR);
+        }
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_thread_join(&p->thread);
+        if (p->fd != -1) {
+            closesocket(p->fd);
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+        qemu_sem_destroy(&p->sem_sync);
+        g_free(p->pages);
+    }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    g_free(multifd_send_state->pages);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+
+out:
+    g_free(multifd_outgoing_addr);
+    multifd_outgoing_addr = NULL;
+}
+
+/* Hand the collected pages to the next idle channel */
+static int multifd_send_pages(void)
+{
+    MultiFDSendParams *p;
+    MultiFDPages *pages = multifd_send_state->pages;
+    int i;
+
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    if (atomic_mb_read(&multifd_send_state->error)) {
+        return -1;
+    }
+    for (i = multifd_send_state->next_channel;;
+         i = (i + 1) % multifd_send_state->count) {
+        p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending_job) {
+            p->pending_job = true;
+            multifd_send_state->next_channel =
+                (i + 1) % multifd_send_state->count;
+            break;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    /* Swap buffers; the idle one of the channel is empty */
+    multifd_send_state->pages = p->pages;
+    p->pages = pages;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    return 0;
+}
+
+int multifd_queue_page(const char *block_name, uint8_t *host,
+                       ram_addr_t offset, size_t size)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+
+    if (pages->num && pages->block_name != block_name) {
+        if (multifd_send_pages()) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+    }
+
+    pages->block_name = block_name;
+    pages->page_size = size;
+    pages->offset[pages->num] = offset;
+    pages->iov[pages->num].iov_base = host + offset;
+    pages->iov[pages->num].iov_len = size;
+    pages->num++;
+
+    if (pages->num == MULTIFD_PAGES_PER_PACKET) {
+        return multifd_send_pages();
+    }
+
+    return 0;
+}
+
+int multifd_send_sync_main(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return 0;
+    }
+    if (multifd_send_state->pages->num && multifd_send_pages()) {
+        return -1;
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->pending_sync = true;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+    for (i = 0; i < multifd_send_state->count; i++) {
+        qemu_sem_wait(&multifd_send_state->params[i].sem_sync);
+    }
+    trace_multifd_send_sync_main();
+
+    return atomic_mb_read(&multifd_send_state->error) ? -1 : 0;
+}
+
+/* Destination side */
+
+typedef struct {
+    uint8_t id;
+    QemuThread thread;
+    bool running;
+    int fd;
+    /* Posted each time a sync packet arrives */
+    QemuSemaphore sem_sync;
+    uint64_t offset[MULTIFD_PAGES_PER_PACKET];
+    struct iovec iov[MULTIFD_PAGES_PER_PACKET];
+} MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    int count;
+    int listen_fd;
+    QemuThread accept_thread;
+    /* Protects fd and running of the channels */
+    QemuMutex mutex;
+    bool error;
+} *multifd_recv_state;
+
+static void multifd_recv_set_error(void)
+{
+    int i;
+
+    atomic_mb_set(&multifd_recv_state->error, true);
+    /* Nobody is going to send the syncs the main thread may wait for */
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+}
+
+static int multifd_recv_iov(int fd, struct iovec *iov, unsigned int iovcnt,
+                            size_t bytes)
+{
+    ssize_t ret = iov_recv(fd, iov, iovcnt, 0, bytes);
+
+    return ret == bytes ? 0 : -1;
+}
+
+static int multifd_recv_pages(MultiFDRecvParams *p, MultiFDPacketHdr *hdr,
+                              uint32_t num)
+{
+    size_t page_size = be32_to_cpu(hdr->page_size);
+    struct iovec iov;
+    uint32_t i;
+    int ret = 0;
+
+    if (num > MULTIFD_PAGES_PER_PACKET) {
+        error_report("multifd: too many pages in a packet: %u", num);
+        return -1;
+    }
+    iov.iov_base = p->offset;
+    iov.iov_len = num * sizeof(uint64_t);
+    if (multifd_recv_iov(p->fd, &iov, 1, iov.iov_len)) {
+        return -1;
+    }
+
+    hdr->ramblock[sizeof(hdr->ramblock) - 1] = '\0';
+    rcu_read_lock();
+    for (i = 0; i < num; i++) {
+        void *host = ram_multifd_host_from_name(hdr->ramblock,
+                                                be64_to_cpu(p->offset[i]),
+                                                page_size);
+        if (!host) {
+            error_report("multifd: bad page %s/%" PRIx64, hdr->ramblock,
+                         be64_to_cpu(p->offset[i]));
+            ret = -1;
+            goto out;
+        }
+        p->iov[i].iov_base = host;
+        p->iov[i].iov_len = page_size;
+    }
+    /* Straight into guest RAM */
+    ret = multifd_recv_iov(p->fd, p->iov, num, num * page_size);
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    MultiFDPacketHdr hdr;
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+
+    rcu_register_thread();
+    trace_multifd_recv_thread_start(p->id);
+    while (true) {
+        uint32_t flags, num;
+
+        if (multifd_recv_iov(p->fd, &iov, 1, sizeof(hdr))) {
+            /* The source closes the channels once it's done */
+            break;
+        }
+        if (be32_to_cpu(hdr.magic) != MULTIFD_MAGIC) {
+            error_report("multifd: bad packet magic on channel %d", p->id);
+            multifd_recv_set_error();
+            break;
+        }
+        flags = be32_to_cpu(hdr.flags);
+        num = be32_to_cpu(hdr.pages);
+        trace_multifd_recv_packet(p->id, flags, num);
+
+        if (num && multifd_recv_pages(p, &hdr, num)) {
+            error_report("multifd: failed to receive pages on channel %d",
+                         p->id);
+            multifd_recv_set_error();
+            break;
+        }
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&p->sem_sync);
+        }
+    }
+    trace_multifd_recv_thread_end(p->id);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void *multifd_accept_thread(void *opaque)
+{
+    int accepted = 0;
+
+    while (accepted < multifd_recv_state->count) {
+        MultiFDRecvParams *p;
+        MultiFDHello hello;
+        struct iovec iov = { .iov_base = &hello, .iov_len = sizeof(hello) };
+        int fd;
+
+        fd = qemu_accept(multifd_recv_state->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (socket_error() == EINTR) {
+                continue;
+            }
+            /* Also how multifd_load_cleanup() stops us */
+            break;
+        }
+        qemu_set_block(fd);
+        if (multifd_recv_iov(fd, &iov, 1, sizeof(hello)) ||
+            be32_to_cpu(hello.magic) != MULTIFD_MAGIC ||
+            be32_to_cpu(hello.version) != MULTIFD_VERSION ||
+            hello.id >= multifd_recv_state->count ||
+            multifd_recv_state->params[hello.id].running) {
+            error_report("multifd: bad channel hello");
+            closesocket(fd);
+            multifd_recv_set_error();
+            break;
+        }
+
+        p = &multifd_recv_state->params[hello.id];
+        qemu_mutex_lock(&multifd_recv_state->mutex);
+        p->fd = fd;
+        p->running = true;
+        qemu_thread_create(&p->thread, "multifd/recv", multifd_recv_thread,
+                           p, QEMU_THREAD_JOINABLE);
+        qemu_mutex_unlock(&multifd_recv_state->mutex);
+        accepted++;
+    }
+
+    if (accepted < multifd_recv_state->count &&
+        !atomic_mb_read(&multifd_recv_state->error)) {
+        error_report("multifd: only %d of %d channels connected", accepted,
+                     multifd_recv_state->count);
+        multifd_recv_set_error();
+    }
+
+    return NULL;
+}
+
+void multifd_load_setup(int listen_fd)
+{
+    int i, count;
+
+    count = migrate_multifd_channels();
+    multifd_recv_state = g_new0(typeof(*multifd_recv_state), 1);
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, count);
+    multifd_recv_state->count = count;
+    multifd_recv_state->listen_fd = listen_fd;
+    qemu_mutex_init(&multifd_recv_state->mutex);
+
+    for (i = 0; i < count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        p->id = i;
+        p->fd = -1;
+        qemu_sem_init(&p->sem_sync, 0);
+    }
+
+    qemu_set_block(listen_fd);
+    qemu_thread_create(&multifd_recv_state->accept_thread, "multifd/accept",
+                       multifd_accept_thread, NULL, QEMU_THREAD_JOINABLE);
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+
+    /* Kick the accept thread out if some channels never turned up */
+    shutdown(multifd_recv_state->listen_fd, SHUT_RDWR);
+    qemu_thread_join(&multifd_recv_state->accept_thread);
+    closesocket(multifd_recv_state->listen_fd);
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->running) {
+            /* Everything has been synced; don't wait for the source */
+            shutdown(p->fd, SHUT_RDWR);
+            qemu_thread_join(&p->thread);
+            closesocket(p->fd);
+        }
+        qemu_sem_destroy(&p->sem_sync);
+    }
+    qemu_mutex_destroy(&multifd_recv_state->mutex);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd: sync received but x-multifd is not enabled");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        if (atomic_mb_read(&multifd_recv_state->error)) {
+            break;
+        }
+        qemu_sem_wait(&multifd_recv_state->params[i].sem_sync);
+    }
+    trace_multifd_recv_sync_main();
+
+    return atomic_mb_read(&multifd_recv_state->error) ? -EIO : 0;
+}
@@ -0,0 +1,572 @@
+/*
+ * Postcopy migration for RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Postcopy is a migration technique where the execution flips from the
+ * source to the destination before all the data has been copied.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/postcopy-ram.h"
+#include "sysemu/sysemu.h"
+#include "qemu/error-report.h"
+#include "trace.h"
+
+static PostcopyState incoming_postcopy_state;
+
+/* Postcopy needs to detect accesses to pages that haven't yet been copied
+ * across, and efficiently map new pages in, the techniques for doing this
+ * are target OS specific.
+ */
+#if defined(__linux__)
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <asm/types.h> /* for __u64 */
+#endif
+
+#if defined(__linux__) && defined(__NR_userfaultfd) && defined(CONFIG_EVENTFD)
+#define HAVE_USERFAULTFD
+#include <linux/userfaultfd.h>
+
+/* A RAMBlock registered for missing page notifications */
+typedef struct PostcopyRAMRange {
+    char idstr[256];
+    uint8_t *host;
+    size_t length;
+} PostcopyRAMRange;
+
+static bool ufd_version_check(int ufd)
+{
+    struct uffdio_api api_struct;
+    uint64_t ioctl_mask;
+
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+    if (ioctl(ufd, UFFDIO_API, &api_struct)) {
+        error_report("postcopy_ram_supported_by_host: UFFDIO_API failed: %s",
+                     strerror(errno));
+        return false;
+    }
+
+    ioctl_mask = (__u64)1 << _UFFDIO_REGISTER |
+                 (__u64)1 << _UFFDIO_UNREGISTER;
+    if ((api_struct.ioctls & ioctl_mask) != ioctl_mask) {
+        error_report("Missing userfault features: %" PRIx64,
+                     (uint64_t)(~api_struct.ioctls & ioctl_mask));
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Check that a RAMBlock can be registered for missing page notifications
+ * and that the kernel lets us place pages into it; this rules out e.g.
+ * shared or file backed memory on kernels that can't handle it.
+ */
+static int test_range_registrable(const char *block_name, void *host_addr,
+                                  ram_addr_t offset, ram_addr_t length,
+                                  void *opaque)
+{
+    int ufd = *(int *)opaque;
+    struct uffdio_register reg_struct;
+    struct uffdio_range range_struct;
+    uint64_t feature_mask = (__u64)1 << _UFFDIO_COPY |
+                            (__u64)1 << _UFFDIO_ZEROPAGE;
+
+    reg_struct.range.start = (uintptr_t)host_addr;
+    reg_struct.range.len = length;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+    if (ioctl(ufd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("RAMBlock '%s' can't be used for postcopy: %s",
+                     block_name, strerror(errno));
+        return -1;
+    }
+
+    range_struct = reg_struct.range;
+    if (ioctl(ufd, UFFDIO_UNREGISTER, &range_struct)) {
+        error_report("%s: userfault unregister %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+
+    if ((reg_struct.ioctls & feature_mask) != feature_mask) {
+        error_report("RAMBlock '%s' is missing userfault features: %" PRIx64,
+                     block_name,
+                     (uint64_t)(~reg_struct.ioctls & feature_mask));
+        return -1;
+    }
+
+    return 0;
+}
+
+bool postcopy_ram_supported_by_host(void)
+{
+    int ufd = -1;
+    bool ret = false;
+
+    /* We only need a temporary fd here, with no flags */
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd == -1) {
+        error_report("%s: userfaultfd not available: %s", __func__,
+                     strerror(errno));
+        goto out;
+    }
+
+    /* Version and features check */
+    if (!ufd_version_check(ufd)) {
+        goto out;
+    }
+
+    /*
+     * Nothing is faulting guest RAM at this point: the VM hasn't started
+     * and the incoming stream is only read from this thread, so briefly
+     * registering each block can't leave anyone stuck on a fault.
+     */
+    if (qemu_ram_foreach_block(test_range_registrable, &ufd)) {
+        goto out;
+    }
+
+    ret = true;
+out:
+    if (ufd != -1) {
+        close(ufd);
+    }
+    return ret;
+}
+
+/*
+ * Discard the contents of memory start..start+length-1, so that the next
+ * access to the range faults in a page from the source.
+ */
+int postcopy_ram_discard_range(MigrationIncomingState *mis, uint8_t *start,
+                               size_t length)
+{
+    trace_postcopy_ram_discard_range(start, length);
+    if (madvise(start, length, MADV_DONTNEED)) {
+        error_report("%s MADV_DONTNEED: %s", __func__, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Find the registered range containing 'addr', or NULL */
+static PostcopyRAMRange *postcopy_find_range(MigrationIncomingState *mis,
+                                             uint8_t *addr)
+{
+    guint i;
+
+    for (i = 0; i < mis->postcopy_ranges->len; i++) {
+        PostcopyRAMRange *range = &g_array_index(mis->postcopy_ranges,
+                                                 PostcopyRAMRange, i);
+
+        if (addr >= range->host && addr - range->host < range->length) {
+            return range;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Handle faults detected by the USERFAULT markings
+ */
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    struct uffd_msg msg;
+    size_t hostpagesize = getpagesize();
+    PostcopyRAMRange *last_range = NULL;
+    int ret;
+
+    trace_postcopy_ram_fault_thread_entry();
+    qemu_sem_post(&mis->fault_thread_sem);
+
+    while (true) {
+        PostcopyRAMRange *range;
+        ram_addr_t rb_offset;
+        struct pollfd pfd[2];
+        uint8_t *addr;
+
+        /*
+         * We're mainly waiting for the kernel to give us a faulting HVA,
+         * however we can be told to quit via userfault_quit_fd which is
+         * an eventfd
+         */
+        pfd[0].fd = mis->userfault_fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = mis->userfault_quit_fd;
+        pfd[1].events = POLLIN; /* Waiting for eventfd to go positive */
+        pfd[1].revents = 0;
+
+        if (poll(pfd, 2, -1 /* Wait forever */) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            goto fail;
+        }
+
+        if (pfd[1].revents) {
+            trace_postcopy_ram_fault_thread_quit();
+            break;
+        }
+
+        ret = read(mis->userfault_fd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (errno == EAGAIN) {
+                /*
+                 * if a wake up happens on the other thread just after
+                 * the poll, there is nothing to read.
+                 */
+                continue;
+            }
+            if (ret < 0) {
+                error_report("%s: Failed to read full userfault message: %s",
+                             __func__, strerror(errno));
+                goto fail;
+            } else {
+                error_report("%s: Read %d bytes from userfaultfd expected %zd",
+                             __func__, ret, sizeof(msg));
+                goto fail; /* Lost alignment, don't know what we'd read next */
+            }
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            error_report("%s: Read unexpected event %ud from userfaultfd",
+                         __func__, msg.event);
+            continue; /* It's not a page fault, shouldn't happen */
+        }
+
+        addr = (uint8_t *)(uintptr_t)msg.arg.pagefault.address;
+        range = postcopy_find_range(mis, addr);
+        if (!range) {
+            error_report("postcopy_ram_fault_thread: Fault outside guest: %"
+                         PRIx64, (uint64_t)msg.arg.pagefault.address);
+            goto fail;
+        }
+
+        rb_offset = (addr - range->host) & ~(hostpagesize - 1);
+        trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
+                                                range->idstr, rb_offset);
+
+        /*
+         * Send the request to the source - we want to request one
+         * of our host page sizes (which is >= TPS); only name the
+         * RAMBlock when it differs from the previous request.
+         */
+        if (migrate_send_rp_req_pages(mis,
+                                      range != last_range ? range->idstr : NULL,
+                                      rb_offset, hostpagesize)) {
+            error_report("%s: Failed to request page %s:" RAM_ADDR_FMT,
+                         __func__, range->idstr, rb_offset);
+            goto fail;
+        }
+        last_range = range;
+    }
+    trace_postcopy_ram_fault_thread_exit();
+    return NULL;
+
+fail:
+    /*
+     * Nothing asks for the pages the guest faults on any more, so the
+     * migration can't complete: fail the incoming stream, which makes the
+     * listen thread give up and take QEMU down rather than leave the
+     * faulting threads waiting forever.
+     */
+    qemu_file_set_error(mis->file, -EIO);
+    qemu_file_shutdown(mis->file);
+    trace_postcopy_ram_fault_thread_exit();
+    return NULL;
+}
+
+static int ram_block_enable_notify(const char *block_name, void *host_addr,
+                                   ram_addr_t offset, ram_addr_t length,
+                                   void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    struct uffdio_register reg_struct;
+    PostcopyRAMRange range;
+
+    reg_struct.range.start = (uintptr_t)host_addr;
+    reg_struct.range.len = length;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+    /* Now tell our userfault_fd that it's responsible for this area */
+    if (ioctl(mis->userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s userfault register: %s", __func__, strerror(errno));
+        return -1;
+    }
+
+    pstrcpy(range.idstr, sizeof(range.idstr), block_name);
+    range.host = host_addr;
+    range.length = length;
+    g_array_append_val(mis->postcopy_ranges, range);
+
+    return 0;
+}
+
+int postcopy_ram_enable_notify(MigrationIncomingState *mis)
+{
+    /* Open the fd for the kernel to give us userfaults */
+    mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (mis->userfault_fd == -1) {
+        error_report("%s: Failed to open userfault fd: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+
+    /*
+     * Although the host check already tested the API, we need to
+     * do the check again as an ABI handshake on the new fd.
+     */
+    if (!ufd_version_check(mis->userfault_fd)) {
+        close(mis->userfault_fd);
+        mis->userfault_fd = -1;
+        return -1;
+    }
+
+    /* Now an eventfd we use to tell the fault-thread to quit */
+    mis->userfault_quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (mis->userfault_quit_fd == -1) {
+        error_report("%s: Opening userfault_quit_fd: %s", __func__,
+                     strerror(errno));
+        close(mis->userfault_fd);
+        mis->userfault_fd = -1;
+        return -1;
+    }
+
+    mis->postcopy_ranges = g_array_new(false, false,
+                                       sizeof(PostcopyRAMRange));
+
+    /* Mark so that we get notified of accesses to unwritten areas */
+    if (qemu_ram_foreach_block(ram_block_enable_notify, mis)) {
+        return -1;
+    }
+
+    qemu_sem_init(&mis->fault_thread_sem, 0);
+    qemu_thread_create(&mis->fault_thread, "postcopy/fault",
+                       postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
+    qemu_sem_wait(&mis->fault_thread_sem);
+    qemu_sem_destroy(&mis->fault_thread_sem);
+    mis->have_fault_thread = true;
+
+    trace_postcopy_ram_enable_notify();
+
+    return 0;
+}
+
+/*
+ * At the end of migration, undo the effects of postcopy_ram_enable_notify
+ * so that the guest RAM behaves like normal memory again.
+ */
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+{
+    trace_postcopy_ram_incoming_cleanup_entry();
+
+    if (mis->postcopy_ranges) {
+        guint i;
+
+        for (i = 0; i < mis->postcopy_ranges->len; i++) {
+            PostcopyRAMRange *range = &g_array_index(mis->postcopy_ranges,
+                                                     PostcopyRAMRange, i);
+            struct uffdio_range range_struct;
+
+            range_struct.start = (uintptr_t)range->host;
+            range_struct.len = range->length;
+            if (ioctl(mis->userfault_fd, UFFDIO_UNREGISTER, &range_struct)) {
+                error_report("%s: userfault unregister %s", __func__,
+                             strerror(errno));
+                return -1;
+            }
+        }
+        g_array_free(mis->postcopy_ranges, true);
+        mis->postcopy_ranges = NULL;
+    }
+
+    if (mis->have_fault_thread) {
+        uint64_t tmp64 = 1;
+
+        /*
+         * Tell the fault_thread to exit, it's an eventfd that should
+         * currently be at 0, we're going to increment it to 1
+         */
+        if (write(mis->userfault_quit_fd, &tmp64, 8) == 8) {
+            trace_postcopy_ram_incoming_cleanup_join();
+            qemu_thread_join(&mis->fault_thread);
+        } else {
+            /* Not much we can do here, but may as well report it */
+            error_report("%s: incrementing userfault_quit_fd: %s", __func__,
+                         strerror(errno));
+        }
+        mis->have_fault_thread = false;
+    }
+
+    if (mis->userfault_quit_fd != -1) {
+        close(mis->userfault_quit_fd);
+        mis->userfault_quit_fd = -1;
+    }
+    if (mis->userfault_fd != -1) {
+        close(mis->userfault_fd);
+        mis->userfault_fd = -1;
+    }
+
+    postcopy_state_set(POSTCOPY_INCOMING_END);
+
+    if (mis->postcopy_tmp_page) {
+        munmap(mis->postcopy_tmp_page, getpagesize());
+        mis->postcopy_tmp_page = NULL;
+    }
+    trace_postcopy_ram_incoming_cleanup_exit();
+    return 0;
+}
+
+/*
+ * Place a host page (from) at (host) atomically
+ * returns 0 on success
+ */
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
+{
+    struct uffdio_copy copy_struct;
+
+    copy_struct.dst = (uint64_t)(uintptr_t)host;
+    copy_struct.src = (uint64_t)(uintptr_t)from;
+    copy_struct.len = getpagesize();
+    copy_struct.mode = 0;
+
+    /* copy also acks to the kernel waking the stalled thread up */
+    if (ioctl(mis->userfault_fd, UFFDIO_COPY, &copy_struct)) {
+        int e = errno;
+        error_report("%s: %s copy host: %p from: %p",
+                     __func__, strerror(e), host, from);
+
+        return -e;
+    }
+
+    trace_postcopy_place_page(host);
+    return 0;
+}
+
+/*
+ * Place a zero page at (host) atomically
+ * returns 0 on success
+ */
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
+{
+    struct uffdio_zeropage zero_struct;
+
+    zero_struct.range.start = (uint64_t)(uintptr_t)host;
+    zero_struct.range.len = getpagesize();
+    zero_struct.mode = 0;
+
+    if (ioctl(mis->userfault_fd, UFFDIO_ZEROPAGE, &zero_struct)) {
+        int e = errno;
+        error_report("%s: %s zero host: %p",
+                     __func__, strerror(e), host);
+
+        return -e;
+    }
+
+    trace_postcopy_place_page_zero(host);
+    return 0;
+}
+
+/*
+ * Returns a target page of memory that can be mapped at a later point in time
+ * using postcopy_place_page
+ * The same address is used repeatedly, postcopy_place_page just takes the
+ * backing page away.
+ * Returns: Pointer to allocated page
+ *
+ */
+void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+{
+    if (!mis->postcopy_tmp_page) {
+        mis->postcopy_tmp_page = mmap(NULL, getpagesize(),
+                             PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                             MAP_ANONYMOUS, -1, 0);
+        if (mis->postcopy_tmp_page == MAP_FAILED) {
+            mis->postcopy_tmp_page = NULL;
+            error_report("%s: %s", __func__, strerror(errno));
+            return NULL;
+        }
+    }
+
+    return mis->postcopy_tmp_page;
+}
+
+#else
+/* No target OS support, stubs just fail */
+bool postcopy_ram_supported_by_host(void)
+{
+    error_report("%s: No OS support", __func__);
+    return false;
+}
+
+int postcopy_ram_discard_range(MigrationIncomingState *mis, uint8_t *start,
+                               size_t length)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_ram_enable_notify(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
+{
+    assert(0);
+    return -1;
+}
+
+void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+{
+    assert(0);
+    return NULL;
+}
+
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+PostcopyState postcopy_state_get(void)
+{
+    return atomic_mb_read(&incoming_postcopy_state);
+}
+
+/* Set the state and return the old state */
+PostcopyState postcopy_state_set(PostcopyState new_state)
+{
+    return atomic_xchg(&incoming_postcopy_state, new_state);
+}
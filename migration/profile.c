@@ -0,0 +1,252 @@
+/*
+ * Timelines of where the time of a migration goes
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+#include "qemu-common.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qapi/qmp/qjson.h"
+#include "qapi/qmp/types.h"
+#include "qmp-commands.h"
+#include "migration/profile.h"
+#include "trace.h"
+
+typedef struct MigrationProfileRecord {
+    char *name;
+    /* -1 for the phases */
+    int64_t instance_id;
+    int64_t start;
+    int64_t duration;
+} MigrationProfileRecord;
+
+typedef struct MigrationProfileState {
+    bool valid;
+    bool active;
+    int64_t t0;
+    int64_t total;
+    GArray *phases;
+    GArray *devices;
+} MigrationProfileState;
+
+static MigrationProfileState profiles[MIGRATION_PROFILE__MAX];
+
+static const char *const side_names[MIGRATION_PROFILE__MAX] = {
+    [MIGRATION_PROFILE_SAVE] = "save",
+    [MIGRATION_PROFILE_LOAD] = "load",
+};
+
+int64_t migration_profile_now(void)
+{
+    return qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+}
+
+static void migration_profile_clear(GArray *records)
+{
+    guint i;
+
+    for (i = 0; i < records->len; i++) {
+        g_free(g_array_index(records, MigrationProfileRecord, i).name);
+    }
+    g_array_set_size(records, 0);
+}
+
+void migration_profile_start(MigrationProfileSide side)
+{
+    MigrationProfileState *p = &profiles[side];
+
+    if (!p->phases) {
+        p->phases = g_array_new(false, false, sizeof(MigrationProfileRecord));
+        p->devices = g_array_new(false, false,
+                                 sizeof(MigrationProfileRecord));
+    }
+    migration_profile_clear(p->phases);
+    migration_profile_clear(p->devices);
+    p->t0 = migration_profile_now();
+    p->total = 0;
+    p->valid = true;
+    p->active = true;
+}
+
+void migration_profile_finish(MigrationProfileSide side)
+{
+    MigrationProfileState *p = &profiles[side];
+
+    if (!p->active) {
+        return;
+    }
+    p->total = migration_profile_now() - p->t0;
+    p->active = false;
+    trace_migration_profile_finish(side_names[side], p->total);
+}
+
+void migration_profile_phase(MigrationProfileSide side, const char *name,
+                             int64_t start)
+{
+    MigrationProfileState *p = &profiles[side];
+    MigrationProfileRecord r;
+
+    if (!p->active || !qemu_mutex_iothread_locked()) {
+        return;
+    }
+    r.name = g_strdup(name);
+    r.instance_id = -1;
+    r.start = start - p->t0;
+    r.duration = migration_profile_now() - start;
+    g_array_append_val(p->phases, r);
+    trace_migration_profile_phase(side_names[side], name, r.start,
+                                  r.duration);
+}
+
+void migration_profile_device(MigrationProfileSide side, const char *idstr,
+                              uint32_t instance_id, int64_t start)
+{
+    MigrationProfileState *p = &profiles[side];
+    MigrationProfileRecord r, *last;
+    int64_t duration = migration_profile_now() - start;
+    guint i;
+
+    /* e.g. the postcopy listen thread, loading devices on its own */
+    if (!p->active || !qemu_mutex_iothread_locked()) {
+        return;
+    }
+    trace_migration_profile_device(side_names[side], idstr, instance_id,
+                                   start - p->t0, duration);
+
+    if (side == MIGRATION_PROFILE_LOAD) {
+        for (i = 0; i < p->devices->len; i++) {
+            last = &g_array_index(p->devices, MigrationProfileRecord, i);
+            if (last->instance_id == instance_id &&
+                !strcmp(last->name, idstr)) {
+                last->duration += duration;
+                return;
+            }
+        }
+    }
+    r.name = g_strdup(idstr);
+    r.instance_id = instance_id;
+    r.start = start - p->t0;
+    r.duration = duration;
+    g_array_append_val(p->devices, r);
+}
+
+static MigrationProfileEntryList *migration_profile_entries(GArray *records)
+{
+    MigrationProfileEntryList *head = NULL, **tail = &head;
+    guint i;
+
+    for (i = 0; i < records->len; i++) {
+        MigrationProfileRecord *r;
+        MigrationProfileEntryList *e;
+
+        r = &g_array_index(records, MigrationProfileRecord, i);
+        e = g_new0(MigrationProfileEntryList, 1);
+        e->value = g_new0(MigrationProfileEntry, 1);
+        e->value->name = g_strdup(r->name);
+        e->value->has_instance_id = r->instance_id >= 0;
+        e->value->instance_id = r->instance_id;
+        e->value->start = r->start;
+        e->value->duration = r->duration;
+        *tail = e;
+        tail = &e->next;
+    }
+    return head;
+}
+
+static MigrationProfileTimeline *
+migration_profile_timeline(MigrationProfileSide side)
+{
+    MigrationProfileState *p = &profiles[side];
+    MigrationProfileTimeline *t;
+
+    t = g_new0(MigrationProfileTimeline, 1);
+    t->total = p->active ? migration_profile_now() - p->t0 : p->total;
+    t->phases = migration_profile_entries(p->phases);
+    t->devices = migration_profile_entries(p->devices);
+    return t;
+}
+
+MigrationProfile *qmp_query_migrate_profile(Error **errp)
+{
+    MigrationProfile *info = g_new0(MigrationProfile, 1);
+
+    if (profiles[MIGRATION_PROFILE_SAVE].valid) {
+        info->has_save = true;
+        info->save = migration_profile_timeline(MIGRATION_PROFILE_SAVE);
+    }
+    if (profiles[MIGRATION_PROFILE_LOAD].valid) {
+        info->has_load = true;
+        info->load = migration_profile_timeline(MIGRATION_PROFILE_LOAD);
+    }
+    return info;
+}
+
+/* One complete ("X") event of the trace event format */
+static void migration_profile_dump_records(QList *events, GArray *records,
+                                           int pid, int tid)
+{
+    guint i;
+
+    for (i = 0; i < records->len; i++) {
+        MigrationProfileRecord *r;
+        QDict *event = qdict_new();
+
+        r = &g_array_index(records, MigrationProfileRecord, i);
+        qdict_put(event, "name", qstring_from_str(r->name));
+        qdict_put(event, "ph", qstring_from_str("X"));
+        qdict_put(event, "pid", qint_from_int(pid));
+        qdict_put(event, "tid", qint_from_int(tid));
+        qdict_put(event, "ts", qint_from_int(r->start));
+        qdict_put(event, "dur", qint_from_int(r->duration));
+        if (r->instance_id >= 0) {
+            QDict *args = qdict_new();
+
+            qdict_put(args, "instance-id", qint_from_int(r->instance_id));
+            qdict_put(event, "args", args);
+        }
+        qlist_append(events, event);
+    }
+}
+
+void qmp_x_migrate_profile_dump(const char *filename, Error **errp)
+{
+    QDict *dump = qdict_new();
+    QList *events = qlist_new();
+    QString *json;
+    GError *gerr = NULL;
+    int side;
+
+    for (side = 0; side < MIGRATION_PROFILE__MAX; side++) {
+        MigrationProfileState *p = &profiles[side];
+        QDict *meta, *args;
+
+        if (!p->valid) {
+            continue;
+        }
+        /* Each side is a process, phases and devices are its threads */
+        args = qdict_new();
+        qdict_put(args, "name", qstring_from_str(side_names[side]));
+        meta = qdict_new();
+        qdict_put(meta, "name", qstring_from_str("process_name"));
+        qdict_put(meta, "ph", qstring_from_str("M"));
+        qdict_put(meta, "pid", qint_from_int(side));
+        qdict_put(meta, "args", args);
+        qlist_append(events, meta);
+
+        migration_profile_dump_records(events, p->phases, side, 0);
+        migration_profile_dump_records(events, p->devices, side, 1);
+    }
+    qdict_put(dump, "traceEvents", events);
+    qdict_put(dump, "displayTimeUnit", qstring_from_str("ms"));
+
+    json = qobject_to_json_pretty(QOBJECT(dump));
+    if (!g_file_set_contents(filename, qstring_get_str(json), -1, &gerr)) {
+        error_setg(errp, "Could not write '%s': %s", filename,
+                   gerr->message);
+        g_error_free(gerr);
+    }
+    QDECREF(json);
+    QDECREF(dump);
+}
@@ -29,7 +29,11 @@
 #include "qemu/iov.h"
 
 #define IO_BUF_SIZE 32768
-#define MAX_IOV_SIZE MIN(IOV_MAX, 64)
+/*
+ * A RAM page normally takes two entries (its header in buf and the page
+ * itself), so this lets a single writev carry several hundred pages.
+ */
+#define MAX_IOV_SIZE MIN(IOV_MAX, 1024)
 
 struct QEMUFile {
     const QEMUFileOps *ops;
@@ -46,6 +50,8 @@ struct QEMUFile {
 
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
+    /* Sum of the lengths in iov */
+    size_t iov_bytes;
 
     int last_error;
 };
@@ -22,6 +22,7 @@
  * THE SOFTWARE.
  */
 #include "qemu-common.h"
+#include "qemu/error-report.h"
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
 #include "qemu/coroutine.h"
@@ -39,12 +40,44 @@ static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
     QEMUFileSocket *s = opaque;
     ssize_t len;
     ssize_t size = iov_size(iov, iovcnt);
+    ssize_t offset = 0;
+    int     err;
 
-    len = iov_send(s->fd, iov, iovcnt, 0, size);
-    if (len < size) {
-        len = -socket_error();
+    while (size > 0) {
+        len = iov_send(s->fd, iov, iovcnt, offset, size);
+
+        if (len > 0) {
+            size -= len;
+            offset += len;
+        }
+
+        if (size > 0) {
+            GPollFD pfd;
+
+            err = socket_error();
+
+            if (err != EAGAIN && err != EWOULDBLOCK) {
+                error_report("socket_writev_buffer: Got err=%d for (%zu/%zu)",
+                             err, (size_t)size, (size_t)len);
+                /*
+                 * If I've already sent some but only just got the error, I
+                 * could return the amount validly sent so far and wait for the
+                 * next call to report the error, but I'd rather flag the error
+                 * immediately.
+                 */
+                return -err;
+            }
+
+            /* Emulate blocking; the return path may share a non-blocking fd */
+            pfd.fd = s->fd;
+            pfd.events = G_IO_OUT | G_IO_ERR;
+            pfd.revents = 0;
+            TFR(err = g_poll(&pfd, 1, -1 /* no timeout */));
+            /* Errors other than EINTR intentionally ignored */
+        }
     }
-    return len;
+
+    return offset;
 }
 
 static int socket_get_fd(void *opaque)
@@ -66,7 +99,16 @@ static ssize_t socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
             break;
         }
         if (socket_error() == EAGAIN) {
-            yield_until_fd_readable(s->fd);
+            if (qemu_in_coroutine()) {
+                yield_until_fd_readable(s->fd);
+            } else {
+                /* Return path readers run in their own thread */
+                GPollFD pfd = {
+                    .fd = s->fd,
+                    .events = G_IO_IN | G_IO_HUP | G_IO_ERR,
+                };
+                TFR(g_poll(&pfd, 1, -1 /* no timeout */));
+            }
         } else if (socket_error() != EINTR) {
             break;
         }
@@ -97,6 +139,8 @@ static int socket_shutdown(void *opaque, bool rd, bool wr)
     }
 }
 
+static QEMUFile *socket_get_return_path(void *opaque);
+
 static ssize_t unix_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
                                   int64_t pos)
 {
@@ -206,20 +250,53 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
 }
 
 static const QEMUFileOps socket_read_ops = {
-    .get_fd     = socket_get_fd,
-    .get_buffer = socket_get_buffer,
-    .close      = socket_close,
-    .shut_down  = socket_shutdown
-
+    .get_fd          = socket_get_fd,
+    .get_buffer      = socket_get_buffer,
+    .close           = socket_close,
+    .shut_down       = socket_shutdown,
+    .get_return_path = socket_get_return_path
 };
 
 static const QEMUFileOps socket_write_ops = {
-    .get_fd        = socket_get_fd,
-    .writev_buffer = socket_writev_buffer,
-    .close         = socket_close,
-    .shut_down     = socket_shutdown
+    .get_fd          = socket_get_fd,
+    .writev_buffer   = socket_writev_buffer,
+    .close           = socket_close,
+    .shut_down       = socket_shutdown,
+    .get_return_path = socket_get_return_path
 };
 
+/*
+ * Give a QEMUFile* off the same socket but data in the opposite
+ * direction.  The fd is dup'd so that each QEMUFile can be closed
+ * independently.
+ */
+static QEMUFile *socket_get_return_path(void *opaque)
+{
+    QEMUFileSocket *forward = opaque;
+    QEMUFileSocket *reverse;
+    int fd;
+
+    if (qemu_file_get_error(forward->file)) {
+        /* If the forward file is in error, don't try and open a return */
+        return NULL;
+    }
+
+    fd = dup(forward->fd);
+    if (fd == -1) {
+        return NULL;
+    }
+
+    reverse = g_new0(QEMUFileSocket, 1);
+    reverse->fd = fd;
+    if (forward->file->ops == &socket_read_ops) {
+        /* being called from the read side, so we need to be able to write */
+        reverse->file = qemu_fopen_ops(reverse, &socket_write_ops);
+    } else {
+        reverse->file = qemu_fopen_ops(reverse, &socket_read_ops);
+    }
+    return reverse->file;
+}
+
 QEMUFile *qemu_fopen_socket(int fd, const char *mode)
 {
     QEMUFileSocket *s;
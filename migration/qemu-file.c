@@ -44,6 +44,18 @@ int qemu_file_shutdown(QEMUFile *f)
     return f->ops->shut_down(f->opaque, true, true);
 }
 
+/*
+ * Result: QEMUFile* for a 'return path' for comms in the opposite direction
+ *         NULL if not available
+ */
+QEMUFile *qemu_file_get_return_path(QEMUFile *f)
+{
+    if (!f->ops->get_return_path) {
+        return NULL;
+    }
+    return f->ops->get_return_path(f->opaque);
+}
+
 bool qemu_file_mode_is_not_valid(const char *mode)
 {
     if (mode == NULL ||
@@ -119,6 +131,7 @@ void qemu_fflush(QEMUFile *f)
     }
     f->buf_index = 0;
     f->iovcnt = 0;
+    f->iov_bytes = 0;
     if (ret < 0) {
         qemu_file_set_error(f, ret);
     }
@@ -234,6 +247,24 @@ int qemu_get_fd(QEMUFile *f)
     return -1;
 }
 
+/*
+ * Switch the underlying fd between blocking and non-blocking mode; used
+ * when a file read from a coroutine is handed over to a thread.
+ */
+void qemu_file_set_blocking(QEMUFile *f, bool block)
+{
+    int fd = qemu_get_fd(f);
+
+    if (fd == -1) {
+        return;
+    }
+    if (block) {
+        qemu_set_block(fd);
+    } else {
+        qemu_set_nonblock(fd);
+    }
+}
+
 void qemu_update_position(QEMUFile *f, size_t size)
 {
     f->pos += size;
@@ -280,6 +311,7 @@ static void add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size)
         f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
         f->iov[f->iovcnt++].iov_len = size;
     }
+    f->iov_bytes += size;
 
     if (f->iovcnt >= MAX_IOV_SIZE) {
         qemu_fflush(f);
@@ -466,12 +498,9 @@ int qemu_get_byte(QEMUFile *f)
 int64_t qemu_ftell_fast(QEMUFile *f)
 {
     int64_t ret = f->pos;
-    int i;
 
     if (f->ops->writev_buffer) {
-        for (i = 0; i < f->iovcnt; i++) {
-            ret += f->iov[i].iov_len;
-        }
+        ret += f->iov_bytes;
     } else {
         ret += f->buf_index;
     }
@@ -511,50 +540,66 @@ void qemu_file_reset_rate_limit(QEMUFile *f)
     f->bytes_xfer = 0;
 }
 
+/*
+ * Count @len bytes sent on behalf of @f by other means (e.g. the multifd
+ * channels) against its rate limit.
+ */
+void qemu_file_acct_rate_limit(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
+/*
+ * The multi-byte accessors go through the buffer functions so that each
+ * value costs one copy (and one iovec entry) rather than one per byte.
+ */
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
-    qemu_put_byte(f, v >> 8);
-    qemu_put_byte(f, v);
+    uint8_t buf[2];
+
+    stw_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
 void qemu_put_be32(QEMUFile *f, unsigned int v)
 {
-    qemu_put_byte(f, v >> 24);
-    qemu_put_byte(f, v >> 16);
-    qemu_put_byte(f, v >> 8);
-    qemu_put_byte(f, v);
+    uint8_t buf[4];
+
+    stl_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
 void qemu_put_be64(QEMUFile *f, uint64_t v)
 {
-    qemu_put_be32(f, v >> 32);
-    qemu_put_be32(f, v);
+    uint8_t buf[8];
+
+    stq_be_p(buf, v);
+    qemu_put_buffer(f, buf, sizeof(buf));
 }
 
+/* Like the byte accessors, a short read gives zeroes for the missing bytes */
 unsigned int qemu_get_be16(QEMUFile *f)
 {
-    unsigned int v;
-    v = qemu_get_byte(f) << 8;
-    v |= qemu_get_byte(f);
-    return v;
+    uint8_t buf[2] = { 0 };
+
+    qemu_get_buffer(f, buf, sizeof(buf));
+    return lduw_be_p(buf);
 }
 
 unsigned int qemu_get_be32(QEMUFile *f)
 {
-    unsigned int v;
-    v = (unsigned int)qemu_get_byte(f) << 24;
-    v |= qemu_get_byte(f) << 16;
-    v |= qemu_get_byte(f) << 8;
-    v |= qemu_get_byte(f);
-    return v;
+    uint8_t buf[4] = { 0 };
+
+    qemu_get_buffer(f, buf, sizeof(buf));
+    return ldl_be_p(buf);
 }
 
 uint64_t qemu_get_be64(QEMUFile *f)
 {
-    uint64_t v;
-    v = (uint64_t)qemu_get_be32(f) << 32;
-    v |= qemu_get_be32(f);
-    return v;
+    uint8_t buf[8] = { 0 };
+
+    qemu_get_buffer(f, buf, sizeof(buf));
+    return ldq_be_p(buf);
 }
 
 /* compress size bytes of data start at p with specific compression
@@ -26,17 +26,25 @@
  * THE SOFTWARE.
  */
 #include <stdint.h>
-#include <zlib.h>
+#include <math.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/timer.h"
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
+#include "migration/multifd.h"
+#include "migration/compress.h"
+#include "migration/profile.h"
 #include "exec/address-spaces.h"
 #include "migration/page_cache.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "exec/ram_addr.h"
+#include "sysemu/sysemu.h"
 #include "qemu/rcu_queue.h"
 
 #ifdef DEBUG_MIGRATION_RAM
@@ -47,8 +55,6 @@
     do { } while (0)
 #endif
 
-static int dirty_rate_high_cnt;
-
 static uint64_t bitmap_sync_count;
 
 /***********************************************************/
@@ -63,6 +69,8 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* All pages sent on the multifd channels before this have been received */
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -71,6 +79,15 @@ static inline bool is_zero_range(uint8_t *p, uint64_t size)
     return buffer_find_nonzero_offset(p, size) == size;
 }
 
+/*
+ * With x-ignore-shared, RAM the destination maps from the same file isn't
+ * transferred at all.
+ */
+static bool ramblock_is_ignored(RAMBlock *block)
+{
+    return migrate_ignore_shared() && qemu_ram_is_shared(block);
+}
+
 /* struct contains XBZRLE cache and a static page
    used by the compression */
 static struct {
@@ -149,6 +166,7 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
+    uint64_t resent_pages;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -213,6 +231,11 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+uint64_t resent_mig_pages_transferred(void)
+{
+    return acct_info.resent_pages;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -221,9 +244,60 @@ static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
 static QemuMutex migration_bitmap_mutex;
 static uint64_t migration_dirty_pages;
+/* How many of the dirty pages are hot, see struct BitmapRcu */
+static uint64_t migration_hot_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
 
+/*
+ * Free page hints.  The guest reports pages it doesn't use from the main
+ * loop; they are queued here and taken out of the migration bitmap by the
+ * thread that sends the RAM.  A hint only holds until the guest reuses
+ * the page, which the dirty log tells us about: clearing the bit of a
+ * hinted page after a newer dirty log has been merged into the bitmap
+ * would lose its new content.  Hints are therefore accepted from the
+ * setup of the migration until the first sync of the dirty log after it;
+ * the queued ones are applied right before that sync, later ones are
+ * dropped.
+ */
+typedef struct FreePageHint {
+    ram_addr_t start;
+    ram_addr_t length;
+} FreePageHint;
+
+static NotifierList free_page_hint_notifiers =
+    NOTIFIER_LIST_INITIALIZER(free_page_hint_notifiers);
+static QemuMutex free_page_hint_lock;
+/* Protected by free_page_hint_lock */
+static GArray *free_page_hints;
+/* Changed with the iothread lock held */
+static bool free_page_hint_accepting;
+/*
+ * Set once a hint cleared a bit, after which the bulk stage can't assume
+ * that every page is dirty.
+ */
+static bool free_page_hinted;
+
+/* Maximum number of ranges sent in one POSTCOPY_RAM_DISCARD command */
+#define MAX_DISCARDS_PER_COMMAND 12
+
+/*
+ * Pages the destination has asked for (postcopy); served by the migration
+ * thread ahead of the background scan of the dirty bitmap.
+ */
+struct RAMSrcPageRequest {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    ram_addr_t len;
+
+    QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
+};
+static QemuMutex src_page_req_mutex;
+static QSIMPLEQ_HEAD(src_page_requests, RAMSrcPageRequest) src_page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(src_page_requests);
+/* Block named by the last request, used when a request omits the name */
+static RAMBlock *last_requested_block;
+
 /* used by the search for pages to send */
 struct PageSearchStatus {
     /* Current block being searched */
@@ -235,77 +309,128 @@ struct PageSearchStatus {
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
+/*
+ * Past the bulk stage every merge of the dirty log also counts, for each
+ * page, how many merges in a row found it dirtied again: a two bit counter
+ * saturating at 3, its low bits in streak_lo and its high bits in
+ * streak_hi.  A page dirtied in three merges in a row is hot, part of the
+ * working set of the guest; sending it before the guest stops would only
+ * mean sending it again, so the scan leaves it dirty and it goes out in
+ * the completion stage, unless a merge finds it left alone first.  The
+ * cold dirty pages are sent meanwhile.  Once there are too few of those
+ * left to hold hot pages back any longer, everything is sent again.
+ *
+ * The sent bitmap has the pages whose contents went out at least once, so
+ * that only sending those again counts as a resend.
+ */
 static struct BitmapRcu {
     struct rcu_head rcu;
+    /* in pages */
+    unsigned long size;
     unsigned long *bmap;
+    unsigned long *streak_lo;
+    unsigned long *streak_hi;
+    unsigned long *sent;
 } *migration_bitmap_rcu;
 
+/* Pages handed to a compression or decompression thread in one go */
+#define COMPRESS_BATCH_PAGES 16
+
+/*
+ * Largest record a compression thread writes for one page: the page
+ * header with the block name, the length and the compressed data
+ */
+#define COMPRESS_RECORD_MAX(page) \
+    (8 + 1 + 255 + 4 + migrate_compress_bound(page))
+
+/*
+ * Each compression thread owns a batch of pages and an output buffer.
+ * The migration thread fills the batch of one thread at a time, kicks it
+ * when full and moves on to the next thread in turn; before it fills a
+ * thread's batch again it waits for the previous job of that thread and
+ * copies its output to the stream.  The threads are thus used round
+ * robin, their output lands in the stream in the order the pages were
+ * queued, and the only synchronisation is one pair of semaphore
+ * operations per batch.
+ */
 struct CompressParam {
-    bool start;
-    bool done;
-    QEMUFile *file;
-    QemuMutex mutex;
-    QemuCond cond;
-    RAMBlock *block;
-    ram_addr_t offset;
+    /* Posted by the migration thread when the batch is ready or to quit */
+    QemuSemaphore sem;
+    /* Posted by the compression thread when the batch has been done */
+    QemuSemaphore done_sem;
+    /* The following are only used by the migration thread */
+    bool busy;
+    /* The batch; owned by the compression thread while busy */
+    int num;
+    RAMBlock *block[COMPRESS_BATCH_PAGES];
+    ram_addr_t offset[COMPRESS_BATCH_PAGES];
+    /* Records of the compressed pages, ready for the stream */
+    uint8_t *out;
+    size_t out_len;
+    /* Set when compression failed, the records in out are incomplete */
+    bool failed;
+    MigrationCompressCtx *ctx;
 };
 typedef struct CompressParam CompressParam;
 
+/*
+ * The decompression threads load pages in batches on the destination:
+ * compressed pages are decompressed into guest RAM, and plain pages copied
+ * there, so that the faults on the guest RAM that hasn't been touched yet
+ * are taken by the threads and not by the thread reading the stream.
+ */
 struct DecompressParam {
-    bool start;
-    QemuMutex mutex;
-    QemuCond cond;
-    void *des;
-    uint8 *compbuf;
-    int len;
+    QemuSemaphore sem;
+    QemuSemaphore done_sem;
+    /* Only used by the loading thread */
+    bool busy;
+    int num;
+    void *des[COMPRESS_BATCH_PAGES];
+    int len[COMPRESS_BATCH_PAGES];
+    bool compressed[COMPRESS_BATCH_PAGES];
+    /* The pages, one after the other */
+    uint8_t *compbuf;
+    size_t compbuf_len;
+    /* For the method of the stream, created on the first compressed page */
+    MigrationCompressCtx *ctx;
 };
 typedef struct DecompressParam DecompressParam;
 
 static CompressParam *comp_param;
 static QemuThread *compress_threads;
-/* comp_done_cond is used to wake up the migration thread when
- * one of the compression threads has finished the compression.
- * comp_done_lock is used to co-work with comp_done_cond.
+/* The thread whose batch is being filled */
+static int comp_next;
+/* Used for the first page of each block, in the migration thread */
+static CompressParam comp_main;
+/*
+ * Compression level used by the threads; adapted between 1 and the
+ * compress-level parameter, see compress_adapt_level()
  */
-static QemuMutex *comp_done_lock;
-static QemuCond *comp_done_cond;
-/* The empty QEMUFileOps will be used by file in CompressParam */
-static const QEMUFileOps empty_ops = { };
+static int comp_level;
+/* Batches started, and how many times we had to wait for a busy thread */
+static uint64_t comp_batches;
+static uint64_t comp_stalls;
 
 static bool compression_switch;
 static bool quit_comp_thread;
 static bool quit_decomp_thread;
 static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
-static uint8_t *compressed_data_buf;
+static int decomp_next;
 
-static int do_compress_ram_page(CompressParam *param);
+static void do_compress_ram_pages(CompressParam *param);
 
 static void *do_data_compress(void *opaque)
 {
     CompressParam *param = opaque;
 
-    while (!quit_comp_thread) {
-        qemu_mutex_lock(&param->mutex);
-        /* Re-check the quit_comp_thread in case of
-         * terminate_compression_threads is called just before
-         * qemu_mutex_lock(&param->mutex) and after
-         * while(!quit_comp_thread), re-check it here can make
-         * sure the compression thread terminate as expected.
-         */
-        while (!param->start && !quit_comp_thread) {
-            qemu_cond_wait(&param->cond, &param->mutex);
-        }
-        if (!quit_comp_thread) {
-            do_compress_ram_page(param);
+    while (true) {
+        qemu_sem_wait(&param->sem);
+        if (atomic_read(&quit_comp_thread)) {
+            break;
         }
-        param->start = false;
-        qemu_mutex_unlock(&param->mutex);
-
-        qemu_mutex_lock(comp_done_lock);
-        param->done = true;
-        qemu_cond_signal(comp_done_cond);
-        qemu_mutex_unlock(comp_done_lock);
+        do_compress_ram_pages(param);
+        qemu_sem_post(&param->done_sem);
     }
 
     return NULL;
@@ -316,14 +441,33 @@ static inline void terminate_compression_threads(void)
     int idx, thread_count;
 
     thread_count = migrate_compress_threads();
-    quit_comp_thread = true;
+    atomic_set(&quit_comp_thread, true);
     for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        qemu_cond_signal(&comp_param[idx].cond);
-        qemu_mutex_unlock(&comp_param[idx].mutex);
+        qemu_sem_post(&comp_param[idx].sem);
+    }
+}
+
+static void compress_param_init(CompressParam *param, int level)
+{
+    param->out = g_malloc(COMPRESS_BATCH_PAGES *
+                          COMPRESS_RECORD_MAX(TARGET_PAGE_SIZE));
+    param->ctx = migrate_compress_ctx_new(migrate_compress_method_current(),
+                                          level, false);
+    if (!param->ctx) {
+        /* Only fails on lack of memory */
+        error_report("Failed to initialise compression");
+        abort();
     }
 }
 
+static void compress_param_destroy(CompressParam *param)
+{
+    migrate_compress_ctx_free(param->ctx);
+    param->ctx = NULL;
+    g_free(param->out);
+    param->out = NULL;
+}
+
 void migrate_compress_threads_join(void)
 {
     int i, thread_count;
@@ -335,46 +479,55 @@ void migrate_compress_threads_join(void)
     thread_count = migrate_compress_threads();
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(compress_threads + i);
-        qemu_fclose(comp_param[i].file);
-        qemu_mutex_destroy(&comp_param[i].mutex);
-        qemu_cond_destroy(&comp_param[i].cond);
+        qemu_sem_destroy(&comp_param[i].sem);
+        qemu_sem_destroy(&comp_param[i].done_sem);
+        compress_param_destroy(&comp_param[i]);
     }
-    qemu_mutex_destroy(comp_done_lock);
-    qemu_cond_destroy(comp_done_cond);
+    compress_param_destroy(&comp_main);
     g_free(compress_threads);
     g_free(comp_param);
-    g_free(comp_done_cond);
-    g_free(comp_done_lock);
     compress_threads = NULL;
     comp_param = NULL;
-    comp_done_cond = NULL;
-    comp_done_lock = NULL;
+    migrate_compress_method_set_current(MIGRATION_COMPRESS_METHOD_ZLIB);
 }
 
 void migrate_compress_threads_create(void)
 {
+    MigrationCompressMethod method = migrate_compress_method();
     int i, thread_count;
 
     if (!migrate_use_compression()) {
         return;
     }
+    if (!migrate_compress_method_available(method)) {
+        error_report("compress-method %s is not supported by this build, "
+                     "using zlib", MigrationCompressMethod_lookup[method]);
+        method = MIGRATION_COMPRESS_METHOD_ZLIB;
+    }
+    if (method != MIGRATION_COMPRESS_METHOD_ZLIB &&
+        savevm_configuration_skipped()) {
+        error_report("compress-method %s needs the configuration section, "
+                     "which this machine type doesn't send; using zlib",
+                     MigrationCompressMethod_lookup[method]);
+        method = MIGRATION_COMPRESS_METHOD_ZLIB;
+    }
+    /* Sent in the configuration section, see savevm.c */
+    migrate_compress_method_set_current(method);
     quit_comp_thread = false;
     compression_switch = true;
+    comp_next = 0;
+    comp_level = migrate_compress_level();
+    comp_batches = 0;
+    comp_stalls = 0;
     thread_count = migrate_compress_threads();
     compress_threads = g_new0(QemuThread, thread_count);
     comp_param = g_new0(CompressParam, thread_count);
-    comp_done_cond = g_new0(QemuCond, 1);
-    comp_done_lock = g_new0(QemuMutex, 1);
-    qemu_cond_init(comp_done_cond);
-    qemu_mutex_init(comp_done_lock);
+    memset(&comp_main, 0, sizeof(comp_main));
+    compress_param_init(&comp_main, comp_level);
     for (i = 0; i < thread_count; i++) {
-        /* com_param[i].file is just used as a dummy buffer to save data, set
-         * it's ops to empty.
-         */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
-        comp_param[i].done = true;
-        qemu_mutex_init(&comp_param[i].mutex);
-        qemu_cond_init(&comp_param[i].cond);
+        compress_param_init(&comp_param[i], comp_level);
+        qemu_sem_init(&comp_param[i].sem, 0);
+        qemu_sem_init(&comp_param[i].done_sem, 0);
         qemu_thread_create(compress_threads + i, "compress",
                            do_data_compress, comp_param + i,
                            QEMU_THREAD_JOINABLE);
@@ -409,26 +562,67 @@ static size_t save_page_header(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
     return size;
 }
 
-/* Reduce amount of guest cpu execution to hopefully slow down memory writes.
+/*
+ * Number of passes over the dirty pages auto-converge aims to complete
+ * the migration in
+ */
+#define THROTTLE_CONVERGE_PASSES 4
+
+/*
+ * Reduce amount of guest cpu execution to hopefully slow down memory writes.
  * If guest dirty memory rate is reduced below the rate at which we can
  * transfer pages to the destination then we should be able to complete
  * migration. Some workloads dirty memory way too fast and will not effectively
  * converge, even with auto-converge.
+ *
+ * Set the vcpu throttle for the guest to converge: each pass sends what
+ * was dirty while the guest dirties @dirty_rate / @bandwidth times as
+ * much, and that ratio has to get the @remaining bytes down to what can
+ * be sent within the downtime limit in THROTTLE_CONVERGE_PASSES passes.
+ * The throttle is set to what slows the guest down to that dirty rate,
+ * starting at no more than x-cpu-throttle-initial and rising by no more
+ * than x-cpu-throttle-increment at a time; it drops as soon as less will
+ * do.
+ *
+ * @dirty_rate: bytes dirtied per second under the current throttle
+ * @bandwidth: bytes of RAM sent per second
+ * @remaining: bytes of dirty RAM
  */
-static void mig_throttle_guest_down(void)
+static void mig_throttle_guest_adjust(double dirty_rate, double bandwidth,
+                                      uint64_t remaining)
 {
     MigrationState *s = migrate_get_current();
-    uint64_t pct_initial =
+    int pct_initial =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INITIAL];
-    uint64_t pct_icrement =
+    int pct_increment =
             s->parameters[MIGRATION_PARAMETER_X_CPU_THROTTLE_INCREMENT];
+    int pct_cur = cpu_throttle_active() ? cpu_throttle_get_percentage() : 0;
+    double threshold = bandwidth * migrate_max_downtime() / 1000000000;
+    double ratio = 1.0;
+    double unthrottled_rate;
+    int pct;
+
+    if (bandwidth <= 0 || dirty_rate <= 0) {
+        return;
+    }
+    if (remaining > threshold) {
+        ratio = pow(threshold / remaining, 1.0 / THROTTLE_CONVERGE_PASSES);
+    }
+    unthrottled_rate = dirty_rate * 100 / (100 - pct_cur);
+    pct = ceil(100 - 100 * ratio * bandwidth / unthrottled_rate);
+
+    pct = MAX(pct, 0);
+    pct = MIN(pct, pct_cur ? pct_cur + pct_increment : pct_initial);
+    pct = MIN(pct, 99);
 
-    /* We have not started throttling yet. Let's start it. */
-    if (!cpu_throttle_active()) {
-        cpu_throttle_set(pct_initial);
+    trace_migration_throttle(dirty_rate, bandwidth, remaining, ratio, pct);
+    if (pct == pct_cur) {
+        return;
+    }
+    if (pct) {
+        cpu_throttle_set(pct);
     } else {
-        /* Throttling already on, just increase the rate */
-        cpu_throttle_set(cpu_throttle_get_percentage() + pct_icrement);
+        cpu_throttle_stop();
     }
 }
 
@@ -531,40 +725,140 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     return 1;
 }
 
+/*
+ * Like find_next_bit() on @bmap, but skipping the pages that are hot
+ * according to @bitmap.
+ */
+static unsigned long migration_bitmap_find_cold(struct BitmapRcu *bitmap,
+                                                unsigned long size,
+                                                unsigned long nr)
+{
+    unsigned long k, word;
+
+    while (nr < size) {
+        k = BIT_WORD(nr);
+        word = bitmap->bmap[k] &
+               ~(bitmap->streak_lo[k] & bitmap->streak_hi[k]);
+        word &= ~0UL << (nr % BITS_PER_LONG);
+        if (word) {
+            return MIN(k * BITS_PER_LONG + ctzl(word), size);
+        }
+        nr = (k + 1) * BITS_PER_LONG;
+    }
+    return size;
+}
+
 /* Called with rcu_read_lock() to protect migration_bitmap */
+static void migration_bitmap_clear_page(struct BitmapRcu *bitmap,
+                                        unsigned long page)
+{
+    clear_bit(page, bitmap->bmap);
+    migration_dirty_pages--;
+    if (test_bit(page, bitmap->streak_lo) &&
+        test_bit(page, bitmap->streak_hi)) {
+        migration_hot_pages--;
+    }
+}
+
+/*
+ * Find the first dirty page of @rb from @start up to @end, clear it in the
+ * bitmap and return its offset; returns @end if there's none.  With
+ * @skip_hot, hot pages are left for later.
+ *
+ * Called with rcu_read_lock() to protect migration_bitmap
+ */
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(RAMBlock *rb,
-                                                 ram_addr_t start)
+                                                 ram_addr_t start,
+                                                 ram_addr_t end,
+                                                 bool skip_hot)
 {
     unsigned long base = rb->offset >> TARGET_PAGE_BITS;
     unsigned long nr = base + (start >> TARGET_PAGE_BITS);
-    uint64_t rb_size = rb->used_length;
-    unsigned long size = base + (rb_size >> TARGET_PAGE_BITS);
-    unsigned long *bitmap;
+    unsigned long size = base + (end >> TARGET_PAGE_BITS);
+    struct BitmapRcu *bitmap_rcu = atomic_rcu_read(&migration_bitmap_rcu);
+    unsigned long *bitmap = bitmap_rcu->bmap;
 
     unsigned long next;
 
-    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
-    if (ram_bulk_stage && nr > base) {
+    if (ram_bulk_stage && !free_page_hinted && nr > base) {
         next = nr + 1;
+    } else if (skip_hot) {
+        next = migration_bitmap_find_cold(bitmap_rcu, size, nr);
     } else {
         next = find_next_bit(bitmap, size, nr);
     }
 
     if (next < size) {
-        clear_bit(next, bitmap);
-        migration_dirty_pages--;
+        migration_bitmap_clear_page(bitmap_rcu, next);
     }
     return (next - base) << TARGET_PAGE_BITS;
 }
 
+/*
+ * Count the pages of the range that the dirty log about to be merged has
+ * caught again, and reset the count of the others.  Every page logged is
+ * dirty once the log is merged, so the hot ones are exactly the pages
+ * whose count reaches 3 here; migration_hot_pages follows suit.
+ */
+static void migration_bitmap_update_streak(struct BitmapRcu *bitmap,
+                                           ram_addr_t start,
+                                           ram_addr_t length)
+{
+    DirtyMemoryBlocks *blocks =
+        atomic_rcu_read(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
+    unsigned long words = DIRTY_MEMORY_BLOCK_SIZE / BITS_PER_LONG;
+    unsigned long *dirty = bitmap->bmap;
+    unsigned long *lo = bitmap->streak_lo, *hi = bitmap->streak_hi;
+    unsigned long first = start >> TARGET_PAGE_BITS;
+    unsigned long nr = length >> TARGET_PAGE_BITS;
+    unsigned long k, page, logged, old_lo;
+
+    if (first % BITS_PER_LONG == 0) {
+        for (k = BIT_WORD(first); k < BIT_WORD(first) + BITS_TO_LONGS(nr);
+             k++) {
+            /* Saturating increment where logged, zero elsewhere */
+            logged = atomic_read(&blocks->blocks[k / words][k % words]);
+            old_lo = lo[k];
+            migration_hot_pages -= ctpopl(dirty[k] & old_lo & hi[k]);
+            lo[k] = logged & (~old_lo | hi[k]);
+            hi[k] = logged & (old_lo | hi[k]);
+            migration_hot_pages += ctpopl(lo[k] & hi[k]);
+        }
+        return;
+    }
+
+    for (page = first; page < first + nr; page++) {
+        if (test_bit(page, dirty) && test_bit(page, lo) &&
+            test_bit(page, hi)) {
+            migration_hot_pages--;
+        }
+        if (!test_bit(page % DIRTY_MEMORY_BLOCK_SIZE,
+                      blocks->blocks[page / DIRTY_MEMORY_BLOCK_SIZE])) {
+            clear_bit(page, lo);
+            clear_bit(page, hi);
+        } else if (!test_bit(page, lo)) {
+            set_bit(page, lo);
+        } else if (!test_bit(page, hi)) {
+            clear_bit(page, lo);
+            set_bit(page, hi);
+        }
+        if (test_bit(page, lo) && test_bit(page, hi)) {
+            migration_hot_pages++;
+        }
+    }
+}
+
 /* Called with rcu_read_lock() to protect migration_bitmap */
 static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 {
-    unsigned long *bitmap;
-    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    struct BitmapRcu *bitmap = atomic_rcu_read(&migration_bitmap_rcu);
+
+    if (!ram_bulk_stage) {
+        migration_bitmap_update_streak(bitmap, start, length);
+    }
     migration_dirty_pages +=
-        cpu_physical_memory_sync_dirty_bitmap(bitmap, start, length);
+        cpu_physical_memory_sync_dirty_bitmap(bitmap->bmap, start, length);
 }
 
 /* Fix me: there are too many global variables used in migration process. */
@@ -574,6 +868,138 @@ static int64_t num_dirty_pages_period;
 static uint64_t xbzrle_cache_miss_prev;
 static uint64_t iterations_prev;
 
+/*
+ * Past the bulk stage the page scan pulls the dirty log in just ahead of
+ * itself: the log of a block is fetched when the scan enters it, and
+ * merged into the migration bitmap a chunk at a time as the scan gets
+ * there.  The scan thus sends pages as recently dirtied as possible, and
+ * instead of stopping for one sync of the whole guest it takes the
+ * iothread lock only for as long as one block or one chunk needs.
+ */
+#define MIGRATION_SYNC_CHUNK (256 * 1024 * 1024)
+
+/* The block the scan last synced, NULL at the start of each round */
+static RAMBlock *sync_block;
+/* How much of sync_block has been merged into the bitmap this round */
+static ram_addr_t sync_offset;
+/* Too few cold pages are left to keep holding the hot ones back */
+static bool send_hot_pages;
+
+void ram_add_free_page_hint_notifier(Notifier *notify)
+{
+    notifier_list_add(&free_page_hint_notifiers, notify);
+}
+
+void ram_remove_free_page_hint_notifier(Notifier *notify)
+{
+    notifier_remove(notify);
+}
+
+static void free_page_hint_notify(FreePageHintEvent event)
+{
+    notifier_list_notify(&free_page_hint_notifiers, &event);
+}
+
+void qemu_guest_free_page_hint(void *addr, size_t len)
+{
+    FreePageHint hint;
+    MemoryRegion *mr;
+    ram_addr_t base, offset, end;
+
+    if (!free_page_hint_accepting) {
+        return;
+    }
+    mr = qemu_ram_addr_from_host(addr, &hint.start);
+    if (!mr) {
+        return;
+    }
+    /* Only whole pages of one block */
+    base = memory_region_get_ram_addr(mr);
+    offset = hint.start - base;
+    end = MIN(offset + len, memory_region_size(mr));
+    offset = QEMU_ALIGN_UP(offset, TARGET_PAGE_SIZE);
+    end = QEMU_ALIGN_DOWN(end, TARGET_PAGE_SIZE);
+    if (end <= offset) {
+        return;
+    }
+    hint.start = base + offset;
+    hint.length = end - offset;
+
+    qemu_mutex_lock(&free_page_hint_lock);
+    g_array_append_val(free_page_hints, hint);
+    qemu_mutex_unlock(&free_page_hint_lock);
+}
+
+/* Called by the thread that sends the RAM */
+static void free_page_hint_apply(void)
+{
+    unsigned long *bitmap;
+    unsigned long page, end;
+    uint64_t cleared = 0;
+    guint i, nr_hints;
+
+    qemu_mutex_lock(&free_page_hint_lock);
+    nr_hints = free_page_hints->len;
+    if (!nr_hints) {
+        qemu_mutex_unlock(&free_page_hint_lock);
+        return;
+    }
+
+    rcu_read_lock();
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    for (i = 0; i < nr_hints; i++) {
+        FreePageHint *hint = &g_array_index(free_page_hints, FreePageHint, i);
+
+        end = (hint->start + hint->length) >> TARGET_PAGE_BITS;
+        for (page = hint->start >> TARGET_PAGE_BITS; page < end; page++) {
+            if (test_and_clear_bit(page, bitmap)) {
+                cleared++;
+            }
+        }
+    }
+    migration_dirty_pages -= cleared;
+    if (cleared) {
+        free_page_hinted = true;
+    }
+    qemu_mutex_unlock(&migration_bitmap_mutex);
+    rcu_read_unlock();
+
+    g_array_set_size(free_page_hints, 0);
+    qemu_mutex_unlock(&free_page_hint_lock);
+    trace_free_page_hint_apply(nr_hints, cleared);
+}
+
+/* Called with the iothread lock held, right after the setup sync */
+static void free_page_hint_start(void)
+{
+    free_page_hinted = false;
+    /*
+     * A hinted page is neither sent nor discarded, so with postcopy the
+     * guest could fault on it after the switchover and the source would
+     * never answer: clean pages are not sent on request.
+     */
+    if (migrate_postcopy_ram()) {
+        return;
+    }
+    free_page_hint_accepting = true;
+    free_page_hint_notify(FREE_PAGE_HINT_START);
+}
+
+/*
+ * Called with the iothread lock held, before merging any dirty log into
+ * the migration bitmap.
+ */
+static void free_page_hint_stop(void)
+{
+    if (!free_page_hint_accepting) {
+        return;
+    }
+    free_page_hint_apply();
+    free_page_hint_accepting = false;
+    free_page_hint_notify(FREE_PAGE_HINT_STOP);
+}
+
 static void migration_bitmap_sync_init(void)
 {
     start_time = 0;
@@ -584,13 +1010,56 @@ static void migration_bitmap_sync_init(void)
 }
 
 /* Called with iothread lock held, to protect ram_list.dirty_memory[] */
+/*
+ * Update the dirty rate, and the throttle with auto-converge, once the
+ * merges since the last update span a second.  Called with the iothread
+ * lock held after merging dirty log, be it the full sync or the scan
+ * syncing ahead: past the bulk stage the full sync may not run again
+ * until the guest has converged.
+ */
+static void migration_bitmap_sync_period(void)
+{
+    MigrationState *s = migrate_get_current();
+    int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t bytes_xfer_now;
+
+    /* more than 1 second = 1000 millisecons */
+    if (end_time > start_time + 1000) {
+        s->dirty_pages_rate = num_dirty_pages_period * 1000
+            / (end_time - start_time);
+        s->dirty_bytes_rate = s->dirty_pages_rate * TARGET_PAGE_SIZE;
+
+        if (migrate_auto_converge()) {
+            bytes_xfer_now = ram_bytes_transferred();
+            mig_throttle_guest_adjust(s->dirty_bytes_rate,
+                                      (double)(bytes_xfer_now -
+                                               bytes_xfer_prev) * 1000 /
+                                      (end_time - start_time),
+                                      migration_dirty_pages *
+                                      TARGET_PAGE_SIZE);
+            bytes_xfer_prev = bytes_xfer_now;
+        }
+
+        if (migrate_use_xbzrle()) {
+            if (iterations_prev != acct_info.iterations) {
+                acct_info.xbzrle_cache_miss_rate =
+                   (double)(acct_info.xbzrle_cache_miss -
+                            xbzrle_cache_miss_prev) /
+                   (acct_info.iterations - iterations_prev);
+            }
+            iterations_prev = acct_info.iterations;
+            xbzrle_cache_miss_prev = acct_info.xbzrle_cache_miss;
+        }
+        start_time = end_time;
+        num_dirty_pages_period = 0;
+    }
+    s->dirty_sync_count = bitmap_sync_count;
+}
+
 static void migration_bitmap_sync(void)
 {
     RAMBlock *block;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
-    MigrationState *s = migrate_get_current();
-    int64_t end_time;
-    int64_t bytes_xfer_now;
 
     bitmap_sync_count++;
 
@@ -603,12 +1072,15 @@ static void migration_bitmap_sync(void)
     }
 
     trace_migration_bitmap_sync_start();
+    free_page_hint_stop();
     address_space_sync_dirty_bitmap(&address_space_memory);
 
     qemu_mutex_lock(&migration_bitmap_mutex);
     rcu_read_lock();
     QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        migration_bitmap_sync_range(block->offset, block->used_length);
+        if (!ramblock_is_ignored(block)) {
+            migration_bitmap_sync_range(block->offset, block->used_length);
+        }
     }
     rcu_read_unlock();
     qemu_mutex_unlock(&migration_bitmap_mutex);
@@ -616,46 +1088,52 @@ static void migration_bitmap_sync(void)
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
-    end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    migration_bitmap_sync_period();
+}
 
-    /* more than 1 second = 1000 millisecons */
-    if (end_time > start_time + 1000) {
-        if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
-               were in this routine. If that happens twice, start or increase
-               throttling */
-            bytes_xfer_now = ram_bytes_transferred();
+/*
+ * Merge the dirty log of the chunk of @block at @offset into the migration
+ * bitmap, fetching the log of the whole block first if the scan just
+ * entered it.  Returns the end of the merged part of @block.
+ *
+ * Called within an RCU critical section, without the iothread lock.
+ */
+static ram_addr_t migration_bitmap_sync_ahead(RAMBlock *block,
+                                              ram_addr_t offset)
+{
+    uint64_t num_dirty_pages_init;
+    ram_addr_t start, end;
 
-            if (s->dirty_pages_rate &&
-               (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ >= 2)) {
-                    trace_migration_throttle();
-                    dirty_rate_high_cnt = 0;
-                    mig_throttle_guest_down();
-             }
-             bytes_xfer_prev = bytes_xfer_now;
-        }
+    if (block == sync_block && offset < sync_offset) {
+        return sync_offset;
+    }
 
-        if (migrate_use_xbzrle()) {
-            if (iterations_prev != acct_info.iterations) {
-                acct_info.xbzrle_cache_miss_rate =
-                   (double)(acct_info.xbzrle_cache_miss -
-                            xbzrle_cache_miss_prev) /
-                   (acct_info.iterations - iterations_prev);
-            }
-            iterations_prev = acct_info.iterations;
-            xbzrle_cache_miss_prev = acct_info.xbzrle_cache_miss;
+    start = QEMU_ALIGN_DOWN(offset, MIGRATION_SYNC_CHUNK);
+    end = MIN(start + MIGRATION_SYNC_CHUNK, block->used_length);
+
+    qemu_mutex_lock_iothread();
+    free_page_hint_stop();
+    if (block != sync_block) {
+        if (!sync_block) {
+            /* A round of syncing ahead goes over the dirty log once */
+            bitmap_sync_count++;
         }
-        s->dirty_pages_rate = num_dirty_pages_period * 1000
-            / (end_time - start_time);
-        s->dirty_bytes_rate = s->dirty_pages_rate * TARGET_PAGE_SIZE;
-        start_time = end_time;
-        num_dirty_pages_period = 0;
+        memory_region_sync_dirty_bitmap(block->mr);
+        sync_block = block;
     }
-    s->dirty_sync_count = bitmap_sync_count;
+    qemu_mutex_lock(&migration_bitmap_mutex);
+    num_dirty_pages_init = migration_dirty_pages;
+    migration_bitmap_sync_range(block->offset + start, end - start);
+    num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
+    qemu_mutex_unlock(&migration_bitmap_mutex);
+    migration_bitmap_sync_period();
+    qemu_mutex_unlock_iothread();
+
+    trace_migration_bitmap_sync_ahead(block->idstr, start, end - start,
+                                      migration_dirty_pages -
+                                      num_dirty_pages_init);
+    sync_offset = end;
+    return end;
 }
 
 /**
@@ -686,40 +1164,165 @@ static int save_zero_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return pages;
 }
 
-/**
- * ram_save_page: Send the given page to the stream
- *
- * Returns: Number of pages written.
- *
- * @f: QEMUFile where to send the data
- * @block: block that contains the page we want to send
- * @offset: offset inside the block for the page
- * @last_stage: if we are at the completion stage
- * @bytes_transferred: increase it with the number of transferred bytes
+/*
+ * x-mapped-ram: instead of going on the stream, every page is written to
+ * its own place in the file, at MAPPED_RAM_ALIGN plus its ram_addr_t, so
+ * sending it again overwrites it.  Adjacent pages are written together.
  */
-static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
-                         bool last_stage, uint64_t *bytes_transferred)
+#define MAPPED_RAM_MAX_RUN  (1 * 1024 * 1024)
+
+static struct {
+    int fd;
+    /* Pages waiting to be written, at @host and @file_offset */
+    uint8_t *host;
+    uint64_t file_offset;
+    size_t len;
+} mapped_ram = { .fd = -1 };
+
+uint64_t ram_mapped_ram_end(void)
 {
-    int pages = -1;
-    uint64_t bytes_xmit;
-    ram_addr_t current_addr;
-    uint8_t *p;
-    int ret;
-    bool send_async = true;
+    return QEMU_ALIGN_UP(MAPPED_RAM_ALIGN + last_ram_offset(),
+                         MAPPED_RAM_ALIGN);
+}
 
-    p = block->host + offset;
+#ifndef _WIN32
+static int mapped_ram_save_setup(QEMUFile *f)
+{
+    uint64_t stream_offset;
+    struct stat st;
+    int fd = qemu_get_fd(f);
 
-    /* In doubt sent page as normal */
-    bytes_xmit = 0;
-    ret = ram_control_save_page(f, block->offset,
-                           offset, TARGET_PAGE_SIZE, &bytes_xmit);
-    if (bytes_xmit) {
-        *bytes_transferred += bytes_xmit;
-        pages = 1;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        mapped_ram_read_header(fd, &stream_offset) < 0) {
+        error_report("x-mapped-ram needs a file: migration");
+        return -1;
     }
+    if (ram_mapped_ram_end() > stream_offset) {
+        error_report("RAM has grown since the migration file was created");
+        return -1;
+    }
+    mapped_ram.fd = fd;
+    mapped_ram.len = 0;
+    return 0;
+}
+
+static void mapped_ram_flush(QEMUFile *f)
+{
+    size_t done = 0;
+    ssize_t len;
+
+    if (!mapped_ram.len) {
+        return;
+    }
+    while (done < mapped_ram.len) {
+        len = pwrite(mapped_ram.fd, mapped_ram.host + done,
+                     mapped_ram.len - done, mapped_ram.file_offset + done);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            qemu_file_set_error(f, -errno);
+            break;
+        }
+        done += len;
+    }
+    mapped_ram.len = 0;
+}
+#else
+static int mapped_ram_save_setup(QEMUFile *f)
+{
+    error_report("x-mapped-ram is not supported on this host");
+    return -1;
+}
+
+static void mapped_ram_flush(QEMUFile *f)
+{
+}
+#endif
+
+/**
+ * mapped_ram_save_page: Write the given page to its place in the file
+ *
+ * Returns: Number of pages written.
+ *
+ * @f: QEMUFile of the migration, only used for accounting
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int mapped_ram_save_page(QEMUFile *f, RAMBlock *block,
+                                ram_addr_t offset,
+                                uint64_t *bytes_transferred)
+{
+    uint8_t *p = block->host + offset;
+    uint64_t file_offset = MAPPED_RAM_ALIGN + block->offset + offset;
+
+    /* The file starts out empty, so there's nothing to write for these */
+    if (ram_bulk_stage && is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct_info.dup_pages++;
+        return 1;
+    }
+
+    if (mapped_ram.len &&
+        (mapped_ram.host + mapped_ram.len != p ||
+         mapped_ram.file_offset + mapped_ram.len != file_offset ||
+         mapped_ram.len >= MAPPED_RAM_MAX_RUN)) {
+        mapped_ram_flush(f);
+    }
+    if (!mapped_ram.len) {
+        mapped_ram.host = p;
+        mapped_ram.file_offset = file_offset;
+    }
+    mapped_ram.len += TARGET_PAGE_SIZE;
+
+    /* Count it like a page on the stream, for the bandwidth and rate limit */
+    qemu_update_position(f, TARGET_PAGE_SIZE);
+    qemu_file_acct_rate_limit(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+    return 1;
+}
+
+/**
+ * ram_save_page: Send the given page to the stream
+ *
+ * Returns: Number of pages written.
+ *
+ * @f: QEMUFile where to send the data
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ * @last_stage: if we are at the completion stage
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
+                         bool last_stage, uint64_t *bytes_transferred)
+{
+    int pages = -1;
+    uint64_t bytes_xmit;
+    ram_addr_t current_addr;
+    uint8_t *p;
+    int ret;
+    bool send_async = true;
+    bool on_main_stream = true;
+    ram_addr_t page_offset = offset;
+
+    if (migrate_use_mapped_ram()) {
+        return mapped_ram_save_page(f, block, offset, bytes_transferred);
+    }
+
+    p = block->host + offset;
+
+    /* In doubt sent page as normal */
+    bytes_xmit = 0;
+    ret = ram_control_save_page(f, block->offset,
+                           offset, TARGET_PAGE_SIZE, &bytes_xmit);
+    if (bytes_xmit) {
+        *bytes_transferred += bytes_xmit;
+        pages = 1;
+    }
+
+    XBZRLE_cache_lock();
 
-    XBZRLE_cache_lock();
-
     current_addr = block->offset + offset;
 
     if (block == last_sent_block) {
@@ -740,7 +1343,20 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
              * page would be stale
              */
             xbzrle_cache_zero_page(current_addr);
-        } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
+        } else if (migrate_use_multifd()) {
+            /* Only the data goes on a channel, it's read straight from RAM */
+            if (multifd_queue_page(block->idstr, block->host, page_offset,
+                                   TARGET_PAGE_SIZE)) {
+                qemu_file_set_error(f, -EIO);
+            }
+            qemu_update_position(f, TARGET_PAGE_SIZE);
+            qemu_file_acct_rate_limit(f, TARGET_PAGE_SIZE);
+            *bytes_transferred += TARGET_PAGE_SIZE;
+            acct_info.norm_pages++;
+            pages = 1;
+            on_main_stream = false;
+        } else if (!ram_bulk_stage && migrate_use_xbzrle() &&
+                   !migration_in_postcopy(migrate_get_current())) {
             pages = save_xbzrle_page(f, &p, current_addr, block,
                                      offset, last_stage, bytes_transferred);
             if (!last_stage) {
@@ -768,105 +1384,195 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
 
     XBZRLE_cache_unlock();
 
+    /* The next page header on the main stream can skip the block name */
+    if (pages > 0 && on_main_stream) {
+        last_sent_block = block;
+    }
+
     return pages;
 }
 
-static int do_compress_ram_page(CompressParam *param)
+/*
+ * Same as save_page_header(), into a buffer
+ */
+static size_t save_page_header_buf(uint8_t *buf, RAMBlock *block,
+                                   ram_addr_t offset)
 {
-    int bytes_sent, blen;
-    uint8_t *p;
-    RAMBlock *block = param->block;
-    ram_addr_t offset = param->offset;
+    size_t size, len;
 
-    p = block->host + (offset & TARGET_PAGE_MASK);
+    stq_be_p(buf, offset);
+    size = 8;
 
-    bytes_sent = save_page_header(param->file, block, offset |
-                                  RAM_SAVE_FLAG_COMPRESS_PAGE);
-    blen = qemu_put_compression_data(param->file, p, TARGET_PAGE_SIZE,
-                                     migrate_compress_level());
-    bytes_sent += blen;
+    if (!(offset & RAM_SAVE_FLAG_CONTINUE)) {
+        len = strlen(block->idstr);
+        buf[size] = len;
+        memcpy(buf + size + 1, block->idstr, len);
+        size += 1 + len;
+    }
+    return size;
+}
 
-    return bytes_sent;
+/*
+ * Compress the batch of @param into records in param->out: page header,
+ * be32 length and the page compressed on its own.  With zlib that's the
+ * format qemu_put_compression_data() produces.
+ */
+static void do_compress_ram_pages(CompressParam *param)
+{
+    size_t bound = migrate_compress_bound(TARGET_PAGE_SIZE);
+    int i;
+
+    param->out_len = 0;
+    param->failed = false;
+    migrate_compress_ctx_set_level(param->ctx, atomic_read(&comp_level));
+
+    for (i = 0; i < param->num; i++) {
+        RAMBlock *block = param->block[i];
+        ram_addr_t offset = param->offset[i];
+        uint8_t *rec = param->out + param->out_len;
+        size_t hdr;
+        ssize_t len;
+
+        hdr = save_page_header_buf(rec, block,
+                                   offset | RAM_SAVE_FLAG_COMPRESS_PAGE);
+        len = migrate_compress_page(param->ctx, rec + hdr + 4, bound,
+                                    block->host + (offset & TARGET_PAGE_MASK),
+                                    TARGET_PAGE_SIZE);
+        if (len < 0) {
+            error_report("Compress Failed!");
+            param->failed = true;
+            break;
+        }
+        stl_be_p(rec + hdr, len);
+        param->out_len += hdr + 4 + len;
+    }
+    param->num = 0;
 }
 
-static inline void start_compression(CompressParam *param)
+static uint64_t bytes_transferred;
+
+/* Copy the records of a finished batch to the stream */
+static void compress_put_output(QEMUFile *f, CompressParam *param)
 {
-    param->done = false;
-    qemu_mutex_lock(&param->mutex);
-    param->start = true;
-    qemu_cond_signal(&param->cond);
-    qemu_mutex_unlock(&param->mutex);
+    if (param->failed) {
+        qemu_file_set_error(f, -EIO);
+        return;
+    }
+    qemu_put_buffer(f, param->out, param->out_len);
+    bytes_transferred += param->out_len;
+    param->out_len = 0;
 }
 
-static inline void start_decompression(DecompressParam *param)
+/* Wait for the job of a busy thread and send its output */
+static void compress_collect(QEMUFile *f, CompressParam *param)
 {
-    qemu_mutex_lock(&param->mutex);
-    param->start = true;
-    qemu_cond_signal(&param->cond);
-    qemu_mutex_unlock(&param->mutex);
+    if (!param->busy) {
+        return;
+    }
+    if (qemu_sem_timedwait(&param->done_sem, 0)) {
+        /* The thread is still at it, the migration thread is outpacing us */
+        comp_stalls++;
+        qemu_sem_wait(&param->done_sem);
+    }
+    param->busy = false;
+    compress_put_output(f, param);
 }
 
-static uint64_t bytes_transferred;
+static void compress_start(CompressParam *param)
+{
+    param->busy = true;
+    comp_batches++;
+    qemu_sem_post(&param->sem);
+}
+
+/*
+ * Tune the compression level to the link: if the threads can't keep up
+ * with the pages we hand them, compress faster; if they never hold us up
+ * the link is the bottleneck, so spend the spare CPU on a better ratio,
+ * up to the compress-level parameter.
+ */
+static void compress_adapt_level(void)
+{
+    int max_level = migrate_compress_level();
+    int level = comp_level;
+
+    if (comp_batches < migrate_compress_threads() * 4) {
+        /* Not enough to go by */
+        return;
+    }
+    if (comp_stalls * 4 > comp_batches) {
+        level = MAX(level - 1, MIN(max_level, 1));
+    } else if (!comp_stalls) {
+        level = MIN(level + 1, max_level);
+    }
+    if (level != comp_level) {
+        trace_compress_adapt_level(comp_batches, comp_stalls, level);
+        atomic_set(&comp_level, level);
+    }
+    comp_batches = 0;
+    comp_stalls = 0;
+}
 
 static void flush_compressed_data(QEMUFile *f)
 {
-    int idx, len, thread_count;
+    int idx, thread_count;
 
     if (!migrate_use_compression()) {
         return;
     }
     thread_count = migrate_compress_threads();
+    if (comp_param[comp_next].num) {
+        compress_collect(f, &comp_param[comp_next]);
+        compress_start(&comp_param[comp_next]);
+        comp_next = (comp_next + 1) % thread_count;
+    }
+    /* oldest job first, though the order doesn't matter here */
     for (idx = 0; idx < thread_count; idx++) {
-        if (!comp_param[idx].done) {
-            qemu_mutex_lock(comp_done_lock);
-            while (!comp_param[idx].done && !quit_comp_thread) {
-                qemu_cond_wait(comp_done_cond, comp_done_lock);
-            }
-            qemu_mutex_unlock(comp_done_lock);
-        }
-        if (!quit_comp_thread) {
-            len = qemu_put_qemu_file(f, comp_param[idx].file);
-            bytes_transferred += len;
-        }
+        compress_collect(f, &comp_param[(comp_next + idx) % thread_count]);
     }
+    compress_adapt_level();
 }
 
-static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
+/*
+ * Wait for the multifd channels to send everything queued so far and tell
+ * the destination to do the same before it loads anything that follows;
+ * a newer copy of a page must not be overtaken by an older one.
+ */
+static void ram_multifd_sync(QEMUFile *f)
 {
-    param->block = block;
-    param->offset = offset;
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    if (multifd_send_sync_main()) {
+        qemu_file_set_error(f, -EIO);
+        return;
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    bytes_transferred += 8;
 }
 
 static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
                                            ram_addr_t offset,
                                            uint64_t *bytes_transferred)
 {
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
+    CompressParam *param = &comp_param[comp_next];
 
-    thread_count = migrate_compress_threads();
-    qemu_mutex_lock(comp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (comp_param[idx].done) {
-                bytes_xmit = qemu_put_qemu_file(f, comp_param[idx].file);
-                set_compress_params(&comp_param[idx], block, offset);
-                start_compression(&comp_param[idx]);
-                pages = 1;
-                acct_info.norm_pages++;
-                *bytes_transferred += bytes_xmit;
-                break;
-            }
-        }
-        if (pages > 0) {
-            break;
-        } else {
-            qemu_cond_wait(comp_done_cond, comp_done_lock);
-        }
+    /* Starting a new batch on this thread: pick up its last one first */
+    if (!param->num) {
+        compress_collect(f, param);
     }
-    qemu_mutex_unlock(comp_done_lock);
 
-    return pages;
+    param->block[param->num] = block;
+    param->offset[param->num] = offset;
+    param->num++;
+    if (param->num == COMPRESS_BATCH_PAGES) {
+        compress_start(param);
+        comp_next = (comp_next + 1) % migrate_compress_threads();
+    }
+    acct_info.norm_pages++;
+
+    /* The bytes are accounted once the output goes to the stream */
+    return 1;
 }
 
 /**
@@ -920,14 +1626,15 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
             flush_compressed_data(f);
             pages = save_zero_page(f, block, offset, p, bytes_transferred);
             if (pages == -1) {
-                set_compress_params(&comp_param[0], block, offset);
                 /* Use the qemu thread to compress the data to make sure the
                  * first page is sent out before other pages
                  */
-                bytes_xmit = do_compress_ram_page(&comp_param[0]);
+                comp_main.block[0] = block;
+                comp_main.offset[0] = offset;
+                comp_main.num = 1;
+                do_compress_ram_pages(&comp_main);
                 acct_info.norm_pages++;
-                qemu_put_qemu_file(f, comp_param[0].file);
-                *bytes_transferred += bytes_xmit;
+                compress_put_output(f, &comp_main);
                 pages = 1;
             }
         } else {
@@ -939,6 +1646,10 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
         }
     }
 
+    if (pages > 0) {
+        last_sent_block = block;
+    }
+
     return pages;
 }
 
@@ -955,8 +1666,29 @@ static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
 static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
                              bool *again)
 {
-    pss->offset = migration_bitmap_find_and_reset_dirty(pss->block,
-                                                       pss->offset);
+    ram_addr_t end = pss->block->used_length;
+
+    if (ramblock_is_ignored(pss->block)) {
+        pss->offset = end;
+    } else {
+        /*
+         * The completion stage and savevm run with the iothread lock held
+         * and the guest stopped, as does postcopy as far as the source is
+         * concerned; there's nothing to gain from syncing ahead or from
+         * holding hot pages back there.
+         */
+        bool live = !ram_bulk_stage && !qemu_mutex_iothread_locked() &&
+                    !migration_in_postcopy(migrate_get_current());
+
+        if (live) {
+            end = migration_bitmap_sync_ahead(pss->block, pss->offset);
+        }
+
+        pss->offset = migration_bitmap_find_and_reset_dirty(pss->block,
+                                                           pss->offset, end,
+                                                           live &&
+                                                           !send_hot_pages);
+    }
     if (pss->complete_round && pss->block == last_seen_block &&
         pss->offset >= last_offset) {
         /*
@@ -966,6 +1698,11 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
         *again = false;
         return false;
     }
+    if (pss->offset < pss->block->used_length && pss->offset >= end) {
+        /* Nothing in this chunk, sync the next one */
+        *again = true;
+        return false;
+    }
     if (pss->offset >= pss->block->used_length) {
         /* Didn't find anything in this RAM Block */
         pss->offset = 0;
@@ -976,11 +1713,19 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
             /* Flag that we've looped */
             pss->complete_round = true;
             ram_bulk_stage = false;
+            sync_block = NULL;
+            /*
+             * The next round merges the dirty log again, possibly within
+             * this iteration, so a page sent in this round can be sent
+             * once more: the copies still in a compression batch or a
+             * multifd channel must reach the destination first.
+             */
+            flush_compressed_data(f);
+            ram_multifd_sync(f);
             if (migrate_use_xbzrle()) {
                 /* If xbzrle is on, stop using the data compression at this
                  * point. In theory, xbzrle can do better than compression.
                  */
-                flush_compressed_data(f);
                 compression_switch = false;
             }
         }
@@ -995,6 +1740,222 @@ static bool find_dirty_block(QEMUFile *f, PageSearchStatus *pss,
     }
 }
 
+/* Called within an RCU critical section */
+static RAMBlock *ram_find_block_by_idstr(const char *id)
+{
+    RAMBlock *block;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!strcmp(id, block->idstr)) {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Returns the host address of @len bytes at @offset in the RAMBlock called
+ * @block_name, or NULL if there's no such block or the range is outside it.
+ * Called from the multifd receive threads within an RCU critical section.
+ */
+void *ram_multifd_host_from_name(const char *block_name, ram_addr_t offset,
+                                 size_t len)
+{
+    RAMBlock *block = ram_find_block_by_idstr(block_name);
+
+    if (!block || offset > block->used_length ||
+        len > block->used_length - offset ||
+        (offset & ~TARGET_PAGE_MASK)) {
+        return NULL;
+    }
+
+    return block->host + offset;
+}
+
+/*
+ * Take the next page off the queue of pages requested by the destination.
+ *
+ * Returns: The RAMBlock the page is in, or NULL if the queue is empty
+ *
+ * @offset: Set to the offset of the page within the block
+ */
+static RAMBlock *unqueue_page(ram_addr_t *offset)
+{
+    RAMBlock *block = NULL;
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    if (!QSIMPLEQ_EMPTY(&src_page_requests)) {
+        struct RAMSrcPageRequest *entry = QSIMPLEQ_FIRST(&src_page_requests);
+        block = entry->rb;
+        *offset = entry->offset;
+
+        if (entry->len > TARGET_PAGE_SIZE) {
+            entry->len -= TARGET_PAGE_SIZE;
+            entry->offset += TARGET_PAGE_SIZE;
+        } else {
+            memory_region_unref(block->mr);
+            QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+            g_free(entry);
+        }
+    }
+    qemu_mutex_unlock(&src_page_req_mutex);
+
+    return block;
+}
+
+/*
+ * Unqueue a page requested by the destination, skipping any that have
+ * already been sent (i.e. are no longer dirty).
+ *
+ * Called within an RCU critical section.
+ *
+ * Returns: True if a queued page is found; @pss is pointed at it and its
+ *          dirty bit has been cleared
+ *
+ * @pss: Data about the state of the current dirty page scan.
+ */
+static bool get_queued_page(PageSearchStatus *pss)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+    struct BitmapRcu *bitmap;
+    bool dirty = false;
+
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu);
+    do {
+        block = unqueue_page(&offset);
+        if (block) {
+            unsigned long page = (block->offset + offset) >> TARGET_PAGE_BITS;
+
+            dirty = test_bit(page, bitmap->bmap);
+            trace_get_queued_page(block->idstr, (uint64_t)offset, dirty);
+            if (dirty) {
+                migration_bitmap_clear_page(bitmap, page);
+            }
+        }
+    } while (block && !dirty);
+
+    if (block) {
+        /*
+         * As soon as we start servicing pages out of order, then we have
+         * to kill the bulk stage, since the bulk stage assumes
+         * in (migration_bitmap_find_and_reset_dirty) that every page is
+         * dirty, that's no longer true.
+         */
+        ram_bulk_stage = false;
+
+        /*
+         * We want the background search to continue from the queued page
+         * since the guest is likely to want other pages near to the page
+         * it just requested.
+         */
+        pss->block = block;
+        pss->offset = offset;
+    }
+
+    return !!block;
+}
+
+/* Drop any page requests left over, e.g. from a failed migration */
+static void flush_page_queue(void)
+{
+    struct RAMSrcPageRequest *mspr, *next_mspr;
+
+    qemu_mutex_lock(&src_page_req_mutex);
+    QSIMPLEQ_FOREACH_SAFE(mspr, &src_page_requests, next_req, next_mspr) {
+        memory_region_unref(mspr->rb->mr);
+        QSIMPLEQ_REMOVE_HEAD(&src_page_requests, next_req);
+        g_free(mspr);
+    }
+    last_requested_block = NULL;
+    qemu_mutex_unlock(&src_page_req_mutex);
+}
+
+/**
+ * ram_save_queue_pages: Queue a range of pages requested by the destination
+ *   so that they're sent ahead of the background scan.
+ *
+ * Called from the return path thread.
+ *
+ * Returns: 0 on success, -1 on error
+ *
+ * @rbname: Name of the RAMBlock, or NULL to reuse the previous block
+ * @start: Offset within the block
+ * @len: Length in bytes
+ */
+int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
+{
+    RAMBlock *ramblock;
+    struct RAMSrcPageRequest *new_entry;
+
+    rcu_read_lock();
+    if (!rbname) {
+        /* Reuse last RAMBlock */
+        ramblock = last_requested_block;
+        if (!ramblock) {
+            /*
+             * Shouldn't happen, we can't reuse the last RAMBlock if
+             * it's the 1st request.
+             */
+            error_report("ram_save_queue_pages no previous block");
+            goto err;
+        }
+    } else {
+        ramblock = ram_find_block_by_idstr(rbname);
+
+        if (!ramblock) {
+            /* We shouldn't be asked for a non-existent RAMBlock */
+            error_report("ram_save_queue_pages no block '%s'", rbname);
+            goto err;
+        }
+        last_requested_block = ramblock;
+    }
+    trace_ram_save_queue_pages(ramblock->idstr, start, len);
+    if (start + len > ramblock->used_length) {
+        error_report("%s request overrun start=" RAM_ADDR_FMT " len="
+                     RAM_ADDR_FMT " blocklen=" RAM_ADDR_FMT,
+                     __func__, start, len, ramblock->used_length);
+        goto err;
+    }
+
+    new_entry = g_new0(struct RAMSrcPageRequest, 1);
+    new_entry->rb = ramblock;
+    new_entry->offset = start;
+    new_entry->len = len;
+
+    memory_region_ref(ramblock->mr);
+    qemu_mutex_lock(&src_page_req_mutex);
+    QSIMPLEQ_INSERT_TAIL(&src_page_requests, new_entry, next_req);
+    qemu_mutex_unlock(&src_page_req_mutex);
+    rcu_read_unlock();
+
+    return 0;
+
+err:
+    rcu_read_unlock();
+    return -1;
+}
+
+/*
+ * Account for the page at @offset of @block having just been sent, as a
+ * zero page if @zero.  Sending it again only counts as a resend once its
+ * contents went out before: the destination already has zero pages.
+ *
+ * Called within an RCU critical section.
+ */
+static void ram_page_sent(RAMBlock *block, ram_addr_t offset, bool zero)
+{
+    struct BitmapRcu *bitmap = atomic_rcu_read(&migration_bitmap_rcu);
+    unsigned long page = (block->offset + offset) >> TARGET_PAGE_BITS;
+
+    if (test_bit(page, bitmap->sent)) {
+        acct_info.resent_pages++;
+    } else if (!zero) {
+        set_bit(page, bitmap->sent);
+    }
+}
+
 /**
  * ram_find_and_save_block: Finds a dirty page and sends it to f
  *
@@ -1021,12 +1982,26 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
 
     if (!pss.block) {
         pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
+        /* Where to give up if a whole round finds nothing */
+        last_seen_block = pss.block;
+    }
+
+    if (atomic_read(&free_page_hint_accepting)) {
+        free_page_hint_apply();
     }
 
     do {
-        found = find_dirty_block(f, &pss, &again);
+        again = true;
+        found = get_queued_page(&pss);
+
+        if (!found) {
+            /* priority queue empty, so just search for something dirty */
+            found = find_dirty_block(f, &pss, &again);
+        }
 
         if (found) {
+            uint64_t dup_pages = acct_info.dup_pages;
+
             if (compression_switch && migrate_use_compression()) {
                 pages = ram_save_compressed_page(f, pss.block, pss.offset,
                                                  last_stage,
@@ -1035,10 +2010,9 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage,
                 pages = ram_save_page(f, pss.block, pss.offset, last_stage,
                                       bytes_transferred);
             }
-
-            /* if page is unmodified, continue to the next */
             if (pages > 0) {
-                last_sent_block = pss.block;
+                ram_page_sent(pss.block, pss.offset,
+                              acct_info.dup_pages != dup_pages);
             }
         }
     } while (!pages && again);
@@ -1097,6 +2071,9 @@ void free_xbzrle_decoded_buf(void)
 static void migration_bitmap_free(struct BitmapRcu *bmap)
 {
     g_free(bmap->bmap);
+    g_free(bmap->streak_lo);
+    g_free(bmap->streak_hi);
+    g_free(bmap->sent);
     g_free(bmap);
 }
 
@@ -1110,10 +2087,21 @@ static void migration_end(void)
     if (bitmap) {
         memory_global_dirty_log_stop();
         call_rcu(bitmap, migration_bitmap_free, rcu);
+
+        free_page_hint_accepting = false;
+        qemu_mutex_lock(&free_page_hint_lock);
+        g_array_set_size(free_page_hints, 0);
+        qemu_mutex_unlock(&free_page_hint_lock);
+        free_page_hint_notify(FREE_PAGE_HINT_DONE);
     }
 
     XBZRLE_cache_lock();
     if (XBZRLE.cache) {
+        PageCacheStats stats;
+
+        cache_get_stats(XBZRLE.cache, &stats);
+        trace_xbzrle_cache_stats(stats.hits, stats.misses, stats.evictions,
+                                 stats.rejected, stats.items);
         cache_fini(XBZRLE.cache);
         g_free(XBZRLE.encoded_buf);
         g_free(XBZRLE.current_buf);
@@ -1122,6 +2110,8 @@ static void migration_end(void)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+
+    flush_page_queue();
 }
 
 static void ram_migration_cancel(void *opaque)
@@ -1136,33 +2126,177 @@ static void reset_ram_globals(void)
     last_offset = 0;
     last_version = ram_list.version;
     ram_bulk_stage = true;
+    sync_block = NULL;
+    send_hot_pages = false;
 }
 
-#define MAX_WAIT 50 /* ms, half buffered_file limit */
+#define MAX_WAIT 50 /* ms, half buffered_file limit */
+
+void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
+{
+    /* called in qemu main thread, so there is
+     * no writing race against this migration_bitmap
+     */
+    if (migration_bitmap_rcu) {
+        struct BitmapRcu *old_bitmap = migration_bitmap_rcu, *bitmap;
+        bitmap = g_new(struct BitmapRcu, 1);
+        bitmap->size = new;
+        bitmap->bmap = bitmap_new(new);
+        bitmap->streak_lo = bitmap_new(new);
+        bitmap->streak_hi = bitmap_new(new);
+        bitmap->sent = bitmap_new(new);
+
+        /* prevent migration_bitmap content from being set bit
+         * by migration_bitmap_sync_range() at the same time.
+         * it is safe to migration if migration_bitmap is cleared bit
+         * at the same time.
+         */
+        qemu_mutex_lock(&migration_bitmap_mutex);
+        bitmap_copy(bitmap->bmap, old_bitmap->bmap, old);
+        bitmap_copy(bitmap->streak_lo, old_bitmap->streak_lo, old);
+        bitmap_copy(bitmap->streak_hi, old_bitmap->streak_hi, old);
+        bitmap_copy(bitmap->sent, old_bitmap->sent, old);
+        bitmap_set(bitmap->bmap, old, new - old);
+        atomic_rcu_set(&migration_bitmap_rcu, bitmap);
+        qemu_mutex_unlock(&migration_bitmap_mutex);
+        migration_dirty_pages += new - old;
+        call_rcu(old_bitmap, migration_bitmap_free, rcu);
+    }
+}
+
+/*
+ * Send the runs of dirty pages in one RAMBlock to the destination as
+ * discard commands, up to MAX_DISCARDS_PER_COMMAND ranges per command.
+ *
+ * Called within an RCU critical section.
+ */
+static int postcopy_send_discard_block(MigrationState *ms, RAMBlock *block,
+                                       unsigned long *bitmap)
+{
+    uint64_t start_list[MAX_DISCARDS_PER_COMMAND];
+    uint64_t length_list[MAX_DISCARDS_PER_COMMAND];
+    unsigned long first = block->offset >> TARGET_PAGE_BITS;
+    unsigned long last = first + (block->used_length >> TARGET_PAGE_BITS);
+    unsigned long run_start = first;
+    unsigned long run_end;
+    uint16_t nranges = 0;
+    unsigned int total = 0;
+
+    while (run_start < last) {
+        run_start = find_next_bit(bitmap, last, run_start);
+        if (run_start >= last) {
+            break;
+        }
+        run_end = find_next_zero_bit(bitmap, last, run_start + 1);
+
+        start_list[nranges] = (uint64_t)(run_start - first) << TARGET_PAGE_BITS;
+        length_list[nranges] = (uint64_t)(run_end - run_start) <<
+                               TARGET_PAGE_BITS;
+        nranges++;
+        total++;
+        if (nranges == MAX_DISCARDS_PER_COMMAND) {
+            qemu_savevm_send_postcopy_ram_discard(ms->file, block->idstr,
+                                                  nranges, start_list,
+                                                  length_list);
+            nranges = 0;
+        }
+        run_start = run_end + 1;
+    }
+
+    if (nranges) {
+        qemu_savevm_send_postcopy_ram_discard(ms->file, block->idstr,
+                                              nranges, start_list,
+                                              length_list);
+    }
+    trace_postcopy_send_discard_block(block->idstr, total);
+
+    return qemu_file_get_error(ms->file);
+}
+
+/**
+ * ram_postcopy_send_discard_bitmap: Tell the destination to discard any
+ *   page it has that is dirty on the source; those are the pages that were
+ *   redirtied after being sent, plus any never sent.  They'll be sent again
+ *   (or requested) once the destination is running.
+ *
+ * Called with the iothread lock held and the guest stopped.
+ *
+ * Returns: 0 on success, negative on error
+ *
+ * @ms: Current migration state
+ */
+int ram_postcopy_send_discard_bitmap(MigrationState *ms)
+{
+    RAMBlock *block;
+    unsigned long *bitmap;
+    int ret = 0;
+
+    rcu_read_lock();
+
+    /* This should be our last sync, the src is now paused */
+    migration_bitmap_sync();
+
+    /* Restart the background scan from the start of RAM */
+    last_seen_block = NULL;
+    last_sent_block = NULL;
+    last_offset = 0;
+
+    bitmap = atomic_rcu_read(&migration_bitmap_rcu)->bmap;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ret = postcopy_send_discard_block(ms, block, bitmap);
+        if (ret) {
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return ret;
+}
 
-void migration_bitmap_extend(ram_addr_t old, ram_addr_t new)
+/**
+ * ram_discard_range: Discard a range of pages in a RAMBlock on the
+ *   destination, so that they fault (and get requested) when touched.
+ *
+ * Returns: 0 on success, -1 on error
+ *
+ * @mis: Current incoming migration state
+ * @block_name: Name of the RAMBlock
+ * @start: Offset within the block
+ * @length: Length in bytes
+ */
+int ram_discard_range(MigrationIncomingState *mis,
+                      const char *block_name,
+                      uint64_t start, size_t length)
 {
-    /* called in qemu main thread, so there is
-     * no writing race against this migration_bitmap
-     */
-    if (migration_bitmap_rcu) {
-        struct BitmapRcu *old_bitmap = migration_bitmap_rcu, *bitmap;
-        bitmap = g_new(struct BitmapRcu, 1);
-        bitmap->bmap = bitmap_new(new);
+    int ret = -1;
+    RAMBlock *rb;
 
-        /* prevent migration_bitmap content from being set bit
-         * by migration_bitmap_sync_range() at the same time.
-         * it is safe to migration if migration_bitmap is cleared bit
-         * at the same time.
-         */
-        qemu_mutex_lock(&migration_bitmap_mutex);
-        bitmap_copy(bitmap->bmap, old_bitmap->bmap, old);
-        bitmap_set(bitmap->bmap, old, new - old);
-        atomic_rcu_set(&migration_bitmap_rcu, bitmap);
-        qemu_mutex_unlock(&migration_bitmap_mutex);
-        migration_dirty_pages += new - old;
-        call_rcu(old_bitmap, migration_bitmap_free, rcu);
+    rcu_read_lock();
+    rb = ram_find_block_by_idstr(block_name);
+    if (!rb) {
+        error_report("ram_discard_range: Failed to find block '%s'",
+                     block_name);
+        goto err;
+    }
+
+    if (start & ~TARGET_PAGE_MASK) {
+        error_report("ram_discard_range: Unaligned start address: %" PRIx64,
+                     start);
+        goto err;
+    }
+
+    if ((start + length) <= rb->used_length) {
+        ret = postcopy_ram_discard_range(mis, rb->host + start, length);
+    } else {
+        error_report("ram_discard_range: Overrun block '%s' (%" PRIu64
+                     "/%zx/" RAM_ADDR_FMT")",
+                     block_name, start, length, rb->used_length);
     }
+
+err:
+    rcu_read_unlock();
+
+    return ret;
 }
 
 /* Each of ram_save_setup, ram_save_iterate and ram_save_complete has
@@ -1176,11 +2310,14 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
-    dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
     migration_bitmap_sync_init();
     qemu_mutex_init(&migration_bitmap_mutex);
 
+    if (migrate_use_mapped_ram() && mapped_ram_save_setup(f) < 0) {
+        return -1;
+    }
+
     if (migrate_use_xbzrle()) {
         XBZRLE_cache_lock();
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
@@ -1220,7 +2357,11 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 
     ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
     migration_bitmap_rcu = g_new(struct BitmapRcu, 1);
+    migration_bitmap_rcu->size = ram_bitmap_pages;
     migration_bitmap_rcu->bmap = bitmap_new(ram_bitmap_pages);
+    migration_bitmap_rcu->streak_lo = bitmap_new(ram_bitmap_pages);
+    migration_bitmap_rcu->streak_hi = bitmap_new(ram_bitmap_pages);
+    migration_bitmap_rcu->sent = bitmap_new(ram_bitmap_pages);
     bitmap_set(migration_bitmap_rcu->bmap, 0, ram_bitmap_pages);
 
     /*
@@ -1228,9 +2369,20 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
      * gaps due to alignment or unplugs.
      */
     migration_dirty_pages = ram_bytes_total() >> TARGET_PAGE_BITS;
+    migration_hot_pages = 0;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (ramblock_is_ignored(block)) {
+            bitmap_clear(migration_bitmap_rcu->bmap,
+                         block->offset >> TARGET_PAGE_BITS,
+                         block->used_length >> TARGET_PAGE_BITS);
+            migration_dirty_pages -= block->used_length >> TARGET_PAGE_BITS;
+        }
+    }
 
     memory_global_dirty_log_start();
     migration_bitmap_sync();
+    free_page_hint_start();
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
 
@@ -1240,6 +2392,12 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        if (migrate_use_mapped_ram()) {
+            qemu_put_be64(f, MAPPED_RAM_ALIGN + block->offset);
+        }
+        if (migrate_ignore_shared()) {
+            qemu_put_byte(f, ramblock_is_ignored(block));
+        }
     }
 
     rcu_read_unlock();
@@ -1298,6 +2456,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    ram_multifd_sync(f);
+    mapped_ram_flush(f);
     rcu_read_unlock();
 
     /*
@@ -1317,12 +2477,17 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     return pages_sent;
 }
 
-/* Called with iothread lock */
+/* Called with iothread lock, or in postcopy with the guest stopped */
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
     rcu_read_lock();
 
-    migration_bitmap_sync();
+    if (!migration_in_postcopy(migrate_get_current())) {
+        int64_t start = migration_profile_now();
+
+        migration_bitmap_sync();
+        migration_profile_phase(MIGRATION_PROFILE_SAVE, "bitmap-sync", start);
+    }
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
@@ -1340,6 +2505,8 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    ram_multifd_sync(f);
+    mapped_ram_flush(f);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -1350,20 +2517,37 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     return 0;
 }
 
+static uint64_t ram_save_cold_size(void)
+{
+    uint64_t dirty = ram_save_remaining();
+
+    return (dirty - MIN(migration_hot_pages, dirty)) * TARGET_PAGE_SIZE;
+}
+
+/*
+ * The scan holds hot pages back, so only the cold ones tell whether it is
+ * time for a full sync; a hot working set of max_size or more would
+ * otherwise keep the dirty rate and throttling from ever being updated.
+ */
 static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
 {
-    uint64_t remaining_size;
+    uint64_t remaining_size, cold_size;
 
     remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+    cold_size = ram_save_cold_size();
 
-    if (remaining_size < max_size) {
+    if (!migration_in_postcopy(migrate_get_current()) &&
+        cold_size < max_size) {
         qemu_mutex_lock_iothread();
         rcu_read_lock();
         migration_bitmap_sync();
+        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
+        cold_size = ram_save_cold_size();
         rcu_read_unlock();
         qemu_mutex_unlock_iothread();
-        remaining_size = ram_save_remaining() * TARGET_PAGE_SIZE;
     }
+    /* Nothing much cold left to send: send the hot pages too */
+    send_hot_pages = cold_size < max_size;
     return remaining_size;
 }
 
@@ -1405,11 +2589,14 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
 /* Must be called from within a rcu critical section.
  * Returns a pointer from within the RCU-protected ram_list.
  */
+/* The block of the last page read from the stream */
+static RAMBlock *load_block;
+
 static inline void *host_from_stream_offset(QEMUFile *f,
                                             ram_addr_t offset,
                                             int flags)
 {
-    static RAMBlock *block = NULL;
+    RAMBlock *block = load_block;
     char id[256];
     uint8_t len;
 
@@ -1426,12 +2613,18 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     qemu_get_buffer(f, (uint8_t *)id, len);
     id[len] = 0;
 
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)) &&
-            block->max_length > offset) {
-            return block->host + offset;
+    /* The source names the block again when it comes back to it */
+    if (!block || strncmp(id, block->idstr, sizeof(id))) {
+        QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
         }
     }
+    if (block && block->max_length > offset) {
+        load_block = block;
+        return block->host + offset;
+    }
 
     error_report("Can't find block %s!", id);
     return NULL;
@@ -1448,28 +2641,56 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
+static void decompress_param_init_ctx(DecompressParam *param)
+{
+    MigrationCompressMethod method = migrate_compress_method_current();
+
+    if (!param->ctx || migrate_compress_ctx_method(param->ctx) != method) {
+        migrate_compress_ctx_free(param->ctx);
+        param->ctx = migrate_compress_ctx_new(method, 0, true);
+        if (!param->ctx) {
+            error_report("Failed to initialise decompression");
+            abort();
+        }
+    }
+}
+
+static void do_decompress_ram_pages(DecompressParam *param)
+{
+    uint8_t *compbuf = param->compbuf;
+    int i;
+
+    for (i = 0; i < param->num; i++) {
+        if (!param->compressed[i]) {
+            memcpy(param->des[i], compbuf, param->len[i]);
+            compbuf += param->len[i];
+            continue;
+        }
+        decompress_param_init_ctx(param);
+        /* Decompression will fail in some case, especially when the page is
+         * dirtied when doing the compression, it's not a problem because
+         * the dirty page will be retransferred and the failure won't break
+         * the data in other pages.
+         */
+        migrate_decompress_page(param->ctx, param->des[i], TARGET_PAGE_SIZE,
+                                compbuf, param->len[i]);
+        compbuf += param->len[i];
+    }
+    param->num = 0;
+    param->compbuf_len = 0;
+}
+
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
-
-    while (!quit_decomp_thread) {
-        qemu_mutex_lock(&param->mutex);
-        while (!param->start && !quit_decomp_thread) {
-            qemu_cond_wait(&param->cond, &param->mutex);
-            pagesize = TARGET_PAGE_SIZE;
-            if (!quit_decomp_thread) {
-                /* uncompress() will return failed in some case, especially
-                 * when the page is dirted when doing the compression, it's
-                 * not a problem because the dirty page will be retransferred
-                 * and uncompress() won't break the data in other pages.
-                 */
-                uncompress((Bytef *)param->des, &pagesize,
-                           (const Bytef *)param->compbuf, param->len);
-            }
-            param->start = false;
+
+    while (true) {
+        qemu_sem_wait(&param->sem);
+        if (atomic_read(&quit_decomp_thread)) {
+            break;
         }
-        qemu_mutex_unlock(&param->mutex);
+        do_decompress_ram_pages(param);
+        qemu_sem_post(&param->done_sem);
     }
 
     return NULL;
@@ -1482,12 +2703,16 @@ void migrate_decompress_threads_create(void)
     thread_count = migrate_decompress_threads();
     decompress_threads = g_new0(QemuThread, thread_count);
     decomp_param = g_new0(DecompressParam, thread_count);
-    compressed_data_buf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+    decomp_next = 0;
     quit_decomp_thread = false;
+    /* Unless the configuration section says otherwise */
+    migrate_compress_method_set_current(MIGRATION_COMPRESS_METHOD_ZLIB);
     for (i = 0; i < thread_count; i++) {
-        qemu_mutex_init(&decomp_param[i].mutex);
-        qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        qemu_sem_init(&decomp_param[i].sem, 0);
+        qemu_sem_init(&decomp_param[i].done_sem, 0);
+        decomp_param[i].compbuf =
+            g_malloc0(COMPRESS_BATCH_PAGES *
+                      migrate_compress_bound(TARGET_PAGE_SIZE));
         qemu_thread_create(decompress_threads + i, "decompress",
                            do_data_decompress, decomp_param + i,
                            QEMU_THREAD_JOINABLE);
@@ -1498,54 +2723,434 @@ void migrate_decompress_threads_join(void)
 {
     int i, thread_count;
 
-    quit_decomp_thread = true;
+    atomic_set(&quit_decomp_thread, true);
     thread_count = migrate_decompress_threads();
     for (i = 0; i < thread_count; i++) {
-        qemu_mutex_lock(&decomp_param[i].mutex);
-        qemu_cond_signal(&decomp_param[i].cond);
-        qemu_mutex_unlock(&decomp_param[i].mutex);
+        qemu_sem_post(&decomp_param[i].sem);
     }
     for (i = 0; i < thread_count; i++) {
         qemu_thread_join(decompress_threads + i);
-        qemu_mutex_destroy(&decomp_param[i].mutex);
-        qemu_cond_destroy(&decomp_param[i].cond);
+        qemu_sem_destroy(&decomp_param[i].sem);
+        qemu_sem_destroy(&decomp_param[i].done_sem);
+        migrate_compress_ctx_free(decomp_param[i].ctx);
         g_free(decomp_param[i].compbuf);
     }
     g_free(decompress_threads);
     g_free(decomp_param);
-    g_free(compressed_data_buf);
     decompress_threads = NULL;
     decomp_param = NULL;
-    compressed_data_buf = NULL;
 }
 
-static void decompress_data_with_multi_threads(uint8_t *compbuf,
-                                               void *host, int len)
+static void decompress_collect(DecompressParam *param)
+{
+    if (param->busy) {
+        qemu_sem_wait(&param->done_sem);
+        param->busy = false;
+    }
+}
+
+static void decompress_start(DecompressParam *param)
+{
+    param->busy = true;
+    qemu_sem_post(&param->sem);
+    decomp_next = (decomp_next + 1) % migrate_decompress_threads();
+}
+
+/*
+ * Read a page of @len bytes from @f straight into the batch of the current
+ * decompression thread, to be decompressed (if @compressed) or copied into
+ * @host.
+ */
+static void load_data_with_multi_threads(QEMUFile *f, void *host, int len,
+                                         bool compressed)
+{
+    DecompressParam *param = &decomp_param[decomp_next];
+
+    if (!param->num) {
+        decompress_collect(param);
+    }
+
+    qemu_get_buffer(f, param->compbuf + param->compbuf_len, len);
+    param->des[param->num] = host;
+    param->len[param->num] = len;
+    param->compressed[param->num] = compressed;
+    param->compbuf_len += len;
+    param->num++;
+    if (param->num == COMPRESS_BATCH_PAGES) {
+        decompress_start(param);
+    }
+}
+
+/*
+ * Runs of zero pages shorter than this are checked and cleared a page at a
+ * time, longer ones are discarded in one go
+ */
+#define ZERO_RUN_DISCARD_MIN (64 * 1024)
+
+/* Zero pages seen in a row and not cleared yet */
+static struct {
+    RAMBlock *block;
+    uint8_t *host;
+    size_t len;
+} zero_run;
+
+static void zero_run_flush(void)
+{
+    uint8_t *start = zero_run.host;
+    uint8_t *end = zero_run.host + zero_run.len;
+    uint8_t *dstart, *dend;
+
+    if (!zero_run.len) {
+        return;
+    }
+    zero_run.len = 0;
+
+    /*
+     * Discarded pages would be missing again once postcopy registers the
+     * RAM with userfaultfd, and the source never resends clean pages.
+     */
+    if (end - start >= ZERO_RUN_DISCARD_MIN &&
+        postcopy_state_get() == POSTCOPY_INCOMING_NONE) {
+        /*
+         * Dropping the host pages makes them read as zero without writing
+         * to them, or even faulting them in if the guest never touched them
+         */
+        dstart = (uint8_t *)REAL_HOST_PAGE_ALIGN((uintptr_t)start);
+        dend = (uint8_t *)((uintptr_t)end & ~(qemu_real_host_page_size - 1));
+        if (dend > dstart &&
+            !qemu_madvise(dstart, dend - dstart, QEMU_MADV_DONTNEED)) {
+            ram_handle_compressed(start, 0, dstart - start);
+            ram_handle_compressed(dend, 0, end - dend);
+            return;
+        }
+    }
+    ram_handle_compressed(start, 0, end - start);
+}
+
+/*
+ * Handle a page that was all @ch; runs of zero pages in anonymous RAM are
+ * gathered to be discarded together
+ */
+static void load_zero_page(RAMBlock *block, uint8_t *host, uint8_t ch)
+{
+    if (ch || mem_prealloc || !qemu_ram_is_anonymous(block)) {
+        ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+        return;
+    }
+    if (zero_run.len && (zero_run.block != block ||
+                         zero_run.host + zero_run.len != host)) {
+        zero_run_flush();
+    }
+    if (!zero_run.len) {
+        zero_run.block = block;
+        zero_run.host = host;
+    }
+    zero_run.len += TARGET_PAGE_SIZE;
+}
+
+/*
+ * Wait until all the pages queued for decompression are in place; pages
+ * sent later may overwrite them.
+ */
+static void wait_for_decompress_done(void)
 {
     int idx, thread_count;
 
+    zero_run_flush();
+    if (!decomp_param) {
+        return;
+    }
     thread_count = migrate_decompress_threads();
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (!decomp_param[idx].start) {
-                memcpy(decomp_param[idx].compbuf, compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                start_decompression(&decomp_param[idx]);
+    if (decomp_param[decomp_next].num) {
+        decompress_start(&decomp_param[decomp_next]);
+    }
+    for (idx = 0; idx < thread_count; idx++) {
+        decompress_collect(&decomp_param[idx]);
+    }
+}
+
+/*
+ * Pages queued to the decompression threads or to be cleared have to land
+ * before anything later in the stream touches the same page.  Within a
+ * pass the source sends the pages of a block in increasing order, so all
+ * it takes is to wait for them whenever that order breaks.
+ */
+static RAMBlock *load_order_block;
+static uint8_t *load_order_host;
+
+static void load_order_check(uint8_t *host)
+{
+    if (load_block != load_order_block || host <= load_order_host) {
+        wait_for_decompress_done();
+        load_order_block = load_block;
+    }
+    load_order_host = host;
+}
+
+/*
+ * Load pages while the destination is running in postcopy; each page has
+ * to be placed atomically so the guest never sees a partial page.
+ *
+ * Called within an RCU critical section.
+ */
+static int ram_load_postcopy(QEMUFile *f)
+{
+    int flags = 0, ret = 0;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    /* Temporary page that is later 'placed' */
+    void *postcopy_host_page = postcopy_get_tmp_page(mis);
+
+    if (!postcopy_host_page) {
+        return -ENOMEM;
+    }
+
+    while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
+        ram_addr_t addr;
+        void *host = NULL;
+        uint8_t ch;
+        bool all_zero = false;
+
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        trace_ram_load_postcopy_loop((uint64_t)addr, flags);
+        if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE)) {
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
                 break;
             }
         }
-        if (idx < thread_count) {
+
+        switch (flags & ~RAM_SAVE_FLAG_CONTINUE) {
+        case RAM_SAVE_FLAG_COMPRESS:
+            ch = qemu_get_byte(f);
+            all_zero = !ch;
+            if (!all_zero) {
+                memset(postcopy_host_page, ch, TARGET_PAGE_SIZE);
+            }
+            break;
+
+        case RAM_SAVE_FLAG_PAGE:
+            qemu_get_buffer(f, postcopy_host_page, TARGET_PAGE_SIZE);
+            break;
+        case RAM_SAVE_FLAG_EOS:
+            /* normal exit */
+            break;
+        default:
+            error_report("Unknown combination of migration flags: %#x"
+                         " (postcopy mode)", flags);
+            ret = -EINVAL;
+        }
+
+        if (!ret && host) {
+            /* Don't place a page made of a truncated stream */
+            ret = qemu_file_get_error(f);
+            if (!ret) {
+                if (all_zero) {
+                    ret = postcopy_place_page_zero(mis, host);
+                } else {
+                    ret = postcopy_place_page(mis, host, postcopy_host_page);
+                }
+            }
+        }
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Loading an x-mapped-ram file: the pages of each block are read in
+ * parallel by the decompression threads' worth of threads, in chunks.
+ * Only the parts of the file that hold data are read; the holes are
+ * pages that were zero and never written, those only need clearing if
+ * something has been put there already, like a -kernel image.
+ */
+#ifndef _WIN32
+#define MAPPED_RAM_LOAD_CHUNK   (64 * 1024 * 1024)
+
+typedef struct MappedRamChunk {
+    uint64_t offset;    /* in the block */
+    uint64_t len;
+    bool data;
+} MappedRamChunk;
+
+typedef struct MappedRamLoad {
+    int fd;
+    uint8_t *host;
+    uint64_t file_offset;
+    GArray *chunks;
+    int next;
+    int error;
+} MappedRamLoad;
+
+static int mapped_ram_load_chunk(MappedRamLoad *load, MappedRamChunk *c)
+{
+    uint64_t done = 0;
+    ssize_t len;
+
+    if (!c->data) {
+        for (done = 0; done < c->len; done += TARGET_PAGE_SIZE) {
+            uint8_t *p = load->host + c->offset + done;
+
+            if (!is_zero_range(p, TARGET_PAGE_SIZE)) {
+                memset(p, 0, TARGET_PAGE_SIZE);
+            }
+        }
+        return 0;
+    }
+
+    while (done < c->len) {
+        len = pread(load->fd, load->host + c->offset + done, c->len - done,
+                    load->file_offset + c->offset + done);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len <= 0) {
+            return len < 0 ? -errno : -EIO;
+        }
+        done += len;
+    }
+    return 0;
+}
+
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRamLoad *load = opaque;
+    int i, ret;
+
+    while ((i = atomic_fetch_inc(&load->next)) < load->chunks->len) {
+        ret = mapped_ram_load_chunk(load, &g_array_index(load->chunks,
+                                                         MappedRamChunk, i));
+        if (ret < 0) {
+            atomic_cmpxchg(&load->error, 0, ret);
             break;
         }
     }
+    return NULL;
+}
+
+static void mapped_ram_add_chunks(GArray *chunks, uint64_t start,
+                                  uint64_t end, bool data)
+{
+    MappedRamChunk c = { .data = data };
+
+    while (start < end) {
+        c.offset = start;
+        c.len = MIN(end - start, MAPPED_RAM_LOAD_CHUNK);
+        g_array_append_val(chunks, c);
+        start += c.len;
+    }
+}
+
+/* Splits the block into chunks of data and of holes */
+static void mapped_ram_find_chunks(MappedRamLoad *load, uint64_t length)
+{
+    uint64_t pos = 0;
+
+    while (pos < length) {
+        off_t data = -1, hole;
+
+#ifdef SEEK_DATA
+        data = lseek(load->fd, load->file_offset + pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            /* Nothing but a hole up to the end of the file */
+            mapped_ram_add_chunks(load->chunks, pos, length, false);
+            return;
+        }
+#endif
+        if (data < 0) {
+            /* Can't tell, read it all */
+            mapped_ram_add_chunks(load->chunks, pos, length, true);
+            return;
+        }
+        data = MIN(QEMU_ALIGN_DOWN(data - load->file_offset,
+                                   TARGET_PAGE_SIZE), length);
+        mapped_ram_add_chunks(load->chunks, pos, data, false);
+        pos = data;
+        if (pos >= length) {
+            return;
+        }
+#ifdef SEEK_HOLE
+        hole = lseek(load->fd, load->file_offset + pos, SEEK_HOLE);
+#else
+        hole = -1;
+#endif
+        if (hole < 0) {
+            mapped_ram_add_chunks(load->chunks, pos, length, true);
+            return;
+        }
+        hole = MIN(QEMU_ALIGN_UP(hole - load->file_offset, TARGET_PAGE_SIZE),
+                   length);
+        mapped_ram_add_chunks(load->chunks, pos, hole, true);
+        pos = hole;
+    }
+}
+
+static int mapped_ram_load_block(QEMUFile *f, RAMBlock *block,
+                                 uint64_t file_offset)
+{
+    MappedRamLoad load = {
+        .fd = qemu_get_fd(f),
+        .host = block->host,
+        .file_offset = file_offset,
+    };
+    int i, thread_count = migrate_decompress_threads();
+    QemuThread *threads;
+
+    if (load.fd < 0 || file_offset & (TARGET_PAGE_SIZE - 1)) {
+        return -EINVAL;
+    }
+
+    load.chunks = g_array_new(false, false, sizeof(MappedRamChunk));
+    mapped_ram_find_chunks(&load, block->used_length);
+    thread_count = MAX(1, MIN(thread_count, load.chunks->len));
+
+    threads = g_new0(QemuThread, thread_count);
+    for (i = 0; i < thread_count; i++) {
+        qemu_thread_create(threads + i, "mapped-ram-load",
+                           mapped_ram_load_thread, &load,
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < thread_count; i++) {
+        qemu_thread_join(threads + i);
+    }
+    trace_mapped_ram_load_block(block->idstr, file_offset,
+                                load.chunks->len, thread_count);
+    g_free(threads);
+    g_array_free(load.chunks, true);
+
+    if (load.error) {
+        error_report("Failed to read RAM block %s from the file: %s",
+                     block->idstr, strerror(-load.error));
+    }
+    return load.error;
+}
+#else
+static int mapped_ram_load_block(QEMUFile *f, RAMBlock *block,
+                                 uint64_t file_offset)
+{
+    return -ENOTSUP;
 }
+#endif
 
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0;
     static uint64_t seq_iter;
     int len = 0;
+    PostcopyState ps = postcopy_state_get();
+    /*
+     * If system is running in postcopy mode, page inserts to host memory must
+     * be atomic
+     */
+    bool postcopy_running = ps >= POSTCOPY_INCOMING_LISTENING &&
+                            ps < POSTCOPY_INCOMING_END;
 
     seq_iter++;
 
@@ -1559,7 +3164,12 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      * critical section.
      */
     rcu_read_lock();
-    while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
+
+    if (postcopy_running) {
+        ret = ram_load_postcopy(f);
+    }
+
+    while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
         void *host;
         uint8_t ch;
@@ -1577,10 +3187,19 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 char id[256];
                 ram_addr_t length;
 
+                uint64_t file_offset = 0;
+                bool ignored = false;
+
                 len = qemu_get_byte(f);
                 qemu_get_buffer(f, (uint8_t *)id, len);
                 id[len] = 0;
                 length = qemu_get_be64(f);
+                if (migration_incoming_get_current()->mapped_ram) {
+                    file_offset = qemu_get_be64(f);
+                }
+                if (migrate_ignore_shared()) {
+                    ignored = qemu_get_byte(f);
+                }
 
                 QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
                     if (!strncmp(id, block->idstr, sizeof(id))) {
@@ -1602,6 +3221,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                     error_report("Unknown ramblock \"%s\", cannot "
                                  "accept migration", id);
                     ret = -EINVAL;
+                } else if (ignored && !qemu_ram_is_shared(block)) {
+                    error_report("RAM block \"%s\" isn't transferred but "
+                                 "isn't mapped shared here either", id);
+                    ret = -EINVAL;
+                } else if (!ret &&
+                           migration_incoming_get_current()->mapped_ram) {
+                    ret = mapped_ram_load_block(f, block, file_offset);
                 }
 
                 total_ram_bytes -= length;
@@ -1614,8 +3240,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 break;
             }
+            load_order_check(host);
             ch = qemu_get_byte(f);
-            ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            load_zero_page(load_block, host, ch);
             break;
         case RAM_SAVE_FLAG_PAGE:
             host = host_from_stream_offset(f, addr, flags);
@@ -1624,7 +3251,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 break;
             }
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            load_order_check(host);
+            if (decomp_param) {
+                load_data_with_multi_threads(f, host, TARGET_PAGE_SIZE,
+                                             false);
+            } else {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
             break;
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             host = host_from_stream_offset(f, addr, flags);
@@ -1635,13 +3268,13 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 || len > migrate_compress_bound(TARGET_PAGE_SIZE)) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
             }
-            qemu_get_buffer(f, compressed_data_buf, len);
-            decompress_data_with_multi_threads(compressed_data_buf, host, len);
+            load_order_check(host);
+            load_data_with_multi_threads(f, host, len, true);
             break;
         case RAM_SAVE_FLAG_XBZRLE:
             host = host_from_stream_offset(f, addr, flags);
@@ -1650,6 +3283,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 break;
             }
+            load_order_check(host);
             if (load_xbzrle(f, addr, host) < 0) {
                 error_report("Failed to decompress XBZRLE page at "
                              RAM_ADDR_FMT, addr);
@@ -1657,6 +3291,11 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            /* The channels may overwrite what we've queued once released */
+            wait_for_decompress_done();
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -1674,6 +3313,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    wait_for_decompress_done();
     rcu_read_unlock();
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
@@ -1684,6 +3324,7 @@ static SaveVMHandlers savevm_ram_handlers = {
     .save_live_setup = ram_save_setup,
     .save_live_iterate = ram_save_iterate,
     .save_live_complete = ram_save_complete,
+    .save_live_complete_postcopy = ram_save_complete,
     .save_live_pending = ram_save_pending,
     .load_state = ram_load,
     .cancel = ram_migration_cancel,
@@ -1692,5 +3333,8 @@ static SaveVMHandlers savevm_ram_handlers = {
 void ram_mig_init(void)
 {
     qemu_mutex_init(&XBZRLE.lock);
+    qemu_mutex_init(&src_page_req_mutex);
+    qemu_mutex_init(&free_page_hint_lock);
+    free_page_hints = g_array_new(false, false, sizeof(FreePageHint));
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
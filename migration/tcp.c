@@ -20,6 +20,7 @@
 #include "qemu/sockets.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
+#include "migration/multifd.h"
 #include "block/block.h"
 #include "qemu/main-loop.h"
 
@@ -50,6 +51,9 @@ static void tcp_wait_for_connect(int fd, Error *err, void *opaque)
 
 void tcp_start_outgoing_migration(MigrationState *s, const char *host_port, Error **errp)
 {
+    if (migrate_use_multifd()) {
+        multifd_set_outgoing_address(host_port);
+    }
     inet_nonblocking_connect(host_port, tcp_wait_for_connect, s, errp);
 }
 
@@ -66,16 +70,23 @@ static void tcp_accept_incoming_migration(void *opaque)
         err = socket_error();
     } while (c < 0 && err == EINTR);
     qemu_set_fd_handler(s, NULL, NULL, NULL);
-    closesocket(s);
 
     DPRINTF("accepted migration\n");
 
     if (c < 0) {
+        closesocket(s);
         error_report("could not accept migration connection (%s)",
                      strerror(err));
         return;
     }
 
+    if (migrate_use_multifd()) {
+        /* The multifd channels connect to the same port */
+        multifd_load_setup(s);
+    } else {
+        closesocket(s);
+    }
+
     f = qemu_fopen_socket(c, "rb");
     if (f == NULL) {
         error_report("could not qemu_fopen socket");
@@ -3,6 +3,7 @@
 #include "migration/qemu-file.h"
 #include "migration/vmstate.h"
 #include "qemu/bitops.h"
+#include "qemu/bswap.h"
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "qjson.h"
@@ -70,11 +71,294 @@ static void *vmstate_base_addr(void *opaque, VMStateField *field, bool alloc)
     return base_addr;
 }
 
+/*
+ * Every VMStateDescription is compiled on first use into a plan: a list of
+ * steps that each cover one field, or a run of consecutive fields that are
+ * plain integers of the same size laid out back to back in the device
+ * state.  The elements of such a step go through the QEMUFile as one
+ * buffer, byte swapped in bulk, rather than with a VMStateInfo call per
+ * element.  The wire format doesn't change.
+ */
+typedef struct VMStatePlanStep {
+    VMStateField *field;
+    int nr_fields;
+    /* size of the elements if they are plain integers, 0 otherwise */
+    int elem_size;
+    /* newest version_id of the fields */
+    int version_id;
+    /* bytes covered by a run of more than one field */
+    size_t run_size;
+} VMStatePlanStep;
+
+typedef struct VMStatePlan {
+    int nr_steps;
+    VMStatePlanStep steps[];
+} VMStatePlan;
+
+/* Bytes swapped on the stack at a time */
+#define VMSTATE_BULK_CHUNK 512
+
+/* Only ever looked up and filled with the iothread lock held */
+static GHashTable *vmstate_plans;
+
+/* Wire size of a VMStateInfo that is a big endian copy of the field */
+static int vmstate_plain_size(VMStateField *field)
+{
+    const VMStateInfo *info = field->info;
+    int size = 0;
+
+    if (field->flags & (VMS_STRUCT | VMS_ARRAY_OF_POINTER | VMS_VBUFFER |
+                        VMS_BUFFER)) {
+        return 0;
+    }
+    if (info == &vmstate_info_uint8 || info == &vmstate_info_int8) {
+        size = 1;
+    } else if (info == &vmstate_info_uint16 || info == &vmstate_info_int16) {
+        size = 2;
+    } else if (info == &vmstate_info_uint32 || info == &vmstate_info_int32) {
+        size = 4;
+    } else if (info == &vmstate_info_uint64 || info == &vmstate_info_int64 ||
+               info == &vmstate_info_float64) {
+        size = 8;
+    }
+    return field->size == size ? size : 0;
+}
+
+/* Whether the field always sits at the same place with the same length */
+static bool vmstate_field_is_fixed(VMStateField *field)
+{
+    return !field->field_exists &&
+           !(field->flags & (VMS_POINTER | VMS_ALLOC | VMS_VARRAY_INT32 |
+                             VMS_VARRAY_UINT32 | VMS_VARRAY_UINT16 |
+                             VMS_VARRAY_UINT8));
+}
+
+static size_t vmstate_field_fixed_size(VMStateField *field)
+{
+    return (field->flags & VMS_ARRAY ? field->num : 1) * field->size;
+}
+
+static VMStatePlan *vmstate_plan_compile(const VMStateDescription *vmsd)
+{
+    VMStateField *field;
+    VMStatePlanStep *step = NULL;
+    VMStatePlan *plan;
+    int nr_fields = 0;
+
+    for (field = vmsd->fields; field->name; field++) {
+        nr_fields++;
+    }
+    plan = g_malloc0(sizeof(*plan) + nr_fields * sizeof(VMStatePlanStep));
+
+    for (field = vmsd->fields; field->name; field++) {
+        int elem_size = vmstate_plain_size(field);
+
+        if (step && elem_size && step->elem_size == elem_size &&
+            vmstate_field_is_fixed(step->field) &&
+            vmstate_field_is_fixed(field) &&
+            field->offset == step->field->offset + step->run_size) {
+            step->nr_fields++;
+            step->version_id = MAX(step->version_id, field->version_id);
+            step->run_size += vmstate_field_fixed_size(field);
+            continue;
+        }
+
+        step = &plan->steps[plan->nr_steps++];
+        step->field = field;
+        step->nr_fields = 1;
+        step->elem_size = elem_size;
+        step->version_id = field->version_id;
+        step->run_size = vmstate_field_is_fixed(field) ?
+                         vmstate_field_fixed_size(field) : 0;
+    }
+
+    trace_vmstate_plan_compile(vmsd->name, nr_fields, plan->nr_steps);
+    return plan;
+}
+
+static VMStatePlan *vmstate_get_plan(const VMStateDescription *vmsd)
+{
+    VMStatePlan *plan;
+
+    if (!vmstate_plans) {
+        vmstate_plans = g_hash_table_new(NULL, NULL);
+    }
+    plan = g_hash_table_lookup(vmstate_plans, vmsd);
+    if (!plan) {
+        plan = vmstate_plan_compile(vmsd);
+        g_hash_table_insert(vmstate_plans, (gpointer)vmsd, plan);
+    }
+    return plan;
+}
+
+/*
+ * Elements of a step: a run is fixed, a single field may be a varray.  A
+ * negative count read from the device state means no elements, as it
+ * does on the per-field path.
+ */
+static size_t vmstate_step_n_elems(void *opaque, VMStatePlanStep *step)
+{
+    if (step->nr_fields > 1) {
+        return step->run_size / step->elem_size;
+    }
+    return MAX(vmstate_n_elems(opaque, step->field), 0);
+}
+
+static void vmstate_put_plain(QEMUFile *f, const uint8_t *buf, int elem_size,
+                              size_t n_elems)
+{
+    uint64_t tmp[VMSTATE_BULK_CHUNK / sizeof(uint64_t)];
+    size_t len = n_elems * elem_size, chunk, i;
+
+    if (elem_size == 1) {
+        qemu_put_buffer(f, buf, len);
+        return;
+    }
+    while (len) {
+        chunk = MIN(len, sizeof(tmp));
+        memcpy(tmp, buf, chunk);
+        for (i = 0; i < chunk / elem_size; i++) {
+            switch (elem_size) {
+            case 2:
+                cpu_to_be16s((uint16_t *)tmp + i);
+                break;
+            case 4:
+                cpu_to_be32s((uint32_t *)tmp + i);
+                break;
+            default:
+                cpu_to_be64s(tmp + i);
+                break;
+            }
+        }
+        qemu_put_buffer(f, (uint8_t *)tmp, chunk);
+        buf += chunk;
+        len -= chunk;
+    }
+}
+
+static void vmstate_get_plain(QEMUFile *f, uint8_t *buf, int elem_size,
+                              size_t n_elems)
+{
+    uint64_t tmp[VMSTATE_BULK_CHUNK / sizeof(uint64_t)];
+    size_t len = n_elems * elem_size, chunk, i;
+
+    if (elem_size == 1) {
+        qemu_get_buffer(f, buf, len);
+        return;
+    }
+    while (len) {
+        chunk = MIN(len, sizeof(tmp));
+        if (qemu_get_buffer(f, (uint8_t *)tmp, chunk) != chunk) {
+            return;
+        }
+        for (i = 0; i < chunk / elem_size; i++) {
+            switch (elem_size) {
+            case 2:
+                be16_to_cpus((uint16_t *)tmp + i);
+                break;
+            case 4:
+                be32_to_cpus((uint32_t *)tmp + i);
+                break;
+            default:
+                be64_to_cpus(tmp + i);
+                break;
+            }
+        }
+        memcpy(buf, tmp, chunk);
+        buf += chunk;
+        len -= chunk;
+    }
+}
+
+static int vmstate_load_field(QEMUFile *f, const VMStateDescription *vmsd,
+                              void *opaque, VMStateField *field,
+                              int version_id)
+{
+    int ret = 0;
+
+    trace_vmstate_load_state_field(vmsd->name, field->name);
+    if ((field->field_exists &&
+         field->field_exists(opaque, version_id)) ||
+        (!field->field_exists &&
+         field->version_id <= version_id)) {
+        void *base_addr = vmstate_base_addr(opaque, field, true);
+        int i, n_elems = vmstate_n_elems(opaque, field);
+        int size = vmstate_size(opaque, field);
+
+        for (i = 0; i < n_elems; i++) {
+            void *addr = base_addr + size * i;
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                addr = *(void **)addr;
+            }
+            if (field->flags & VMS_STRUCT) {
+                ret = vmstate_load_state(f, field->vmsd, addr,
+                                         field->vmsd->version_id);
+            } else {
+                ret = field->info->get(f, addr, size);
+
+            }
+            if (ret >= 0) {
+                ret = qemu_file_get_error(f);
+            }
+            if (ret < 0) {
+                qemu_file_set_error(f, ret);
+                trace_vmstate_load_field_error(field->name, ret);
+                return ret;
+            }
+        }
+    } else if (field->flags & VMS_MUST_EXIST) {
+        error_report("Input validation failed: %s/%s",
+                     vmsd->name, field->name);
+        return -1;
+    }
+    return 0;
+}
+
+static int vmstate_load_step(QEMUFile *f, const VMStateDescription *vmsd,
+                             void *opaque, VMStatePlanStep *step,
+                             int version_id)
+{
+    VMStateField *field = step->field;
+    bool exists;
+    void *base_addr;
+    int i, ret;
+
+    if (field->field_exists) {
+        exists = field->field_exists(opaque, version_id);
+    } else {
+        exists = step->version_id <= version_id;
+    }
+    if (!step->elem_size || !exists) {
+        /* not plain, or some of the fields are too new for the stream */
+        for (i = 0; i < step->nr_fields; i++) {
+            ret = vmstate_load_field(f, vmsd, opaque, field + i, version_id);
+            if (ret) {
+                return ret;
+            }
+        }
+        return 0;
+    }
+
+    for (i = 0; i < step->nr_fields; i++) {
+        trace_vmstate_load_state_field(vmsd->name, field[i].name);
+    }
+    base_addr = vmstate_base_addr(opaque, field, true);
+    vmstate_get_plain(f, base_addr, step->elem_size,
+                      vmstate_step_n_elems(opaque, step));
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        trace_vmstate_load_field_error(field->name, ret);
+        return ret;
+    }
+    return 0;
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
-    VMStateField *field = vmsd->fields;
-    int ret = 0;
+    VMStatePlan *plan = vmstate_get_plan(vmsd);
+    int i, ret = 0;
 
     trace_vmstate_load_state(vmsd->name, version_id);
     if (version_id > vmsd->version_id) {
@@ -97,44 +381,11 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
             return ret;
         }
     }
-    while (field->name) {
-        trace_vmstate_load_state_field(vmsd->name, field->name);
-        if ((field->field_exists &&
-             field->field_exists(opaque, version_id)) ||
-            (!field->field_exists &&
-             field->version_id <= version_id)) {
-            void *base_addr = vmstate_base_addr(opaque, field, true);
-            int i, n_elems = vmstate_n_elems(opaque, field);
-            int size = vmstate_size(opaque, field);
-
-            for (i = 0; i < n_elems; i++) {
-                void *addr = base_addr + size * i;
-
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    addr = *(void **)addr;
-                }
-                if (field->flags & VMS_STRUCT) {
-                    ret = vmstate_load_state(f, field->vmsd, addr,
-                                             field->vmsd->version_id);
-                } else {
-                    ret = field->info->get(f, addr, size);
-
-                }
-                if (ret >= 0) {
-                    ret = qemu_file_get_error(f);
-                }
-                if (ret < 0) {
-                    qemu_file_set_error(f, ret);
-                    trace_vmstate_load_field_error(field->name, ret);
-                    return ret;
-                }
-            }
-        } else if (field->flags & VMS_MUST_EXIST) {
-            error_report("Input validation failed: %s/%s",
-                         vmsd->name, field->name);
-            return -1;
+    for (i = 0; i < plan->nr_steps; i++) {
+        ret = vmstate_load_step(f, vmsd, opaque, &plan->steps[i], version_id);
+        if (ret) {
+            return ret;
         }
-        field++;
     }
     ret = vmstate_subsection_load(f, vmsd, opaque);
     if (ret != 0) {
@@ -287,10 +538,83 @@ bool vmstate_save_needed(const VMStateDescription *vmsd, void *opaque)
 }
 
 
+static void vmstate_save_field(QEMUFile *f, const VMStateDescription *vmsd,
+                               void *opaque, VMStateField *field,
+                               QJSON *vmdesc)
+{
+    if (!field->field_exists ||
+        field->field_exists(opaque, vmsd->version_id)) {
+        void *base_addr = vmstate_base_addr(opaque, field, false);
+        int i, n_elems = vmstate_n_elems(opaque, field);
+        int size = vmstate_size(opaque, field);
+        int64_t old_offset, written_bytes;
+        QJSON *vmdesc_loop = vmdesc;
+
+        for (i = 0; i < n_elems; i++) {
+            void *addr = base_addr + size * i;
+
+            vmsd_desc_field_start(vmsd, vmdesc_loop, field, i, n_elems);
+            old_offset = qemu_ftell_fast(f);
+
+            if (field->flags & VMS_ARRAY_OF_POINTER) {
+                addr = *(void **)addr;
+            }
+            if (field->flags & VMS_STRUCT) {
+                vmstate_save_state(f, field->vmsd, addr, vmdesc_loop);
+            } else {
+                field->info->put(f, addr, size);
+            }
+
+            written_bytes = qemu_ftell_fast(f) - old_offset;
+            vmsd_desc_field_end(vmsd, vmdesc_loop, field, written_bytes, i);
+
+            /* Compressed arrays only care about the first element */
+            if (vmdesc_loop && vmsd_can_compress(field)) {
+                vmdesc_loop = NULL;
+            }
+        }
+    } else {
+        if (field->flags & VMS_MUST_EXIST) {
+            error_report("Output state validation failed: %s/%s",
+                    vmsd->name, field->name);
+            assert(!(field->flags & VMS_MUST_EXIST));
+        }
+    }
+}
+
+static void vmstate_save_step(QEMUFile *f, const VMStateDescription *vmsd,
+                              void *opaque, VMStatePlanStep *step,
+                              QJSON *vmdesc)
+{
+    VMStateField *field = step->field;
+    int i;
+
+    if (!step->elem_size ||
+        (field->field_exists &&
+         !field->field_exists(opaque, vmsd->version_id))) {
+        vmstate_save_field(f, vmsd, opaque, field, vmdesc);
+        return;
+    }
+
+    vmstate_put_plain(f, vmstate_base_addr(opaque, field, false),
+                      step->elem_size, vmstate_step_n_elems(opaque, step));
+
+    /* Plain fields are compressed, only their first element is described */
+    for (i = 0; vmdesc && i < step->nr_fields; i++) {
+        int n_elems = vmstate_n_elems(opaque, field + i);
+
+        if (n_elems) {
+            vmsd_desc_field_start(vmsd, vmdesc, field + i, 0, n_elems);
+            vmsd_desc_field_end(vmsd, vmdesc, field + i, step->elem_size, 0);
+        }
+    }
+}
+
 void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
                         void *opaque, QJSON *vmdesc)
 {
-    VMStateField *field = vmsd->fields;
+    VMStatePlan *plan = vmstate_get_plan(vmsd);
+    int i;
 
     if (vmsd->pre_save) {
         vmsd->pre_save(opaque);
@@ -302,46 +626,8 @@ void vmstate_save_state(QEMUFile *f, const VMStateDescription *vmsd,
         json_start_array(vmdesc, "fields");
     }
 
-    while (field->name) {
-        if (!field->field_exists ||
-            field->field_exists(opaque, vmsd->version_id)) {
-            void *base_addr = vmstate_base_addr(opaque, field, false);
-            int i, n_elems = vmstate_n_elems(opaque, field);
-            int size = vmstate_size(opaque, field);
-            int64_t old_offset, written_bytes;
-            QJSON *vmdesc_loop = vmdesc;
-
-            for (i = 0; i < n_elems; i++) {
-                void *addr = base_addr + size * i;
-
-                vmsd_desc_field_start(vmsd, vmdesc_loop, field, i, n_elems);
-                old_offset = qemu_ftell_fast(f);
-
-                if (field->flags & VMS_ARRAY_OF_POINTER) {
-                    addr = *(void **)addr;
-                }
-                if (field->flags & VMS_STRUCT) {
-                    vmstate_save_state(f, field->vmsd, addr, vmdesc_loop);
-                } else {
-                    field->info->put(f, addr, size);
-                }
-
-                written_bytes = qemu_ftell_fast(f) - old_offset;
-                vmsd_desc_field_end(vmsd, vmdesc_loop, field, written_bytes, i);
-
-                /* Compressed arrays only care about the first element */
-                if (vmdesc_loop && vmsd_can_compress(field)) {
-                    vmdesc_loop = NULL;
-                }
-            }
-        } else {
-            if (field->flags & VMS_MUST_EXIST) {
-                error_report("Output state validation failed: %s/%s",
-                        vmsd->name, field->name);
-                assert(!(field->flags & VMS_MUST_EXIST));
-            }
-        }
-        field++;
+    for (i = 0; i < plan->nr_steps; i++) {
+        vmstate_save_step(f, vmsd, opaque, &plan->steps[i], vmdesc);
     }
 
     if (vmdesc) {
@@ -0,0 +1,17 @@
+/*
+ * Xor Based Zero Run Length Encoding, internals for tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_XBZRLE_INTERNAL_H
+#define QEMU_XBZRLE_INTERNAL_H 1
+
+#include "qemu-common.h"
+
+/* Use the vectorised run finding if available (default), or the plain C one */
+void xbzrle_set_accel(bool enable);
+
+#endif
@@ -12,6 +12,8 @@
  */
 #include "qemu-common.h"
 #include "include/migration/migration.h"
+#include "migration/xbzrle-internal.h"
+#include "qemu/host-utils.h"
 
 /*
   page = zrun nzrun
@@ -23,12 +25,283 @@
 
   length = uleb128 encoded integer
  */
+
+/*
+ * Run finding: return the index of the first byte at or after @i that
+ * ends the zero run (old and new differ) or the non-zero run (old and new
+ * are equal) starting at @i, or @slen if the run reaches the end of the
+ * buffer.  Runs are always maximal, so all the variants produce the same
+ * encoding.
+ */
+typedef int (*XbzrleRunFn)(const uint8_t *old_buf, const uint8_t *new_buf,
+                           int i, int slen);
+
+static int find_zrun_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    while (i < slen && (i % sizeof(long)) && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+
+    /* word at a time for speed */
+    if (!(i % sizeof(long))) {
+        while (i < slen &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
+        }
+    }
+
+    /* go over the rest */
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int find_nzrun_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    while (i < slen && (i % sizeof(long)) && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!(i % sizeof(long))) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < slen) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                break;
+            }
+            i += sizeof(long);
+        }
+    }
+
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* SSE2 is part of the x86-64 baseline, so this needs no runtime check */
+static int find_zrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+
+        if (eq != 0xffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int find_nzrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#include <immintrin.h>
+
+static int __attribute__((target("avx2")))
+find_zrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                   int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (eq != 0xffffffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int __attribute__((target("avx2")))
+find_nzrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                    int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+#endif
+
+#ifdef CONFIG_AVX512BW_OPT
+#include <immintrin.h>
+
+static int __attribute__((target("avx512bw")))
+find_zrun_end_avx512bw(const uint8_t *old_buf, const uint8_t *new_buf,
+                       int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(o, n);
+
+        if (eq != UINT64_MAX) {
+            return i + ctz64(~eq);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int __attribute__((target("avx512bw")))
+find_nzrun_end_avx512bw(const uint8_t *old_buf, const uint8_t *new_buf,
+                        int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(o, n);
+
+        if (eq) {
+            return i + ctz64(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+
+/*
+ * NEON has no movemask; check whole vectors with a horizontal min/max and
+ * finish the vector holding the end of the run a byte at a time.
+ */
+static int find_zrun_end_neon(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(old_buf + i), vld1q_u8(new_buf + i));
+
+        if (vminvq_u8(eq) != 0xff) {
+            break;
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int find_nzrun_end_neon(const uint8_t *old_buf, const uint8_t *new_buf,
+                               int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(old_buf + i), vld1q_u8(new_buf + i));
+
+        if (vmaxvq_u8(eq)) {
+            break;
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+#endif
+
+#if defined(__SSE2__)
+static XbzrleRunFn find_zrun_end = find_zrun_end_sse2;
+static XbzrleRunFn find_nzrun_end = find_nzrun_end_sse2;
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static XbzrleRunFn find_zrun_end = find_zrun_end_neon;
+static XbzrleRunFn find_nzrun_end = find_nzrun_end_neon;
+#else
+static XbzrleRunFn find_zrun_end = find_zrun_end_long;
+static XbzrleRunFn find_nzrun_end = find_nzrun_end_long;
+#endif
+
+#if defined(CONFIG_AVX2_OPT) || defined(CONFIG_AVX512BW_OPT)
+static void __attribute__((constructor)) init_xbzrle_accel(void)
+{
+    __builtin_cpu_init();
+#ifdef CONFIG_AVX512BW_OPT
+    if (__builtin_cpu_supports("avx512bw")) {
+        find_zrun_end = find_zrun_end_avx512bw;
+        find_nzrun_end = find_nzrun_end_avx512bw;
+        return;
+    }
+#endif
+#ifdef CONFIG_AVX2_OPT
+    if (__builtin_cpu_supports("avx2")) {
+        find_zrun_end = find_zrun_end_avx2;
+        find_nzrun_end = find_nzrun_end_avx2;
+    }
+#endif
+}
+#endif
+
+void xbzrle_set_accel(bool enable)
+{
+    static XbzrleRunFn accel_zrun, accel_nzrun;
+
+    if (!accel_zrun) {
+        accel_zrun = find_zrun_end;
+        accel_nzrun = find_nzrun_end;
+    }
+    find_zrun_end = enable ? accel_zrun : find_zrun_end_long;
+    find_nzrun_end = enable ? accel_nzrun : find_nzrun_end_long;
+}
+
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, end;
     uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
@@ -40,28 +313,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        end = find_zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = end - i;
+        i = end;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,42 +329,16 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        end = find_nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = end - i;
+        i = end;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -119,7 +347,6 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
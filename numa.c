@@ -38,6 +38,11 @@
 #include "qemu/option.h"
 #include "qemu/config-file.h"
 
+#ifdef CONFIG_NUMA
+#include <numa.h>
+#include <numaif.h>
+#endif
+
 QemuOptsList qemu_numa_opts = {
     .name = "numa",
     .implied_opt_name = "type",
@@ -436,6 +441,58 @@ static void allocate_system_memory_nonnuma(MemoryRegion *mr, Object *owner,
     vmstate_register_ram_global(mr);
 }
 
+/*
+ * Ask the host to place @seg, the RAM of guest node @node, on one of its
+ * own nodes.  This is only a preference, so that RAM which doesn't fit
+ * there still goes elsewhere.
+ */
+static void numa_set_host_node(MemoryRegion *seg, int node)
+{
+#ifdef CONFIG_NUMA
+    unsigned long host_nodes[BITS_TO_LONGS(MAX_NODES + 1)] = { 0 };
+    int host_node;
+
+    if (numa_available() < 0) {
+        return;
+    }
+    host_node = node % (numa_max_node() + 1);
+    set_bit(host_node, host_nodes);
+    /* As in host_memory_backend_memory_complete(), maxnode is one more */
+    if (mbind(memory_region_get_ram_ptr(seg), memory_region_size(seg),
+              MPOL_PREFERRED, host_nodes, host_node + 2, MPOL_MF_MOVE)) {
+        error_report("warning: cannot place the RAM of NUMA node %d on "
+                     "host node %d: %s", node, host_node, strerror(errno));
+    }
+#endif
+}
+
+/* One RAM block per node, for -numa node,mem= with numa-split-ram=on */
+static void allocate_system_memory_split(MemoryRegion *mr, Object *owner,
+                                         const char *name,
+                                         uint64_t ram_size)
+{
+    uint64_t addr = 0;
+    int i;
+
+    memory_region_init(mr, owner, name, ram_size);
+    for (i = 0; i < nb_numa_nodes; i++) {
+        uint64_t size = numa_info[i].node_mem;
+        MemoryRegion *seg;
+        char *seg_name;
+
+        if (!size) {
+            continue;
+        }
+        seg = g_new(MemoryRegion, 1);
+        seg_name = g_strdup_printf("%s.node%d", name, i);
+        allocate_system_memory_nonnuma(seg, owner, seg_name, size);
+        g_free(seg_name);
+        numa_set_host_node(seg, i);
+        memory_region_add_subregion(mr, addr, seg);
+        addr += size;
+    }
+}
+
 void memory_region_allocate_system_memory(MemoryRegion *mr, Object *owner,
                                           const char *name,
                                           uint64_t ram_size)
@@ -444,7 +501,11 @@ void memory_region_allocate_system_memory(MemoryRegion *mr, Object *owner,
     int i;
 
     if (nb_numa_nodes == 0 || !have_memdevs) {
-        allocate_system_memory_nonnuma(mr, owner, name, ram_size);
+        if (nb_numa_nodes && machine_numa_split_ram(current_machine)) {
+            allocate_system_memory_split(mr, owner, name, ram_size);
+        } else {
+            allocate_system_memory_nonnuma(mr, owner, name, ram_size);
+        }
         return;
     }
 
@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is an N-way set associative cache indexed by a hash of the
+ * page address, with LRU replacement within each set
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -32,28 +33,50 @@
     do { } while (0)
 #endif
 
-/* the page in cache will not be replaced in two cycles */
-#define CACHED_PAGE_LIFETIME 2
+/* Number of pages in each set */
+#define CACHE_WAYS 8
 
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    /* Value of the cache clock at the last use, for LRU */
+    uint64_t it_lru;
+    /* Fixed slot in the cache arena */
     uint8_t *it_data;
 };
 
+typedef struct CacheSet {
+    /*
+     * Addresses that recently missed in this set without being admitted;
+     * once the set is full, a page only evicts another one the second
+     * time it's inserted, so pages that are dirtied once don't push out
+     * the ones that keep changing.
+     */
+    uint64_t ghost_addr[CACHE_WAYS];
+    unsigned int ghost_next;
+    PageCacheStats stats;
+} CacheSet;
+
 struct PageCache {
+    /* num_sets * ways items, the ways of a set are next to each other */
     CacheItem *page_cache;
+    CacheSet *sets;
+    /* All the page data, in one allocation */
+    uint8_t *arena;
+    size_t arena_size;
     unsigned int page_size;
+    unsigned int ways;
+    int64_t num_sets;
     int64_t max_num_items;
-    uint64_t max_item_age;
     int64_t num_items;
+    uint64_t lru_clock;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
 {
-    int64_t i;
+    int64_t i, j;
 
     PageCache *cache;
 
@@ -63,7 +86,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     }
 
     /* We prefer not to abort if there is no memory */
-    cache = g_try_malloc(sizeof(*cache));
+    cache = g_try_malloc0(sizeof(*cache));
     if (!cache) {
         DPRINTF("Failed to allocate cache\n");
         return NULL;
@@ -74,115 +97,185 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         DPRINTF("rounding down to %" PRId64 "\n", num_pages);
     }
     cache->page_size = page_size;
-    cache->num_items = 0;
-    cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache sets to %" PRId64 " of %u pages\n",
+            cache->num_sets, cache->ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
                                      sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
+    cache->sets = g_try_malloc0(cache->num_sets * sizeof(*cache->sets));
+    /*
+     * The arena is allocated like guest RAM so that it's aligned for and
+     * can be backed by transparent hugepages; the cache is walked randomly
+     * and would otherwise take a TLB miss on most lookups.
+     */
+    cache->arena_size = cache->max_num_items * page_size;
+    cache->arena = qemu_anon_ram_alloc(cache->arena_size, NULL);
+    if (!cache->page_cache || !cache->sets || !cache->arena) {
         DPRINTF("Failed to allocate cache->page_cache\n");
+        g_free(cache->page_cache);
+        g_free(cache->sets);
+        if (cache->arena) {
+            qemu_anon_ram_free(cache->arena, cache->arena_size);
+        }
         g_free(cache);
         return NULL;
     }
+    qemu_madvise(cache->arena, cache->arena_size, QEMU_MADV_HUGEPAGE);
 
     for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
+        cache->page_cache[i].it_data = cache->arena + i * page_size;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_lru = 0;
         cache->page_cache[i].it_addr = -1;
     }
+    for (i = 0; i < cache->num_sets; i++) {
+        for (j = 0; j < CACHE_WAYS; j++) {
+            cache->sets[i].ghost_addr[j] = -1;
+        }
+    }
 
     return cache;
 }
 
 void cache_fini(PageCache *cache)
 {
-    int64_t i;
-
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
-    }
-
+    qemu_anon_ram_free(cache->arena, cache->arena_size);
+    g_free(cache->sets);
     g_free(cache->page_cache);
     cache->page_cache = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static size_t cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    g_assert(cache->num_sets);
+    return (address / cache->page_size) & (cache->num_sets - 1);
+}
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+/* Returns the first item of the set @address maps to */
+static CacheItem *cache_get_set_items(const PageCache *cache,
+                                      uint64_t address)
+{
+    return &cache->page_cache[cache_get_set(cache, address) * cache->ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *it;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
+    it = cache_get_set_items(cache, addr);
+    for (i = 0; i < cache->ways; i++) {
+        if (it[i].it_addr == addr) {
+            return &it[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns a free item of the set, or else its least recently used one */
+static CacheItem *cache_get_victim(const PageCache *cache, CacheItem *set)
+{
+    CacheItem *victim = &set[0];
+    unsigned int i;
+
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == -1) {
+            return &set[i];
+        }
+        if (set[i].it_lru < victim->it_lru) {
+            victim = &set[i];
+        }
+    }
+
+    return victim;
+}
+
+/*
+ * Returns true if @addr missed before and may evict a page of the full
+ * set now; otherwise remembers it for next time.
+ */
+static bool cache_admit(CacheSet *set, uint64_t addr)
+{
+    unsigned int i;
+
+    for (i = 0; i < CACHE_WAYS; i++) {
+        if (set->ghost_addr[i] == addr) {
+            set->ghost_addr[i] = -1;
+            return true;
+        }
+    }
+    set->ghost_addr[set->ghost_next] = addr;
+    set->ghost_next = (set->ghost_next + 1) % CACHE_WAYS;
 
-    return &cache->page_cache[pos];
+    return false;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
+bool cache_is_cached(PageCache *cache, uint64_t addr,
                      uint64_t current_age)
 {
+    CacheSet *set = &cache->sets[cache_get_set(cache, addr)];
     CacheItem *it;
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        it->it_lru = ++cache->lru_clock;
+        set->stats.hits++;
         return true;
     }
+    set->stats.misses++;
     return false;
 }
 
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
-
+    CacheSet *set = &cache->sets[cache_get_set(cache, addr)];
     CacheItem *it;
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
-    }
-    /* allocate page */
-    if (!it->it_data) {
-        it->it_data = g_try_malloc(cache->page_size);
-        if (!it->it_data) {
-            DPRINTF("Error allocating page\n");
+    if (!it) {
+        it = cache_get_victim(cache, cache_get_set_items(cache, addr));
+        if (it->it_addr == -1) {
+            cache->num_items++;
+            set->stats.items++;
+        } else if (!cache_admit(set, addr)) {
+            /* first time we see this page, don't replace anything for it */
+            set->stats.rejected++;
             return -1;
+        } else {
+            set->stats.evictions++;
         }
-        cache->num_items++;
     }
 
     memcpy(it->it_data, pdata, cache->page_size);
 
     it->it_age = current_age;
+    it->it_lru = ++cache->lru_clock;
     it->it_addr = addr;
 
     return 0;
@@ -217,29 +310,59 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+            /* if the set is full, keep the MRU pages */
+            new_it = cache_get_victim(new_cache,
+                                      cache_get_set_items(new_cache,
+                                                          old_it->it_addr));
+            if (new_it->it_addr == -1) {
+                new_cache->num_items++;
+                new_cache->sets[cache_get_set(new_cache,
+                                              old_it->it_addr)].stats.items++;
+            } else if (new_it->it_lru >= old_it->it_lru) {
+                continue;
             }
+            memcpy(new_it->it_data, old_it->it_data, cache->page_size);
+            new_it->it_age = old_it->it_age;
+            new_it->it_lru = old_it->it_lru;
+            new_it->it_addr = old_it->it_addr;
         }
     }
+    new_cache->lru_clock = cache->lru_clock;
 
+    qemu_anon_ram_free(cache->arena, cache->arena_size);
+    g_free(cache->sets);
     g_free(cache->page_cache);
-    cache->page_cache = new_cache->page_cache;
-    cache->max_num_items = new_cache->max_num_items;
-    cache->num_items = new_cache->num_items;
+    *cache = *new_cache;
 
     g_free(new_cache);
 
     return cache->max_num_items;
 }
+
+int64_t cache_get_num_sets(const PageCache *cache)
+{
+    return cache->num_sets;
+}
+
+void cache_get_set_stats(const PageCache *cache, int64_t set,
+                         PageCacheStats *stats)
+{
+    g_assert(set >= 0 && set < cache->num_sets);
+    *stats = cache->sets[set].stats;
+}
+
+void cache_get_stats(const PageCache *cache, PageCacheStats *stats)
+{
+    int64_t i;
+
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < cache->num_sets; i++) {
+        const PageCacheStats *s = &cache->sets[i].stats;
+
+        stats->hits += s->hits;
+        stats->misses += s->misses;
+        stats->evictions += s->evictions;
+        stats->rejected += s->rejected;
+        stats->items += s->items;
+    }
+}
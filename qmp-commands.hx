@@ -737,6 +737,25 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch an in-progress migration to postcopy mode. Ignored after the end of
+migration (or once already in postcopy).
+
+Example:
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -821,8 +840,8 @@ EQMP
 
     {
         .name       = "dump-guest-memory",
-        .args_type  = "paging:b,protocol:s,begin:i?,end:i?,format:s?",
-        .params     = "-p protocol [begin] [length] [format]",
+        .args_type  = "paging:b,protocol:s,detach:b?,begin:i?,end:i?,format:s?",
+        .params     = "-p protocol [-d] [begin] [length] [format]",
         .help       = "dump guest memory to file",
         .mhandler.cmd_new = qmp_marshal_dump_guest_memory,
     },
@@ -838,6 +857,9 @@ Arguments:
 - "paging": do paging to get guest's memory mapping (json-bool)
 - "protocol": destination file(started with "file:") or destination file
               descriptor (started with "fd:") (json-string)
+- "detach": if specified, command will return immediately, without waiting
+            for the dump to finish. The user can track progress using
+            "query-dump" and wait for the DUMP_COMPLETED event. (json-bool)
 - "begin": the starting physical address. It's optional, and should be specified
            with length together (json-int)
 - "length": the memory size, in bytes. It's optional, and should be specified
@@ -875,6 +897,30 @@ Example:
 <- { "return": { "formats":
                     ["elf", "kdump-zlib", "kdump-lzo", "kdump-snappy"] }
 
+EQMP
+
+    {
+        .name       = "query-dump",
+        .args_type  = "",
+        .params     = "",
+        .help       = "query background dump status",
+        .mhandler.cmd_new = qmp_marshal_query_dump,
+    },
+
+SQMP
+query-dump
+----------
+
+Query background dump status.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "query-dump" }
+<- { "return": { "status": "active", "completed": 1024000,
+                 "total": 2048000 } }
+
 EQMP
 
 #if defined TARGET_S390X
@@ -3310,6 +3356,9 @@ The main json-object contains the following:
 - "expected-downtime": only present while migration is active
                 total amount in ms for downtime that was calculated on
                 the last bitmap round (json-int)
+- "expected-completion-time": only present while migration is active and
+                predicted to converge, time in ms until it completes at the
+                current dirty page rate and bandwidth (json-int)
 - "ram": only present if "status" is "active", it is a json-object with the
   following RAM information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3326,6 +3375,8 @@ The main json-object contains the following:
             but this way upper levels don't need to care about page
             size (json-int)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+         - "resent": number of pages sent again after the first pass over
+            the RAM (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3523,6 +3574,9 @@ Set migration parameters
 - "compress-level": set compression level during migration (json-int)
 - "compress-threads": set compression thread count for migration (json-int)
 - "decompress-threads": set decompression thread count for migration (json-int)
+- "x-multifd-channels": set number of multifd channels (json-int)
+- "compress-method": set compression library, "zlib", "lz4" or "zstd"
+  (json-string)
 
 Arguments:
 
@@ -3536,7 +3590,9 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "x-cpu-throttle-initial:i?,x-cpu-throttle-increment:i?,"
+            "x-multifd-channels:i?,compress-method:s?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3549,6 +3605,8 @@ Query current migration parameters
          - "compress-level" : compression level value (json-int)
          - "compress-threads" : compression thread count value (json-int)
          - "decompress-threads" : decompression thread count value (json-int)
+         - "x-multifd-channels" : number of multifd channels (json-int)
+         - "compress-method" : compression library (json-string)
 
 Arguments:
 
@@ -3571,6 +3629,77 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_migrate_parameters,
     },
 
+SQMP
+query-migrate-profile
+---------------------
+
+Show where the time of the last migration went.  "save" is the last
+outgoing migration or snapshot, from the moment the guest was stopped;
+"load" is the last incoming migration.  Each has:
+
+- "total": length of the timeline in microseconds (json-int)
+- "phases": steps of the migration (json-array of json-object)
+- "devices": the state of each device (json-array of json-object); the
+  "name" is the section id and there's an "instance-id"
+
+with every entry giving its "start" and "duration" in microseconds.
+
+Example:
+
+-> { "execute": "query-migrate-profile" }
+<- { "return": {
+        "save": {
+           "total": 41830,
+           "phases": [
+              { "name": "vm-stop", "start": 12, "duration": 5220 },
+              { "name": "cpu-synchronize", "start": 5240, "duration": 310 },
+              { "name": "bitmap-sync", "start": 5561, "duration": 2890 },
+              { "name": "transfer", "start": 41500, "duration": 320 }
+           ],
+           "devices": [
+              { "name": "ram", "instance-id": 0, "start": 5555,
+                "duration": 35010 },
+              { "name": "0000:00:03.0/virtio-net", "instance-id": 0,
+                "start": 40570, "duration": 102 }
+           ]
+        }
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-migrate-profile",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_migrate_profile,
+    },
+
+SQMP
+x-migrate-profile-dump
+----------------------
+
+Write the timelines of query-migrate-profile to a file, as complete events
+of the JSON trace event format that chrome://tracing and similar viewers
+load.
+
+Arguments:
+
+- "filename": the file to write (json-string)
+
+Example:
+
+-> { "execute": "x-migrate-profile-dump",
+     "arguments": { "filename": "/tmp/migration.json" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "x-migrate-profile-dump",
+        .args_type  = "filename:F",
+        .mhandler.cmd_new = qmp_marshal_x_migrate_profile_dump,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -4033,6 +4162,48 @@ Example (1):
      ]
    }
 
+EQMP
+
+    {
+        .name       = "query-memory-hugepages",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_memory_hugepages,
+    },
+
+SQMP
+query-memory-hugepages
+----------------------
+
+Show how much of each block of guest RAM is backed by huge pages.
+
+Return a json-array of json-objects, each with:
+
+- "id": name of the RAM block (json-string)
+- "size": size of the block in bytes (json-int)
+- "hugepage-size": size of the huge pages that can back the block, 0 if
+                   there are none (json-int)
+- "hugepage-bytes": bytes of the block currently backed by huge pages
+                    (json-int)
+
+Example:
+
+-> { "execute": "query-memory-hugepages" }
+<- { "return": [
+       {
+         "id": "pc.ram",
+         "size": 4294967296,
+         "hugepage-size": 2097152,
+         "hugepage-bytes": 4116709376
+       },
+       {
+         "id": "vga.vram",
+         "size": 16777216,
+         "hugepage-size": 2097152,
+         "hugepage-bytes": 0
+       }
+     ]
+   }
+
 EQMP
 
     {
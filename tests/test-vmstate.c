@@ -482,12 +482,79 @@ static void test_load_skip(void)
     qsb_free(qsb);
 }
 
+/* Consecutive integer fields of one size are saved and loaded in bulk */
+
+typedef struct TestArrays {
+    uint16_t u16[3];
+    uint16_t u16_1;
+    uint32_t u32[2];
+    int32_t  i32_1;
+    uint8_t  u8[5];
+    uint64_t u64[2];
+} TestArrays;
+
+TestArrays obj_arrays = {
+    .u16 = { 1, 0x1234, 0xfffe },
+    .u16_1 = 0x8001,
+    .u32 = { 70000, 0xdeadbeef },
+    .i32_1 = -70000,
+    .u8 = { 1, 2, 3, 0x80, 0xff },
+    .u64 = { 12121212, 0x0123456789abcdefULL },
+};
+
+static const VMStateDescription vmstate_arrays = {
+    .name = "arrays/primitive",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16_ARRAY(u16, TestArrays, 3),
+        VMSTATE_UINT16(u16_1, TestArrays),
+        VMSTATE_UINT32_ARRAY(u32, TestArrays, 2),
+        VMSTATE_INT32(i32_1, TestArrays),
+        VMSTATE_UINT8_ARRAY(u8, TestArrays, 5),
+        VMSTATE_UINT64_ARRAY(u64, TestArrays, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+uint8_t wire_arrays[] = {
+    /* u16 */   0x00, 0x01, 0x12, 0x34, 0xff, 0xfe,
+    /* u16_1 */ 0x80, 0x01,
+    /* u32 */   0x00, 0x01, 0x11, 0x70, 0xde, 0xad, 0xbe, 0xef,
+    /* i32_1 */ 0xff, 0xfe, 0xee, 0x90,
+    /* u8 */    0x01, 0x02, 0x03, 0x80, 0xff,
+    /* u64 */   0x00, 0x00, 0x00, 0x00, 0x00, 0xb8, 0xf4, 0x7c,
+                0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+    QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+};
+
+static void obj_arrays_copy(void *target, void *source)
+{
+    memcpy(target, source, sizeof(TestArrays));
+}
+
+static void test_arrays_primitive(void)
+{
+    TestArrays obj, obj_clone;
+
+    memset(&obj, 0, sizeof(obj));
+    save_vmstate(&vmstate_arrays, &obj_arrays);
+
+    compare_vmstate(wire_arrays, sizeof(wire_arrays));
+
+    SUCCESS(load_vmstate(&vmstate_arrays, &obj, &obj_clone,
+                         obj_arrays_copy, 1, wire_arrays,
+                         sizeof(wire_arrays)));
+    SUCCESS(memcmp(&obj, &obj_arrays, sizeof(obj)));
+}
+
 int main(int argc, char **argv)
 {
     temp_fd = mkstemp(temp_file);
 
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/vmstate/simple/primitive", test_simple_primitive);
+    g_test_add_func("/vmstate/arrays/primitive", test_arrays_primitive);
     g_test_add_func("/vmstate/versioned/load/v1", test_load_v1);
     g_test_add_func("/vmstate/versioned/load/v2", test_load_v2);
     g_test_add_func("/vmstate/field_exists/load/noskip", test_load_noskip);
@@ -17,6 +17,7 @@
 #include <sys/time.h>
 #include "qemu-common.h"
 #include "include/migration/migration.h"
+#include "migration/xbzrle-internal.h"
 
 #define PAGE_SIZE 4096
 
@@ -177,6 +178,108 @@ static void test_encode_decode(void)
     }
 }
 
+/* Random changes of random length, like a guest writing into a page */
+static void fill_random_changes(uint8_t *old_buf, uint8_t *new_buf,
+                                int changes, int max_len)
+{
+    int i, j, pos, len;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_buf[i] = new_buf[i] = g_test_rand_int();
+    }
+    for (i = 0; i < changes; i++) {
+        pos = g_test_rand_int_range(0, PAGE_SIZE);
+        len = g_test_rand_int_range(1, max_len + 1);
+        for (j = pos; j < PAGE_SIZE && j < pos + len; j++) {
+            new_buf[j] = old_buf[j] + g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+static void test_encode_accel(void)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *reference = g_malloc(PAGE_SIZE);
+    int i, dlen, ref_len;
+
+    /* the vectorised run finding must not change the encoding */
+    for (i = 0; i < 10000; i++) {
+        fill_random_changes(old_buf, new_buf, g_test_rand_int_range(0, 64),
+                            g_test_rand_int_range(1, 256));
+
+        xbzrle_set_accel(false);
+        ref_len = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, reference,
+                                       PAGE_SIZE);
+        xbzrle_set_accel(true);
+        dlen = xbzrle_encode_buffer(old_buf, new_buf, PAGE_SIZE, compressed,
+                                    PAGE_SIZE);
+        g_assert(dlen == ref_len);
+        if (dlen > 0) {
+            g_assert(memcmp(compressed, reference, dlen) == 0);
+            g_assert(xbzrle_decode_buffer(compressed, dlen, old_buf,
+                                          PAGE_SIZE) <= PAGE_SIZE);
+            g_assert(memcmp(old_buf, new_buf, PAGE_SIZE) == 0);
+        }
+    }
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+    g_free(reference);
+}
+
+#define PERF_PAGES 1024
+#define PERF_ROUNDS 100
+
+static double encode_throughput(uint8_t *old_buf, uint8_t *new_buf,
+                                uint8_t *compressed)
+{
+    gint64 start = g_get_monotonic_time();
+    int i, j;
+
+    for (i = 0; i < PERF_ROUNDS; i++) {
+        for (j = 0; j < PERF_PAGES; j++) {
+            xbzrle_encode_buffer(old_buf + j * PAGE_SIZE,
+                                 new_buf + j * PAGE_SIZE, PAGE_SIZE,
+                                 compressed, PAGE_SIZE);
+        }
+    }
+
+    /* MB/s of guest pages */
+    return (double)PERF_ROUNDS * PERF_PAGES * PAGE_SIZE /
+           MAX(g_get_monotonic_time() - start, 1);
+}
+
+static void test_encode_perf(gconstpointer opaque)
+{
+    int changes = GPOINTER_TO_INT(opaque);
+    uint8_t *old_buf = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(PERF_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    double plain, accel;
+    int j;
+
+    for (j = 0; j < PERF_PAGES; j++) {
+        fill_random_changes(old_buf + j * PAGE_SIZE, new_buf + j * PAGE_SIZE,
+                            changes, 16);
+    }
+
+    xbzrle_set_accel(false);
+    plain = encode_throughput(old_buf, new_buf, compressed);
+    xbzrle_set_accel(true);
+    accel = encode_throughput(old_buf, new_buf, compressed);
+
+    g_test_message("%d changes/page: plain %.1f MB/s, accelerated %.1f MB/s",
+                   changes, plain, accel);
+    g_test_maximized_result(accel, "%.1f MB/s", accel);
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -189,6 +292,16 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
+    if (g_test_perf()) {
+        /* gtester -m perf */
+        g_test_add_data_func("/xbzrle/perf/encode_1", GINT_TO_POINTER(1),
+                             test_encode_perf);
+        g_test_add_data_func("/xbzrle/perf/encode_16", GINT_TO_POINTER(16),
+                             test_encode_perf);
+        g_test_add_data_func("/xbzrle/perf/encode_64", GINT_TO_POINTER(64),
+                             test_encode_perf);
+    }
 
     return g_test_run();
 }
@@ -58,12 +58,16 @@ extern int daemon(int, int);
 #include "sysemu/sysemu.h"
 #include "trace.h"
 #include "qemu/sockets.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/bitops.h"
 #include <sys/mman.h>
 #include <libgen.h>
 #include <setjmp.h>
 #include <sys/signal.h>
 
 #ifdef CONFIG_LINUX
+#include <sched.h>
 #include <sys/syscall.h>
 #include <sys/vfs.h>
 #endif
@@ -126,10 +130,82 @@ void *qemu_memalign(size_t alignment, size_t size)
     return qemu_oom_check(qemu_try_memalign(alignment, size));
 }
 
+/* Read once from sysfs; 0 without transparent huge pages */
+size_t qemu_thp_pagesize(void)
+{
+#ifdef __linux__
+    static size_t thp_pagesize = -1;
+    gchar *contents;
+    unsigned long long size;
+
+    if (thp_pagesize == (size_t)-1) {
+        thp_pagesize = 0;
+        if (g_file_get_contents(
+                "/sys/kernel/mm/transparent_hugepage/hpage_pmd_size",
+                &contents, NULL, NULL)) {
+            if (sscanf(contents, "%llu", &size) == 1 && is_power_of_2(size)) {
+                thp_pagesize = size;
+            }
+            g_free(contents);
+        }
+    }
+    return thp_pagesize;
+#else
+    return 0;
+#endif
+}
+
+/* Sums the huge page counters of the mappings in /proc/self/smaps */
+int64_t qemu_hugepage_bytes(void *area, size_t size)
+{
+#ifdef __linux__
+    uintptr_t start = (uintptr_t)area, end = start + size;
+    unsigned long vma_start = 0, vma_end = 0, lo, hi;
+    unsigned long long kb;
+    uint64_t total = 0;
+    char *line = NULL;
+    size_t len = 0;
+    FILE *f;
+
+    f = fopen("/proc/self/smaps", "r");
+    if (!f) {
+        return -errno;
+    }
+    while (getline(&line, &len, f) != -1) {
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            vma_start = lo;
+            vma_end = hi;
+            continue;
+        }
+        if (vma_end <= start || vma_start >= end) {
+            continue;
+        }
+        if (sscanf(line, "AnonHugePages: %llu kB", &kb) == 1 ||
+            sscanf(line, "Shared_Hugetlb: %llu kB", &kb) == 1 ||
+            sscanf(line, "Private_Hugetlb: %llu kB", &kb) == 1) {
+            lo = MAX(vma_start, start);
+            hi = MIN(vma_end, end);
+            if (hi - lo == vma_end - vma_start) {
+                total += kb * 1024;
+            } else {
+                /* The mapping goes on past the range; take its share */
+                total += (double)kb * 1024 * (hi - lo) / (vma_end - vma_start);
+            }
+        }
+    }
+    free(line);
+    fclose(f);
+    return total;
+#else
+    return -ENOTSUP;
+#endif
+}
+
 /* alloc shared memory pages */
 void *qemu_anon_ram_alloc(size_t size, uint64_t *alignment)
 {
-    size_t align = QEMU_VMALLOC_ALIGN;
+    /* Align to transparent huge pages even where they aren't 2 MiB */
+    size_t align = MAX(QEMU_VMALLOC_ALIGN, qemu_thp_pagesize());
     void *ptr = qemu_ram_mmap(-1, size, align, false);
 
     if (ptr == MAP_FAILED) {
@@ -333,7 +409,26 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+/* Pages a thread touches between updates of the shared count */
+#define MEM_PREALLOC_BATCH 64
+
+typedef struct MemPreallocThread {
+    QemuThread thread;
+    char *addr;
+    size_t numpages;
+    size_t hpagesize;
+    bool shared;
+    /* Shared by all the threads */
+    size_t *touched;
+    bool *failed;
+    QemuSemaphore *done;
+#ifdef CONFIG_LINUX
+    bool bind;
+    cpu_set_t cpus;
+#endif
+} MemPreallocThread;
+
+static __thread sigjmp_buf sigjump;
 
 static void sigbus_handler(int signal)
 {
@@ -360,11 +455,107 @@ static size_t fd_getpagesize(int fd)
     return getpagesize();
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory)
+#ifdef CONFIG_LINUX
+/* The CPUs of a host NUMA node, from a list such as "0-7,16-23" */
+static bool host_node_cpus(int node, cpu_set_t *cpus)
+{
+    char *path, *contents, *p, *end;
+    unsigned long first, last;
+
+    CPU_ZERO(cpus);
+    path = g_strdup_printf("/sys/devices/system/node/node%d/cpulist", node);
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        g_free(path);
+        return false;
+    }
+    g_free(path);
+
+    for (p = contents; *p && *p != '\n'; p = end) {
+        first = last = strtoul(p, &end, 10);
+        if (end == p) {
+            break;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+        }
+        for (; first <= last && first < CPU_SETSIZE; first++) {
+            CPU_SET(first, cpus);
+        }
+        if (*end == ',') {
+            end++;
+        }
+    }
+    g_free(contents);
+    return CPU_COUNT(cpus) > 0;
+}
+#endif
+
+static void *do_mem_prealloc(void *opaque)
+{
+    MemPreallocThread *t = opaque;
+    sigset_t set;
+    size_t i, batch = 0;
+
+#ifdef CONFIG_LINUX
+    /* Not being able to run there only costs speed */
+    if (t->bind) {
+        sched_setaffinity(0, sizeof(t->cpus), &t->cpus);
+    }
+#endif
+
+    /* unblock SIGBUS */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+    if (sigsetjmp(sigjump, 1)) {
+        atomic_set(t->failed, true);
+    } else {
+        /*
+         * MAP_POPULATE silently ignores failures.  A read fault is enough
+         * to allocate a page of a shared mapping, and unlike writing back
+         * what's there it can't undo a write of another QEMU using the
+         * same file, e.g. the source of an x-ignore-shared migration.
+         */
+        for (i = 0; i < t->numpages; i++) {
+            volatile char *p = t->addr + (t->hpagesize * i);
+
+            if (t->shared) {
+                (void)*p;
+            } else {
+                *p = *p;
+            }
+            if (++batch == MEM_PREALLOC_BATCH) {
+                atomic_add(t->touched, batch);
+                batch = 0;
+            }
+        }
+        atomic_add(t->touched, batch);
+    }
+
+    qemu_sem_post(t->done);
+    return NULL;
+}
+
+void os_mem_prealloc(int fd, char *area, size_t memory, bool shared,
+                     int threads, const unsigned long *host_nodes,
+                     MemPreallocProgress *progress, void *opaque)
 {
     int ret;
     struct sigaction act, oldact;
-    sigset_t set, oldset;
+    size_t hpagesize = fd_getpagesize(fd);
+    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
+    size_t touched = 0, start = 0;
+    bool failed = false;
+    QemuSemaphore done;
+    MemPreallocThread *t;
+    int nr_nodes = 0, cpus = 0, running, i;
+    unsigned long node;
+#ifdef CONFIG_LINUX
+    cpu_set_t node_cpus[MAX_NODES];
+    bool node_ok[MAX_NODES];
+#endif
 
     memset(&act, 0, sizeof(act));
     act.sa_handler = &sigbus_handler;
@@ -376,32 +567,81 @@ void os_mem_prealloc(int fd, char *area, size_t memory)
         exit(1);
     }
 
-    /* unblock SIGBUS */
-    sigemptyset(&set);
-    sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+    if (host_nodes) {
+        for (node = find_first_bit(host_nodes, MAX_NODES); node < MAX_NODES;
+             node = find_next_bit(host_nodes, MAX_NODES, node + 1)) {
+#ifdef CONFIG_LINUX
+            node_ok[nr_nodes] = host_node_cpus(node, &node_cpus[nr_nodes]);
+            if (node_ok[nr_nodes]) {
+                cpus += CPU_COUNT(&node_cpus[nr_nodes]);
+            }
+#endif
+            nr_nodes++;
+        }
+    }
 
-    if (sigsetjmp(sigjump, 1)) {
+    if (threads <= 0) {
+        if (!cpus) {
+            cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        threads = MIN(MAX(cpus, 1), MEM_PREALLOC_MAX_THREADS);
+    }
+    threads = MAX(MIN(threads, numpages), 1);
+
+    /*
+     * Each thread touches a contiguous part, and consecutive threads run on
+     * the same node, so that the part of a node is contiguous too
+     */
+    qemu_sem_init(&done, 0);
+    t = g_new0(MemPreallocThread, threads);
+    for (i = 0; i < threads; i++) {
+        t[i].numpages = numpages / threads + (i < numpages % threads);
+        t[i].addr = area + start * hpagesize;
+        t[i].hpagesize = hpagesize;
+        t[i].touched = &touched;
+        t[i].shared = shared;
+        t[i].failed = &failed;
+        t[i].done = &done;
+#ifdef CONFIG_LINUX
+        if (nr_nodes && node_ok[i * nr_nodes / threads]) {
+            t[i].bind = true;
+            t[i].cpus = node_cpus[i * nr_nodes / threads];
+        }
+#endif
+        start += t[i].numpages;
+        qemu_thread_create(&t[i].thread, "mem-prealloc", do_mem_prealloc,
+                           &t[i], QEMU_THREAD_JOINABLE);
+    }
+    trace_os_mem_prealloc(area, memory, hpagesize, threads, nr_nodes);
+
+    for (running = threads; running; ) {
+        if (qemu_sem_timedwait(&done, 1000) == 0) {
+            running--;
+        } else if (progress) {
+            progress(opaque, MIN(atomic_read(&touched) * hpagesize, memory),
+                     memory);
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        qemu_thread_join(&t[i].thread);
+    }
+    g_free(t);
+    qemu_sem_destroy(&done);
+
+    if (failed) {
         fprintf(stderr, "os_mem_prealloc: Insufficient free host memory "
                         "pages available to allocate guest RAM\n");
         exit(1);
-    } else {
-        int i;
-        size_t hpagesize = fd_getpagesize(fd);
-        size_t numpages = DIV_ROUND_UP(memory, hpagesize);
-
-        /* MAP_POPULATE silently ignores failures */
-        for (i = 0; i < numpages; i++) {
-            memset(area + (hpagesize * i), 0, 1);
-        }
+    }
 
-        ret = sigaction(SIGBUS, &oldact, NULL);
-        if (ret) {
-            perror("os_mem_prealloc: failed to reinstall signal handler");
-            exit(1);
-        }
+    ret = sigaction(SIGBUS, &oldact, NULL);
+    if (ret) {
+        perror("os_mem_prealloc: failed to reinstall signal handler");
+        exit(1);
+    }
 
-        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (progress) {
+        progress(opaque, memory, memory);
     }
 }
 
@@ -79,6 +79,16 @@ void *qemu_anon_ram_alloc(size_t size, uint64_t *align)
     return ptr;
 }
 
+size_t qemu_thp_pagesize(void)
+{
+    return 0;
+}
+
+int64_t qemu_hugepage_bytes(void *area, size_t size)
+{
+    return -ENOTSUP;
+}
+
 void qemu_vfree(void *ptr)
 {
     trace_qemu_vfree(ptr);
@@ -462,7 +472,9 @@ size_t getpagesize(void)
     return system_info.dwPageSize;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory)
+void os_mem_prealloc(int fd, char *area, size_t memory, bool shared,
+                     int threads, const unsigned long *host_nodes,
+                     MemPreallocProgress *progress, void *opaque)
 {
     int i;
     size_t pagesize = getpagesize();
@@ -471,6 +483,9 @@ void os_mem_prealloc(int fd, char *area, size_t memory)
     for (i = 0; i < memory / pagesize; i++) {
         memset(area + pagesize * i, 0, 1);
     }
+    if (progress) {
+        progress(opaque, memory, memory);
+    }
 }
 
 
@@ -211,6 +211,10 @@ static QemuOptsList machine_opts = {
             .name = "firmware",
             .type = QEMU_OPT_STRING,
             .help = "firmware image",
+        },{
+            .name = "numa-split-ram",
+            .type = QEMU_OPT_BOOL,
+            .help = "Set on to allocate the RAM of each NUMA node separately",
         },{
             .name = "iommu",
             .type = QEMU_OPT_BOOL,